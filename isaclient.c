@@ -11,11 +11,22 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// SIMD scanning is compiled for x86-64, other CPUs use the scalar version
+#ifdef __x86_64__
+#define SCAN_X86
+#include <immintrin.h>
+#endif
 
 #define BUFFER 1024 // buffer length
-#define HLP_MSG "\nUsage: ./isaclient -H <host> -p <port> <command> \nboards\nboard add<name>\nboard delete<name>\nboard list<name>\nitem add<name><content>\nitem delete<name><id>\nitem update<name><id><content>\n"
+#define HLP_MSG "\nUsage: ./isaclient -H <host> -p <port> <command> \nboards\nboard add<name>\nboard delete<name>\nboard list<name> [--offset <n>] [--limit <n>] [--tail <n>] [--since <version>]\nboard watch<name> [--since <version>]\nitem add<name><content>\nitem delete<name><id>\nitem update<name><id><content>\nitem insert<name><id><content>\nitem batch<name><file>\nexport<file>\nimport<file>\nsearch<terms> [<board>]\n"
 #define CMD_ERR "Incorrect command!\n"
 #define NO_ID -1
+#define CACHE_DIR ".isaclient" // listings with their ETags, in the home directory
+#define MAX_TAG 64
+#define FILE_BUFFER 65536 // block of an exported or imported file
 
 #define STR_LEN_INC 8
 
@@ -29,18 +40,48 @@ typedef struct
     int allocSize;
 } string;
 
+// Scanners selected by the CPU features
+int (*scanChar)(const char *buf, int length, char c);
+int (*scanHeaderEnd)(const char *buf, int length);
+
+void initScan();
+int scanCharScalar(const char *buf, int length, char c);
+int scanHeaderEndScalar(const char *buf, int length);
+#ifdef SCAN_X86
+int scanCharSse2(const char *buf, int length, char c);
+int scanHeaderEndSse2(const char *buf, int length);
+int scanCharAvx2(const char *buf, int length, char c);
+int scanHeaderEndAvx2(const char *buf, int length);
+#endif
+
 void handleArguments(int argc, char *argv[]);
-char *handleCommands(int argc, char *argv[]);
+char *handleOptions(int *argc, char *argv[]);
+char *handleCommands(int argc, char *argv[], char query[]);
 char *createRequest(char type[], char url[], char name[], char host[], int id, char content[]);
+void searchUrl(char url[], char terms[], char board[]);
 void nameCheck(char name[]);
 void numCheck(char argv[]);
-void getContent(char buffer[], string *content);
+bool responseComplete(string *response, int *chunkPos);
+int getHeader(char buffer[], int length, const char *name);
+int getContentLength(char buffer[], int length);
+bool isChunked(char buffer[], int length);
+bool decodeChunks(char buffer[], int length, int *pos, string *content);
+int getContent(char buffer[], int length, string *content);
+bool getETag(char buffer[], int length, char etag[]);
+bool cachePath(char path[], char host[], char port[], char request[]);
+bool loadCache(char path[], char etag[], string *content);
+void saveCache(char path[], char etag[], string *content);
+void appendFile(string *request, char path[]);
+int openImport(string *request, char path[]);
+void sendFile(int sock, int fd);
+int saveExport(int sock, char path[]);
 
 int strInit(string *s);
 void strFree(string *s);
 int *string_concat(string *s1, const char *s2);
 void strClear(string *s);
 int strAddChar(string *s1, char c);
+int strAddData(string *s1, const char *data, int length);
 
 int main(int argc, char *argv[])
 {
@@ -50,17 +91,46 @@ int main(int argc, char *argv[])
     struct hostent *servent; // a pointer to the server addresses
     char buffer[BUFFER];
     int returnCode = 0;
+    int importFd = -1;
 
     string request;
     strInit(&request);
+    initScan();
+
+    // Argument handling, options are removed from the arguments
+    char *query = handleOptions(&argc, argv);
 
-    // Argument handling
     if (argc > 10 || argc < 2)
         errx(1, "%s", HLP_MSG);
     else
     {
         handleArguments(argc, argv);
-        string_concat(&request, handleCommands(argc, argv));
+        string_concat(&request, handleCommands(argc, argv, query));
+
+        // Operations of the batch are sent from the file
+        if (argc == 9 && strcmp(argv[6], "batch") == 0)
+            appendFile(&request, argv[8]);
+
+        // Import is sent straight from the file after the headers
+        if (argc == 7 && strcmp(argv[5], "import") == 0)
+            importFd = openImport(&request, argv[6]);
+    }
+
+    // Listings are kept with their ETags, the server sends only changed ones
+    char cacheFile[BUFFER];
+    char etag[MAX_TAG];
+    string cached;
+    strInit(&cached);
+    bool cacheable = cachePath(cacheFile, argv[2], argv[4], request.str);
+
+    if (cacheable && loadCache(cacheFile, etag, &cached))
+    {
+        // Header goes before the empty line ending the request
+        request.length -= 2;
+        request.str[request.length] = '\0';
+        string_concat(&request, "If-None-Match: ");
+        string_concat(&request, etag);
+        string_concat(&request, "\r\n\r\n");
     }
 
     // Erase the server and local address structure
@@ -103,27 +173,50 @@ int main(int argc, char *argv[])
     if (getsockname(sock, (struct sockaddr *)&local, &len) == -1)
         err(1, "getsockname() failed");
 
-    // Buffer fit error checking
-    if (request.length >= BUFFER)
+    // Send http request to server, content of a batch can be long
+    for (int sent = 0; sent < request.length; sent += i)
     {
-        err(1, "Message is too long!");
+        i = write(sock, request.str + sent, request.length - sent);
+        if (i == -1)
+        {
+            err(1, "initial write() failed");
+        }
     }
-    else
+
+    if (importFd != -1)
     {
-        strcpy(buffer, request.str);
+        sendFile(sock, importFd);
+        close(importFd);
     }
 
-    // Send http request to server
-    i = write(sock, buffer, request.length);
-    if (i == -1)
+    // Export is written to the file while it arrives
+    if (argc == 7 && strcmp(argv[5], "export") == 0)
+    {
+        returnCode = saveExport(sock, argv[6]);
+        close(sock);
+        return returnCode;
+    }
+
+    // Read the response until the headers and the whole content arrive
+    string response;
+    strInit(&response);
+    int chunkPos = 0;
+
+    while ((i = read(sock, buffer, BUFFER)) > 0)
     {
-        err(1, "initial write() failed");
+        strAddData(&response, buffer, i);
+
+        if (responseComplete(&response, &chunkPos))
+            break;
     }
 
-    // Read an initial string
-    if ((i = read(sock, buffer, BUFFER)) == -1)
+    if (i == -1)
+    {
+        err(1, "read() failed");
+    }
+    else if (response.length == 0)
     {
-        err(1, "initial read() failed");
+        errx(1, "Server closed the connection");
     }
     else
     {
@@ -133,24 +226,37 @@ int main(int argc, char *argv[])
         strInit(&content);
         strInit(&headers);
 
-        // Get the exact answer without random characters
-        sprintf(buffer, "%.*s", i, buffer);
-
-        getContent(buffer, &content);
+        int headerLength = getContent(response.str, response.length, &content);
 
-        // Get headers from the response
-        char tmp[BUFFER];
-        memcpy(tmp, &buffer[0], strlen(buffer) - content.length - 2);
-        tmp[strlen(buffer) - content.length - 2] = '\0';
-        string_concat(&headers, tmp);
+        // Get headers from the response, the empty line is printed only before content
+        if (content.length == 0)
+            headerLength -= 2;
+        strAddData(&headers, response.str, headerLength);
 
         // Get code from header
-        char codeChar[4];
-        strncpy(codeChar, headers.str + 9, 3);
+        char codeChar[4] = "";
+        if (headers.length > 12)
+            strncpy(codeChar, headers.str + 9, 3);
         int code = atoi(codeChar);
 
+        // Listing did not change, the cached copy is printed,
+        // a new listing replaces it
+        if (cacheable && code == 304)
+        {
+            strClear(&content);
+            strAddData(&content, cached.str, cached.length);
+        }
+        else if (cacheable && code == 200 && getETag(response.str, headerLength, etag))
+        {
+            saveCache(cacheFile, etag, &content);
+        }
+        else if (cacheable && code == 404)
+        {
+            unlink(cacheFile);
+        }
+
         // Set returnCode when unsuccessful
-        if (code != 200 && code != 201)
+        if (code != 200 && code != 201 && code != 304)
         {
             returnCode = 1;
         }
@@ -164,62 +270,485 @@ int main(int argc, char *argv[])
         strFree(&headers);
     }
 
+    strFree(&response);
+    strFree(&cached);
+
     // Close the socket
     close(sock);
     return returnCode;
 }
 
+// Check if the response contains the headers and Content-Length bytes of content
+// or all chunks of the chunked content
+// chunkPos keeps the start of the first chunk not checked yet, so every chunk
+// is checked only once while the response grows
+bool responseComplete(string *response, int *chunkPos)
+{
+    int end = scanHeaderEnd(response->str, response->length);
+
+    if (end == -1)
+        return false;
+
+    int headerLength = end + 4;
+
+    if (isChunked(response->str, headerLength))
+    {
+        if (*chunkPos < headerLength)
+            *chunkPos = headerLength;
+        return decodeChunks(response->str, response->length, chunkPos, NULL);
+    }
+
+    return response->length - headerLength >= getContentLength(response->str, headerLength);
+}
+
+// Find the header, returns the position of its value or -1
+// Headers are searched line by line, only the line starts are compared
+int getHeader(char buffer[], int length, const char *name)
+{
+    int pos = 0, end;
+    int nameLength = strlen(name);
+
+    while (pos < length)
+    {
+        if ((end = scanChar(buffer + pos, length - pos, '\n')) == -1)
+            end = length - pos;
+
+        if (end > nameLength && strncasecmp(buffer + pos, name, nameLength) == 0)
+            return pos + nameLength;
+
+        pos += end + 1;
+    }
+
+    return -1;
+}
+
+// Get content length from Content-Length header
+int getContentLength(char buffer[], int length)
+{
+    int pos = getHeader(buffer, length, "Content-Length:");
+
+    return pos == -1 ? 0 : atoi(buffer + pos);
+}
+
+// Check if the content is sent with Transfer-Encoding: chunked
+bool isChunked(char buffer[], int length)
+{
+    int pos = getHeader(buffer, length, "Transfer-Encoding:");
+
+    if (pos == -1)
+        return false;
+
+    while (buffer[pos] == ' ')
+        pos++;
+    return strncasecmp(buffer + pos, "chunked", 7) == 0;
+}
+
+// Decode chunks from the position, their data are appended to content
+// (if it is not NULL)
+// Position is moved after the complete chunks, returns true after the last one
+bool decodeChunks(char buffer[], int length, int *pos, string *content)
+{
+    while (*pos < length)
+    {
+        int end = scanChar(buffer + *pos, length - *pos, '\n');
+
+        if (end == -1)
+            return false;
+
+        // Size line is in hex, extensions after ';' are ignored
+        long size = strtol(buffer + *pos, NULL, 16);
+        int data = *pos + end + 1;
+
+        // Last chunk ends with an empty line (trailers are not sent)
+        if (size == 0)
+            return length - data >= 2;
+
+        if (length - data < size + 2)
+            return false;
+
+        if (content != NULL)
+            strAddData(content, buffer + data, size);
+        *pos = data + size + 2;
+    }
+
+    return false;
+}
+
 // Get content from message
-void getContent(char buffer[], string *content)
+// Returns the length of the headers including the empty line
+int getContent(char buffer[], int length, string *content)
+{
+    int end = scanHeaderEnd(buffer, length);
+
+    // Headers were not finished, there is no content
+    if (end == -1)
+        return length;
+
+    int headerLength = end + 4;
+
+    // Chunks are joined to the content
+    strClear(content);
+    if (isChunked(buffer, headerLength))
+    {
+        decodeChunks(buffer, length, &headerLength, content);
+        return end + 4;
+    }
+
+    int cl = getContentLength(buffer, headerLength);
+
+    // Cut content from message according to content length
+    if (cl > length - headerLength)
+        cl = length - headerLength;
+    if (cl > 0)
+        strAddData(content, buffer + headerLength, cl);
+
+    return headerLength;
+}
+
+// Get the ETag header of the response, returns false when it is missing
+bool getETag(char buffer[], int length, char etag[])
+{
+    int pos = getHeader(buffer, length, "ETag:");
+    int end;
+
+    if (pos == -1)
+        return false;
+
+    while (buffer[pos] == ' ')
+        pos++;
+    for (end = pos; end < length && buffer[end] != '\r' && buffer[end] != '\n'; end++)
+        ;
+
+    if (end == pos || end - pos >= MAX_TAG)
+        return false;
+
+    memcpy(etag, buffer + pos, end - pos);
+    etag[end - pos] = '\0';
+    return true;
+}
+
+// Get the cache file of the GET request: ~/.isaclient/host_port_url,
+// characters of the url other than letters and digits are written in hex
+// Returns false when the request is not a listing or there is no cache
+bool cachePath(char path[], char host[], char port[], char request[])
+{
+    const char *home = getenv("HOME");
+    struct passwd *pw;
+
+    // Answer of a watch or an export is not a listing to keep
+    if (strncmp(request, "GET ", 4) != 0 || strstr(request, "/watch") != NULL || strncmp(request, "GET /boards/export ", 19) == 0)
+        return false;
+
+    if (home == NULL && (pw = getpwuid(getuid())) != NULL)
+        home = pw->pw_dir;
+    if (home == NULL)
+        return false;
+
+    int length = snprintf(path, BUFFER, "%s/%s", home, CACHE_DIR);
+    if (length >= BUFFER - 200 || (mkdir(path, 0700) == -1 && errno != EEXIST))
+        return false;
+
+    length += snprintf(path + length, BUFFER - length, "/%.64s_%.8s_", host, port);
+
+    for (char *c = request + 4; *c != ' ' && *c != '\0' && length < BUFFER - 4; c++)
+    {
+        if (isalnum(*c))
+            path[length++] = *c;
+        else
+            length += sprintf(path + length, "%%%02x", (unsigned char)*c);
+    }
+    path[length] = '\0';
+
+    return true;
+}
+
+// Load the cached listing, the first line of the file is its ETag
+// Returns false when nothing is cached
+bool loadCache(char path[], char etag[], string *content)
 {
-    int cl = 0;
-    bool isCl = false;
-    char c;
+    FILE *f = fopen(path, "r");
+    char buffer[BUFFER];
+    size_t length;
 
-    string word;
-    strInit(&word);
+    if (f == NULL)
+        return false;
 
-    // Get content length from Content-Length header
-    for (int i = 0; i <= strlen(buffer); i++)
+    if (fgets(etag, MAX_TAG, f) == NULL || etag[0] != '"' || etag[strlen(etag) - 1] != '\n')
     {
-        c = buffer[i];
+        fclose(f);
+        return false;
+    }
+    etag[strlen(etag) - 1] = '\0';
+
+    while ((length = fread(buffer, 1, BUFFER, f)) > 0)
+        strAddData(content, buffer, length);
+
+    fclose(f);
+    return true;
+}
+
+// Save the listing with its ETag, the file is replaced at once,
+// so other clients never read a part of it
+void saveCache(char path[], char etag[], string *content)
+{
+    char tmpPath[BUFFER + 16];
+    FILE *f;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, getpid());
+    if ((f = fopen(tmpPath, "w")) == NULL)
+        return;
+
+    fprintf(f, "%s\n", etag);
+    fwrite(content->str, 1, content->length, f);
+
+    if (fclose(f) != 0 || rename(tmpPath, path) == -1)
+        unlink(tmpPath);
+}
 
-        if (c == ' ' || c == '\0' || c == '\n')
+// Append the file as the content of the request, the request ends with the headers
+void appendFile(string *request, char path[])
+{
+    char buffer[BUFFER];
+    string content;
+    size_t length;
+    FILE *f;
+
+    if ((f = fopen(path, "rb")) == NULL)
+        err(1, "%s", path);
+
+    strInit(&content);
+    while ((length = fread(buffer, 1, BUFFER, f)) > 0)
+        strAddData(&content, buffer, length);
+    fclose(f);
+
+    if (content.length == 0)
+        errx(1, "%s is empty", path);
+
+    // Headers go before the empty line ending the request
+    request->length -= 2;
+    request->str[request->length] = '\0';
+    sprintf(buffer, "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n", content.length);
+    string_concat(request, buffer);
+    strAddData(request, content.str, content.length);
+    strFree(&content);
+}
+
+// Open the file of the import and add its length to the request
+// Returns the descriptor, the content is sent by sendFile
+int openImport(string *request, char path[])
+{
+    char headers[100];
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+        err(1, "%s", path);
+
+    // Headers go before the empty line ending the request
+    request->length -= 2;
+    request->str[request->length] = '\0';
+    sprintf(headers, "Content-Type: application/x-ndjson\r\nContent-Length: %lld\r\n\r\n", (long long)st.st_size);
+    string_concat(request, headers);
+    return fd;
+}
+
+// Send the file as the content of the request, it is not read to the memory
+void sendFile(int sock, int fd)
+{
+    char buffer[FILE_BUFFER];
+    ssize_t length, sent, i;
+
+    while ((length = read(fd, buffer, FILE_BUFFER)) > 0)
+    {
+        for (sent = 0; sent < length; sent += i)
         {
-            if (isCl)
-            {
-                cl = atoi(word.str);
-                isCl = false;
-            }
-            else
-            {
-                if (strcmp(word.str, "Content-Length:") == 0)
-                {
-                    isCl = true;
-                }
-            }
-            strClear(&word);
+            if ((i = write(sock, buffer + sent, length - sent)) == -1)
+                err(1, "write() failed");
         }
-        else
+    }
+
+    if (length == -1)
+        err(1, "read() failed");
+}
+
+// Write the chunks of the export to the file as they arrive
+// Headers are printed, returns 0 when the whole export was saved
+int saveExport(int sock, char path[])
+{
+    char buffer[FILE_BUFFER];
+    string response, content;
+    int headerLength = -1, pos = 0, length;
+    bool done = false;
+    FILE *f;
+
+    if ((f = fopen(path, "wb")) == NULL)
+        err(1, "%s", path);
+
+    strInit(&response);
+    strInit(&content);
+
+    while (!done && (length = read(sock, buffer, FILE_BUFFER)) > 0)
+    {
+        strAddData(&response, buffer, length);
+
+        if (headerLength == -1)
         {
-            strAddChar(&word, c);
+            int end = scanHeaderEnd(response.str, response.length);
+            if (end == -1)
+                continue;
+
+            headerLength = pos = end + 4;
+            fprintf(stderr, "%.*s", headerLength - 2, response.str);
+
+            if (!isChunked(response.str, headerLength))
+                break;
         }
+
+        done = decodeChunks(response.str, response.length, &pos, &content);
+        if (fwrite(content.str, 1, content.length, f) != (size_t)content.length)
+            err(1, "%s", path);
+        strClear(&content);
+
+        // Written chunks are not kept
+        memmove(response.str, response.str + pos, response.length - pos + 1);
+        response.length -= pos;
+        pos = 0;
     }
 
-    // Cut content from message according to content length
-    if (cl != 0)
+    fclose(f);
+    strFree(&response);
+    strFree(&content);
+
+    if (!done)
+    {
+        fprintf(stderr, "Export was not finished!\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Find the first occurrence of the character, returns its index or -1
+// Scalar version used on CPUs without SIMD and for the tails of buffers
+int scanCharScalar(const char *buf, int length, char c)
+{
+    for (int i = 0; i < length; i++)
+    {
+        if (buf[i] == c)
+            return i;
+    }
+    return -1;
+}
+
+// Find the end of headers (CRLF CRLF), returns index of its first CR or -1
+int scanHeaderEndScalar(const char *buf, int length)
+{
+    for (int i = 0; i + 3 < length; i++)
     {
-        char cntnt[BUFFER];
-        strClear(content);
+        if (buf[i] == '\r' && buf[i + 1] == '\n' && buf[i + 2] == '\r' && buf[i + 3] == '\n')
+            return i;
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+// SSE2 is available on every x86-64 CPU, 16 bytes are compared at once
+int scanCharSse2(const char *buf, int length, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    int i = 0, found;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    found = scanCharScalar(buf + i, length - i, c);
+    return found == -1 ? -1 : i + found;
+}
+
+// Every position is compared with all 4 bytes of CRLF CRLF using shifted loads
+int scanHeaderEndSse2(const char *buf, int length)
+{
+    __m128i cr = _mm_set1_epi8('\r');
+    __m128i lf = _mm_set1_epi8('\n');
+    int i = 0, found;
+
+    for (; i + 19 <= length; i += 16)
+    {
+        __m128i m = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), cr),
+                                  _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), lf));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 2)), cr));
+        m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 3)), lf));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    found = scanHeaderEndScalar(buf + i, length - i);
+    return found == -1 ? -1 : i + found;
+}
 
-        int poz = strlen(buffer) - cl - 2;
-        memcpy(cntnt, &buffer[poz], cl);
-        cntnt[cl] = '\0';
+// AVX2 versions compare 32 bytes at once, compiled for AVX2 only
+// and selected at runtime when the CPU supports it
+__attribute__((target("avx2"))) int scanCharAvx2(const char *buf, int length, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    int i = 0, found;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    found = scanCharSse2(buf + i, length - i, c);
+    return found == -1 ? -1 : i + found;
+}
+
+__attribute__((target("avx2"))) int scanHeaderEndAvx2(const char *buf, int length)
+{
+    __m256i cr = _mm256_set1_epi8('\r');
+    __m256i lf = _mm256_set1_epi8('\n');
+    int i = 0, found;
 
-        string_concat(content, cntnt);
+    for (; i + 35 <= length; i += 32)
+    {
+        __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), cr),
+                                     _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), lf));
+        m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 2)), cr));
+        m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 3)), lf));
+        unsigned int mask = _mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
     }
 
-    strFree(&word);
+    found = scanHeaderEndSse2(buf + i, length - i);
+    return found == -1 ? -1 : i + found;
+}
+#endif
+
+// Select the fastest scanner supported by the CPU
+void initScan()
+{
+    scanChar = scanCharScalar;
+    scanHeaderEnd = scanHeaderEndScalar;
+
+#ifdef SCAN_X86
+    scanChar = scanCharSse2;
+    scanHeaderEnd = scanHeaderEndSse2;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scanChar = scanCharAvx2;
+        scanHeaderEnd = scanHeaderEndAvx2;
+    }
+#endif
 }
 
 // Program argument error checking
@@ -232,8 +761,47 @@ void handleArguments(int argc, char *argv[])
     }
 }
 
+// Handle --offset, --limit, --tail and --since options of board list and watch
+// Options are removed from the arguments, returns the query for the url
+char *handleOptions(int *argc, char *argv[])
+{
+    static char query[100];
+    int i = 5;
+
+    query[0] = '\0';
+
+    // Content of item commands can look like an option
+    if (*argc < 8 || strcmp(argv[5], "board") != 0 || (strcmp(argv[6], "list") != 0 && strcmp(argv[6], "watch") != 0))
+        return query;
+
+    while (i < *argc)
+    {
+        if (strcmp(argv[i], "--offset") != 0 && strcmp(argv[i], "--limit") != 0 && strcmp(argv[i], "--tail") != 0 && strcmp(argv[i], "--since") != 0)
+        {
+            i++;
+            continue;
+        }
+
+        if (i + 1 >= *argc)
+        {
+            fprintf(stderr, "%s", CMD_ERR);
+            exit(1);
+        }
+        numCheck(argv[i + 1]);
+
+        // ?offset=10&limit=5
+        sprintf(query + strlen(query), "%c%s=%d", query[0] == '\0' ? '?' : '&', argv[i] + 2, atoi(argv[i + 1]));
+
+        for (int j = i; j + 2 < *argc; j++)
+            argv[j] = argv[j + 2];
+        *argc -= 2;
+    }
+
+    return query;
+}
+
 // Handle program commands, return the request
-char *handleCommands(int argc, char *argv[])
+char *handleCommands(int argc, char *argv[], char query[])
 {
     static char request[BUFFER];
 
@@ -253,11 +821,46 @@ char *handleCommands(int argc, char *argv[])
         }
         break;
 
+    // GET /boards/export
+    // POST /import
+    // GET /search?q=terms
+    case 7:
+        if (strcmp(argv[5], "export") == 0)
+        {
+            strcpy(request, createRequest("GET", "/boards/export", "", argv[2], NO_ID, ""));
+        }
+        else if (strcmp(argv[5], "search") == 0)
+        {
+            char url[BUFFER];
+            searchUrl(url, argv[6], "");
+            strcpy(request, createRequest("GET", url, "", argv[2], NO_ID, ""));
+        }
+        else if (strcmp(argv[5], "import") == 0)
+        {
+            // Content is sent from the file by main
+            strcpy(request, createRequest("POST", "/import", "", argv[2], NO_ID, ""));
+        }
+        else
+        {
+            fprintf(stderr, "%s", CMD_ERR);
+            exit(1);
+        }
+        break;
+
     // POST /boards/name
     // DELETE /boards/name
     // GET /boards/name
+    // GET /board/name/watch
+    // GET /search?q=terms&board=name
     case 8:
-        if (strcmp(argv[5], "board") == 0)
+        if (strcmp(argv[5], "search") == 0)
+        {
+            char url[BUFFER];
+            nameCheck(argv[7]);
+            searchUrl(url, argv[6], argv[7]);
+            strcpy(request, createRequest("GET", url, "", argv[2], NO_ID, ""));
+        }
+        else if (strcmp(argv[5], "board") == 0)
         {
             if (strcmp(argv[6], "add") == 0)
             {
@@ -272,7 +875,20 @@ char *handleCommands(int argc, char *argv[])
             else if (strcmp(argv[6], "list") == 0)
             {
                 nameCheck(argv[7]);
-                strcpy(request, createRequest("GET", "/board", argv[7], argv[2], NO_ID, ""));
+
+                // Query follows the name in the url
+                char name[BUFFER];
+                snprintf(name, BUFFER - 200, "%s%s", argv[7], query);
+                strcpy(request, createRequest("GET", "/board", name, argv[2], NO_ID, ""));
+            }
+            else if (strcmp(argv[6], "watch") == 0)
+            {
+                nameCheck(argv[7]);
+
+                // Server answers when the board changes, 304 after a timeout
+                char name[BUFFER];
+                snprintf(name, BUFFER - 200, "%s/watch%s", argv[7], query);
+                strcpy(request, createRequest("GET", "/board", name, argv[2], NO_ID, ""));
             }
             else
             {
@@ -289,6 +905,7 @@ char *handleCommands(int argc, char *argv[])
 
     // POST /board/name
     // DELETE /board/name/id
+    // POST /board/name/batch
     case 9:
         if (strcmp(argv[5], "item") == 0)
         {
@@ -304,6 +921,15 @@ char *handleCommands(int argc, char *argv[])
 
                 strcpy(request, createRequest("POST", "/board", argv[7], argv[2], NO_ID, argv[8]));
             }
+            else if (strcmp(argv[6], "batch") == 0)
+            {
+                nameCheck(argv[7]);
+
+                // Content is appended from the file by main
+                char name[BUFFER];
+                snprintf(name, BUFFER - 200, "%s/batch", argv[7]);
+                strcpy(request, createRequest("POST", "/board", name, argv[2], NO_ID, ""));
+            }
             else
             {
                 fprintf(stderr, "%s", CMD_ERR);
@@ -317,7 +943,7 @@ char *handleCommands(int argc, char *argv[])
         }
         break;
 
-    // PUT /board/name/id
+    // PUT /board/name/id, POST /board/name/id
     case 10:
         if (strcmp(argv[5], "item") == 0)
         {
@@ -328,6 +954,13 @@ char *handleCommands(int argc, char *argv[])
 
                 strcpy(request, createRequest("PUT", "/board", argv[7], argv[2], atoi(argv[8]), argv[9]));
             }
+            else if (strcmp(argv[6], "insert") == 0)
+            {
+                nameCheck(argv[7]);
+                numCheck(argv[8]);
+
+                strcpy(request, createRequest("POST", "/board", argv[7], argv[2], atoi(argv[8]), argv[9]));
+            }
             else
             {
                 fprintf(stderr, "%s", CMD_ERR);
@@ -350,6 +983,25 @@ char *handleCommands(int argc, char *argv[])
     return request;
 }
 
+// Create the url of the search, bytes of the terms other than letters
+// and digits are sent as %XX, too long terms are cut
+void searchUrl(char url[], char terms[], char board[])
+{
+    int length = sprintf(url, "/search?q=");
+
+    for (int i = 0; terms[i] != '\0' && length < BUFFER - 300; i++)
+    {
+        if (isalnum((unsigned char)terms[i]))
+            url[length++] = terms[i];
+        else
+            length += sprintf(url + length, "%%%02X", (unsigned char)terms[i]);
+    }
+    url[length] = '\0';
+
+    if (board[0] != '\0')
+        sprintf(url + length, "&board=%s", board);
+}
+
 // Create request based on program command
 char *createRequest(char type[], char url[], char name[], char host[], int id, char content[])
 {
@@ -369,13 +1021,16 @@ char *createRequest(char type[], char url[], char name[], char host[], int id, c
         sprintf(request, "%s %s/%s HTTP/1.1\r\nHost: %s\r\n", type, url, name, host);
     }
 
-    // Append content if there is any
+    // One request per connection, server can close it after the response
+    strcat(request, "Connection: close\r\n");
+
+    // Append content if there is any, request ends with the content
     if (content[0] != '\0')
     {
-        char ctHeaders[100] = "Content-Type: text/plain\r\n";
-        sprintf(ctHeaders, "%sContent-Length: %ld\r\n\r\n", ctHeaders, strlen(content));
+        char ctHeaders[100];
+        sprintf(ctHeaders, "Content-Type: text/plain\r\nContent-Length: %ld\r\n\r\n", strlen(content));
         strcat(request, ctHeaders);
-        strcat(request, content);
+        return strcat(request, content);
     }
     return strcat(request, "\r\n");
 }
@@ -467,3 +1122,18 @@ int *string_concat(string *s1, const char *s2)
     s1->length += length_const_char;
     return STR_SUCCESS;
 }
+
+// Function appends length bytes of data to the string
+int strAddData(string *s1, const char *data, int length)
+{
+    if (s1->length + length + 1 >= s1->allocSize)
+    {
+        if ((s1->str = (char *)realloc(s1->str, s1->length + length + 1)) == NULL)
+            return STR_ERROR;
+        s1->allocSize = s1->length + length + 1;
+    }
+    memcpy(&s1->str[s1->length], data, length);
+    s1->length += length;
+    s1->str[s1->length] = '\0';
+    return STR_SUCCESS;
+}
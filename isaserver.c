@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // CPU affinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,119 +10,1189 @@
 #include <err.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <limits.h>
+#include <time.h>
+#include <math.h>
+
+// SIMD scanning is compiled for x86-64, other CPUs use the scalar version
+#ifdef __x86_64__
+#define SCAN_X86
+#include <immintrin.h>
+#endif
 
 #define BUFFER 1024 // buffer for incoming messages
 #define MAX_NAME 20
-#define QUEUE 1 // queue length for  waiting connections
-#define USG_MSG "Usage:  ./isaserver [-p , -h] <port>\n"
-#define HLP_MSG "HELP:  ./isaserver [-p , -h] <port>\n"
+#define QUEUE SOMAXCONN // queue length for  waiting connections
+#define MAX_EVENTS 64   // events returned by one epoll_wait()
+#define MAX_HEADER 8192 // longest accepted request line with headers
+#define MAX_HEADERS 32  // headers remembered from one request
+#define MAX_SEGMENTS 4  // segments of the longest route path
+#define NO_ROUTE -1
+#define MAX_TAG 48    // quoted ETag of a listing
+#define MAX_MATCH 256 // longer If-None-Match is ignored
+#define MAX_EXTRA 256 // headers of the response added by the handler
+#define USG_MSG "Usage:  ./isaserver [-p , -t , -s , -c , -w , -d , -g , -z , -i , -f , -h] <port> [<threads>] [<shards>] [<KB>] [<file>] [<mode>] [<ms>] [<MB>] [<s>] [<host>:<port>]\n"
+#define HLP_MSG "HELP:  ./isaserver [-p , -t , -s , -c , -w , -d , -g , -z , -i , -f , -h] <port> [<threads>] [<shards>] [<KB>] [<file>] [<mode>] [<ms>] [<MB>] [<s>] [<host>:<port>]\n" \
+                "  -p <port>     port where the server is waiting\n" \
+                "  -t <threads>  serve connections with a pool of worker threads\n" \
+                "  -s <shards>   one pinned listener per shard, boards partitioned by name\n" \
+                "  -c <KB>       memory for cached listings (default 16384, 0 disables)\n" \
+                "  -w <file>     write-ahead log of the changes, replayed at startup\n" \
+                "  -d <mode>     durability of the log: batch (fsync before the responses),\n" \
+                "                interval (fsync every window) or none (default batch)\n" \
+                "  -g <ms>       group commit window of the log (default 2)\n" \
+                "  -z <MB>       snapshot the boards to the mapped store when the log grows by <MB>\n" \
+                "                (default 64, 0 disables)\n" \
+                "  -i <s>        snapshot the boards every <s> seconds when the log changed (default 0 - never)\n" \
+                "  -f <host>:<port>  read replica of the primary with a log (also --follow),\n" \
+                "                changes are redirected to the primary\n"
 
 // Request codes
 #define RQ_OK 200
+#define RQ_PARTIAL 206
 #define RQ_CREATED 201
 #define RQ_NOT_FOUND 404
 #define RQ_EXISTS 409
 #define RQ_CL 400
+#define RQ_NOT_MODIFIED 304
+#define RQ_REDIRECT 307
+#define RQ_GONE 410
+#define RQ_RANGE 416 // window of the Range header is outside of the board
+#define RQ_BROKEN 500 // stored posts of the board are corrupted
+#define RQ_STREAM 1 // 200 with the listing sent in chunks
+#define RQ_WATCH 2  // connection waits for a change of the board
+#define RQ_EXPORT 3 // 200 with all boards as NDJSON sent in chunks
+#define RQ_SHIP 4   // connection is handed to the thread shipping the log to a follower
+
+// Counted B+ tree of posts
+#define NODE_MAX 64 // items of a leaf or children of an inner node
+#define NODE_MIN 32 // smaller nodes are merged or filled from a sibling
+
+// Arena of board posts
+#define ARENA_MIN 1024      // first chunk of posts of a board
+#define ARENA_MAX 65536     // chunks grow up to this size
+#define NODE_CHUNK_MAX 64   // nodes in the largest chunk of tree nodes
+#define COMPACT_STEP 16     // posts moved by one step of the compaction
+
+// Hash index of boards
+#define TABLE_MIN 16       // initial number of slots
+#define MIGRATE_STEP 16    // old slots moved to the new table per operation
+#define TOMBSTONE ((tBoardPtr)1) // slot of a deleted board
+
+// Messages between shards
+#define MSG_REQUEST 1    // request for a board owned by another shard
+#define MSG_REPLY 2      // response created by the owner of the board
+#define MSG_LIST 3       // names of boards owned by the shard
+#define MSG_LIST_REPLY 4 // names of boards sent back to the asking shard
+#define MSG_CHUNK 5      // next chunk of a streamed listing
+#define MSG_CHUNK_REPLY 6
+#define MSG_EVENT 7      // change of a board for its watchers
+#define MSG_UNWATCH 8    // watcher of another shard left the board
+#define MSG_IMPORT 9     // imported posts of a board owned by another shard
+#define MSG_IMPORT_REPLY 10
+#define ALL_SHARDS -1
+#define LOCAL_SHARD -2 // route without a board, the shard of the connection answers
 
 // String
 #define STR_LEN_INC 8
 #define STR_ERROR 1
 #define STR_SUCCESS 0
+#define POOL_SIZE 64        // spare buffers kept by a loop
+#define POOL_MAX_ALLOC 65536 // larger buffers are freed instead of kept
+#define REF_MIN 256         // longer posts are sent from the arena, not copied
+#define MAX_IOV 64          // segments written by one writev()
+
+// Cache of rendered listings
+#define CACHE_DEFAULT 16384 // KB of cached listings
+
+// Change log of a board
+#define CHANGE_LOG 256  // last changes kept for GET /board/name?since=
+#define CH_INSERT '+'   // new post on the ID
+#define CH_CHANGE '='   // new content of the post with the ID
+#define CH_DELETE '-'   // post with the ID was deleted
+
+// Write-ahead log
+#define WAL_BATCH 0    // responses wait for fsync of their group
+#define WAL_INTERVAL 1 // fsync once per window, responses do not wait
+#define WAL_NONE 2     // records are only written, the system flushes them
+#define WAL_WINDOW 2   // ms of the group commit window
+#define WAL_HEADER 8   // length and CRC-32 of a frame
+#define W_NEW_BOARD 'B'
+#define W_DELETE_BOARD 'D'
+#define W_INSERT 'I'
+#define W_CHANGE 'C'
+#define W_DELETE 'X'
+#define W_BASE 'G'        // first frame of the log, generation of the store it continues
+#define W_POSITION 'P'    // shipped to the followers only, generation and offset of the next frame
+#define W_HEARTBEAT 'H'   // shipped to the followers only, end of the log of the primary
+#define SNAPSHOT_SIZE 64      // MB the log grows by before the snapshot
+#define SNAPSHOT_BLOCK 1048576 // records of the snapshot are written in blocks of this size
+#define SNAPSHOT_OFFSETS 8192  // offsets of the posts written to the tables at once
+#define STORE_MAGIC "ISAS"
+#define STORE_GEN 0xFFFFFFFF  // generation of the records in the store, arenas never reach it
+#define SNAPSHOT_POLL 10      // ms between checks of the running snapshot
+
+// Replication
+#define SHIP_BLOCK 65536    // bytes of the store or the log read for one send
+#define SHIP_HEARTBEAT 100  // ms between the heartbeats of the stream
+#define SHIP_TIMEOUT 60     // s a send to a stalled follower can block
+#define FOLLOW_TIMEOUT 5    // s without data from the primary, the connection is opened again
+#define FOLLOW_RETRY 1000   // ms before the follower connects again
+
+// Watchers of boards
+#define WATCH_TIMEOUT 30000 // ms of a long-poll without a change, 304 is sent
+
+// Streamed listings of posts
+#define STREAM_POSTS 4096 // larger boards are sent with chunked encoding
+#define STREAM_CHUNK 16384 // bytes of posts in one chunk
+
+// Bulk import of boards
+#define IMPORT_BUFFER 1048576 // received content waiting for processing, more is not read
+#define IMPORT_CHUNK 65536    // bytes of posts applied to a board (sent to its owner) at once
+#define IMPORT_RESERVE 67108864 // largest chunk of an arena reserved for imported posts
+
+// Full-text search
+#define TERM_MAX 32      // longer words are indexed by their first bytes
+#define MAX_TERMS 8      // terms of one search
+#define BLOCK_POSTS 128  // postings of one block of a posting list
+#define INDEX_MIN 1024   // gone posts in the postings before the index is rebuilt
+#define INDEX_CHUNK_MAX 1048576 // largest chunk of the terms and postings of a board
+#define SEARCH_LIMIT 20  // hits of a search without ?limit=
+#define SEARCH_MAX 1000  // most hits of one search
+#define BM25_K1 1.2      // saturation of the count of a term in a post
+#define BM25_B 0.75      // weight of the length of the post (its terms)
+
+// Request parser states
+#define P_START 0   // empty lines before the request line
+#define P_LINE 1    // request line
+#define P_HEADER 2  // header lines until the empty line
+#define P_CONTENT 3 // Content-Length bytes of content
+
+// Request methods
+#define M_OTHER 0
+#define M_GET 1
+#define M_POST 2
+#define M_PUT 3
+#define M_DELETE 4
+
+// Part of the request message, the message is not copied
+typedef struct
+{
+    int pos;
+    int length;
+} tSlice;
 
-// Request structure
+// Window of a listing from the query (offset, limit, tail) or Range header
+// -1 - not given, first and last are IDs resolved with the board size
+// since asks only for the changes after the version
+typedef struct
+{
+    int offset;
+    int limit;
+    int tail;
+    int first;
+    int last;
+    int since;
+    bool range; // window of the Range header, answered with 206 and Content-Range
+} tWindow;
+
+// Request structure, filled incrementally by parseRequest
+// All positions are relative to the start of the request message
 typedef struct
 {
-    char type[7];
-    char url[20];
+    int state; // parser state, the parser continues from it when more data comes
+    int pos;   // start of the line being parsed
+    int scan;  // part of the line already searched for its end
+    int method;
+    tSlice url;
+    tSlice query;                   // part of the url after '?'
+    int route;                      // matched route or NO_ROUTE
+    tSlice params[MAX_SEGMENTS];    // parameters of the route (:name, :id)
+    tSlice headers[MAX_HEADERS][2]; // name and value of the headers
+    int headerCount;
     bool ct;
     int cl;
+    int contentPos; // start of the content in the request message
+    bool http10;    // HTTP/1.0 request, connection is closed by default
+    bool close;     // connection is closed after the response
+    bool keepAlive; // Connection: keep-alive
+    tWindow window; // posts of GET /board/name
+    char match[MAX_MATCH]; // If-None-Match, empty when not sent
+    char etag[MAX_TAG];    // ETag of the response, empty when not sent
+    char extra[MAX_EXTRA]; // more headers of the response
+    int from;              // loop of the connection
+    bool sse;              // Accept: text/event-stream
+    unsigned int watching; // creation of the watched board, 0 - no watch
 } tRqst;
 
-tRqst rqst;
-
-// Linked lists for boards and board items
+// Linked list for boards, B+ tree for board items
+// Post is a record of its length in the arena of the board
 typedef struct tElem
 {
-    struct tElem *nPtr;
-    struct tElem *pPtr;
-    char data[BUFFER];
+    unsigned int length;
+    unsigned int gen; // generation of the arena the record was written in
+    char data[];      // content ended by '\0'
 } * tElemPtr;
 
+// Change of a board, the ID is the one at the time of the change
+typedef struct
+{
+    unsigned int version; // version of the board after the change
+    int id;
+    char type; // CH_INSERT, CH_CHANGE or CH_DELETE
+} tChange;
+
+// Line of an import, a board or a post of the last board
+typedef struct
+{
+    bool board;
+    char name[MAX_NAME];
+    int reserve;    // space of the posts of the board
+    char *post;     // content unescaped in place
+    int postLength;
+} tImportLine;
+
+// Block of memory of an arena, records or nodes are bumped into it
+typedef struct tChunk
+{
+    struct tChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} tChunk;
+
+// Mapped store, the boards created from it keep it mapped while responses
+// can refer to their posts, a follower replaces it by the store of a new stream
+typedef struct
+{
+    char *map;
+    size_t size;
+    atomic_int refs; // store being loaded and the pins of its boards
+} tMapping;
+
+// Chunks of an arena referenced by responses waiting for sending
+// The arena holds one reference itself, chunks freed by the arena while
+// other references exist are kept until they are released
+typedef struct tPin
+{
+    atomic_int refs;
+    pthread_mutex_t lock; // protects chunks
+    tChunk *chunks;       // chunks waiting for the release of the references
+    bool owned;           // owner (arena, cache entry) holds a reference
+    tMapping *mapping;    // store with the posts of the arena, NULL - none
+} tPin;
+
+// Memory of one board, the whole arena is freed with the board
+// Space of deleted or changed posts is reclaimed by the compaction,
+// it moves live posts to new chunks a few at a time and then frees
+// chunks of the old generation
+// Every generation has its own pin, so references to the records of one
+// generation do not keep the chunks of the others
+typedef struct
+{
+    tChunk *chunks;      // records of the current generation
+    tChunk *old;         // records of the previous generation, NULL - no compaction
+    tChunk *nodes;       // nodes of the tree
+    struct tNode *free;  // released nodes, linked by next
+    unsigned int gen;
+    size_t live;         // bytes of live records
+    size_t dead;         // bytes of released records in chunks
+    int cursor;          // position of the next post for the compaction
+    tPin *pin;           // references of responses to the chunks
+    tPin *oldPin;        // references to the records of the previous generation
+    struct tNode **leaves; // leaf of every post by its document ID, NULL - the post is gone
+    unsigned int docs;     // document IDs given out
+    unsigned int docAlloc;
+} tArena;
+
+// Rendered body of GET /board/name or GET /boards
+// Entry is valid while its version is the version of the board (list)
+typedef struct tCacheEntry
+{
+    unsigned int version;
+    int length;
+    tChunk *chunk;                   // the body
+    tPin *pin;                       // references of responses to the body
+    struct tCacheEntry **slot;       // pointer to the entry in the board (list)
+    struct tCacheEntry *nPtr;        // LRU list, the most recent first
+    struct tCacheEntry *pPtr;
+} * tCachePtr;
+
+// Cached listings of one list of boards, the least recently used ones are
+// evicted when they would take more than the budget
+typedef struct
+{
+    tCachePtr First;
+    tCachePtr Last;
+    size_t size;          // bytes of cached bodies
+    size_t budget;
+    pthread_mutex_t lock; // protects the entries and their slots
+} tCache;
+
+// Node of the counted B+ tree, posts are in the leaves in their order
+// Every node knows the number of posts in its subtree, so the post
+// on a position is found by one descent from the root
+// Leaves keep the document IDs of their posts and nodes their parents,
+// so the search finds the position of a post from its document
+typedef struct tNode
+{
+    bool leaf;
+    int count;            // items of a leaf or children of an inner node
+    int size;             // posts in the subtree
+    struct tNode *next;   // next leaf, leaves are linked for listing
+    struct tNode *parent; // NULL - root
+    union
+    {
+        struct tNode *children[NODE_MAX + 1]; // one more for the split
+        tElemPtr items[NODE_MAX + 1];
+    };
+    unsigned int docs[NODE_MAX + 1]; // document IDs of the items of a leaf
+} * tNodePtr;
+
+// Blocks of a posting list start with a skip entry, the search jumps over
+// the blocks of documents smaller than the one it looks for
+typedef struct
+{
+    unsigned int first; // document of the first posting of the block
+    int offset;         // start of the block in the data
+} tSkip;
+
+// Posting list of a term, the documents containing it in ascending order
+// Posting is the varint delta from the previous document of the block
+// followed by the varint count of the term in the document
+typedef struct tTerm
+{
+    struct tTerm *next; // next term of the bucket
+    unsigned int hash;
+    int length;
+    char text[TERM_MAX];
+    int count;          // postings, also the ones of gone posts
+    int docs;           // posts containing the term
+    unsigned int gone;  // last gone document taken from docs, plus one
+    unsigned int last;  // document of the last posting
+    int tail;           // offset of the count of the last posting
+    unsigned char *data;
+    int size;
+    int alloc;
+    tSkip *skips;
+    int skipCount;
+    int skipAlloc;
+} * tTermPtr;
+
+// Inverted index of the posts of a board
+// Every new or changed post is a new document, documents of changed and
+// deleted posts stay in the posting lists and the search skips them until
+// they outnumber the posts, then the index is built again
+// Terms and their postings are bumped into chunks, so a deleted board frees
+// its index by the chunks, a grown posting list leaves its previous copy
+// in them until the rebuild
+typedef struct
+{
+    tChunk *chunks;    // terms, postings and skips
+    tTermPtr *buckets; // chained hash table of the terms
+    int size;          // buckets, power of two, 0 before the first term
+    int terms;
+    int dead;          // gone documents in the postings
+    unsigned int *lengths; // terms of every document, the length of BM25
+    unsigned int lengthAlloc;
+    size_t total;      // terms of the posts, for their average length
+} tIndex;
+
 typedef struct tBoard
 {
     char name[MAX_NAME];
-    tElemPtr First;
-    tElemPtr Last;
+    unsigned int hash; // hash of the name, compared before the name
+    int nameLength;
+    pthread_rwlock_t lock; // protects posts of the board
+    tArena arena;          // posts and nodes of the tree
+    tNodePtr posts;        // root of the tree of posts
+    tIndex index;          // terms of the posts for GET /search
+    unsigned int version;  // changed by every change of posts
+    unsigned int created;  // version of the list when the board was created
+    tCachePtr cache;       // rendered listing
+    tChange *changes;      // ring of the last changes, NULL before the first one
+    int changeCount;
+    int changeNext;        // slot of the next change
+    unsigned int base;     // version before the oldest change of the ring
+    atomic_int *_Atomic watching; // watchers of the board per loop, NULL before the first one
+    const uint64_t *stored; // offsets of the posts in the mapped store
+    int storedCount;
+    atomic_bool unloaded;   // tree of the stored posts is built on the first use
+    atomic_bool unindexed;  // index of the stored posts is built on the first search
+    atomic_bool broken;     // stored posts are corrupted, the board is not served
     struct tBoard *nPtr;
     struct tBoard *pPtr;
 } * tBoardPtr;
 
+// Open addressing hash table of boards with linear probing
+typedef struct
+{
+    tBoardPtr *slots; // NULL - empty, TOMBSTONE - deleted board
+    int size;         // power of two
+    int used;         // boards and tombstones
+} tTable;
+
 // List structure
+// Boards are kept in the list for the stable order of GET /boards
+// and in the hash index for lookups by name
 typedef struct
 {
     tBoardPtr First;
+    tTable table; // index of boards
+    tTable old;   // previous index, boards are moved from it step by step
+    int migrated; // slots of old already moved to table
+    int count;    // number of boards
+    unsigned int version; // changed by new and deleted boards
+    atomic_uint clock;    // last version given to a board
+    tCachePtr cached;     // rendered list of boards
+    tCache cache;
+    bool shared;           // list is used by more threads, locking is enabled
+    pthread_rwlock_t lock; // protects the directory of boards
 } tList;
 
+// Server configuration from program arguments
+typedef struct
+{
+    int port;
+    int threads; // 0 = single event loop in the main thread
+    int shards;  // 0 = no sharding, else one loop with own list per shard
+    int cache;   // KB of cached listings, shards divide it
+    char *wal;   // write-ahead log, NULL - changes are not persisted
+    int walMode; // WAL_BATCH, WAL_INTERVAL or WAL_NONE
+    int walWindow; // ms of the group commit window
+    int snapshotSize;     // MB, 0 - snapshots are not triggered by the size
+    int snapshotInterval; // s, 0 - snapshots are not triggered by the time
+    char *follow;         // <host>:<port> of the primary, NULL - the server is not a follower
+} tConfig;
+
+tConfig config;
+unsigned int bootId; // part of ETags, tags of older runs do not match
+
+// Data outside of the string sent as its part, it is not copied
+typedef struct
+{
+    int at;           // position in the string the data is inserted to
+    const char *data;
+    int length;
+    tPin *pin;        // keeps the data allocated
+} tRef;
+
 // String structure
+// Data of references are part of the string too, they are sent by writev()
 typedef struct
 {
     char *str;
     int length;
     int allocSize;
+    tRef *refs;
+    int refCount;
+    int refAlloc;
+    int refLength; // total length of the references
 } string;
 
-void initList(tList *L);
+// Terms of GET /search, hits contain all of them
+typedef struct
+{
+    char terms[MAX_TERMS][TERM_MAX];
+    int lengths[MAX_TERMS];
+    int count;
+    char board[MAX_NAME]; // empty - all boards
+    int limit;
+} tQuery;
+
+// Position in a posting list during the search
+typedef struct
+{
+    tTermPtr term;
+    int block;        // skip entry of the block being read
+    int pos;          // next posting in the data
+    int end;          // end of the block
+    unsigned int doc; // current posting
+    int count;        // occurrences of the term in the document
+} tCursor;
+
+// Post found by the search, the line is "board/id. content"
+typedef struct
+{
+    uint64_t key; // score, the better hit has the larger one
+    const char *line;
+    int length;
+} tHit;
+
+// Best hits of the search, a heap with the worst hit on the top,
+// lines are rendered only for the hits which get to it
+typedef struct
+{
+    tHit *hits;
+    string *lines;  // lines of the hits
+    int count;
+    int limit;
+    int matched;    // all posts containing the terms
+    string scratch; // line of the next candidate
+} tHits;
+
+// Header of the store, the file of the boards written by the snapshot
+// Directory of the boards follows, then the tables of the offsets of their
+// posts and the records of the posts in the layout of tElem, so the posts
+// are used right from the mapped pages
+typedef struct
+{
+    char magic[4];
+    uint32_t gen;    // log of this generation continues the store
+    uint64_t skip;   // bytes of the log of the previous generation in the store
+    uint32_t boards;
+    uint32_t reserved;
+} tStoreHeader;
+
+// Board in the directory of the store
+typedef struct
+{
+    uint64_t table;  // offset of the table of the offsets of the posts
+    uint32_t posts;
+    uint32_t nameLength;
+    char name[MAX_NAME];
+} tStoreBoard;
+
+// Store mapped at startup, its boards keep it mapped, changes go
+// to the boards in memory and the next snapshot merges them to a new store
+typedef struct
+{
+    unsigned int gen;
+    uint64_t skip;
+    char *path;
+} tStore;
+
+// Write-ahead log, loops append frames of the changes to the pending buffer
+// and the log thread writes them in groups
+// Positions in the log (LSN) are the ends of the frames, they keep growing
+// when a snapshot replaces the beginning of the file
+// Snapshot is the store written by a forked child from its copy of the boards,
+// the loops pause only for the fork(), then it replaces the store and the
+// frames logged since the fork replace the log
+typedef struct
+{
+    int fd;                 // -1 - no log
+    bool active;            // changes are logged, false during the replay
+    pthread_mutex_t lock;   // protects pending, frames and appended
+    pthread_cond_t cond;    // frames were appended
+    string pending;         // frames waiting for write()
+    int frames;             // frames in pending
+    unsigned long appended; // end of the last appended frame
+    atomic_ulong durable;   // end of the frames the responses can rely on
+    pthread_t thread;
+    unsigned long origin;   // LSN of the beginning of the file
+    off_t size;             // bytes written to the file
+    off_t compacted;        // size of the file after the last snapshot
+    unsigned int gen;       // generation of the store the log continues
+    char *snapshotPath;     // file the child writes the snapshot to
+    char *snapshotBlock;    // buffers of the child, allocated before the fork()
+    uint64_t *snapshotOffsets;
+    char *newPath;          // new log written before the rename
+    pid_t snapshot;         // running child, 0 - none
+    unsigned long snapshotLsn; // LSN of the boards in the snapshot
+    long long snapshotAt;   // ms of the last snapshot
+    atomic_bool pausing;    // loops stop at the barriers for the fork()
+    pthread_barrier_t paused;
+    pthread_barrier_t resumed;
+    pthread_mutex_t shipLock; // protects the files, gen and shipped for the shipping threads
+    pthread_cond_t shipCond;  // more frames can be shipped
+    off_t shipped;            // end of the durable frames in the file, the followers get them
+    off_t shipSkip;           // part of the previous file the last snapshot replaced
+} tWal;
+
+// Snapshot being written by the child, the records are collected in the block
+// and the offsets of the posts in the part of the tables not written yet
+typedef struct
+{
+    int fd;
+    char *block;
+    int used;
+    uint64_t written;  // offset of the block in the file
+    uint64_t *offsets;
+    int offsetCount;
+    uint64_t table;    // offset of the first of the offsets in the file
+} tSnapshot;
+
+// Follower served by a shipping thread, it gets the store first when it is new,
+// then the frames of the log from its position
+typedef struct
+{
+    int fd;             // socket of the follower
+    int file;           // log being shipped
+    int storeFd;        // store of a new follower, -1 - the follower continues
+    unsigned int gen;   // generation of the log
+    off_t pos;          // offset of the next frame in the log
+    unsigned int primaryGen; // end of the log of the primary for the heartbeat
+    off_t primaryEnd;
+    string buffer;
+} tShip;
+
+// Read replica, the follower thread applies the stream of the primary
+// Position is the generation and the offset in the log of the primary,
+// the follower continues from it after a broken connection
+typedef struct
+{
+    char *host;
+    char *port;
+    tList *L;              // boards of the follower, shards take theirs by the name
+    bool positioned;       // position is known, the primary continues from it
+    atomic_uint gen;
+    atomic_ullong offset;  // end of the applied frames
+    atomic_ullong end;     // end of the log of the primary from the last heartbeat
+    uint64_t target;       // end from a heartbeat the follower did not reach yet
+    long long targetAt;    // ms the heartbeat came, 0 - no target
+    atomic_llong current;  // ms the follower had all frames the primary had
+    atomic_bool connected;
+    string buffer;         // received data not applied yet
+} tFollow;
+
+tWal wal;
+tStore store;
+tFollow follow;
+uint32_t crcTable[256];
+_Thread_local unsigned long walLsn; // end of the last frame appended by the thread in batch mode
+_Thread_local string walFrame;      // frame being built by the thread
+_Thread_local bool walGroup;        // changes are collected to one frame
+
+// Path segment of a route, compiled from its pattern
+typedef struct
+{
+    const char *text;
+    int length;
+    bool param; // segment starting with ':' matches any text
+} tSegment;
+
+// Route of the API, maps method and path pattern to the handler
+typedef struct
+{
+    int method;
+    const char *pattern;
+    int (*handler)(tList *L, tRqst *rqst, char msg[], string *body);
+    bool allShards; // route needs boards of all shards
+    int segmentCount;
+    tSegment segments[MAX_SEGMENTS];
+} tRoute;
+
+// Client connection state
+typedef struct tConn
+{
+    int fd;
+    string in;  // received data waiting for processing
+    string out; // response data waiting for sending
+    int outPos; // already sent part of out, without the references
+    int refPos; // next reference of out to send
+    int refOff; // already sent part of the reference
+    int inPos;  // start of the first unprocessed request in in
+    tRqst rqst; // request being parsed
+    int pending;   // replies expected from other shards
+    string gather; // board names collected from the shards, posts of an import
+    unsigned int gatherVersion; // sum of the list versions of the shards
+    bool eof;      // client will not send more data or asked to close
+    string body;   // body of the response being created
+    struct tLoop *loop; // loop of the connection, its pool gets the buffers back
+    bool streaming;     // listing of a board is sent in chunks
+    char streamName[MAX_NAME];
+    int streamPos;      // ID of the next post of the listing
+    int streamLast;     // ID of the last post of the listing
+    struct tWatch *watch;    // board the connection waits for, NULL - no watch
+    struct tConn *watchNext; // other watchers of the board in the loop
+    struct tConn *watchPrev;
+    struct tConn *pollNext;  // long-poll watchers of the loop by deadline
+    struct tConn *pollPrev;
+    long long deadline;      // end of the long-poll in ms
+    bool sse;                // events are sent until the connection is closed
+    bool watchClose;         // request of the long-poll asked to close
+    bool watchHttp10;
+    unsigned long walWait;   // end of the log the responses wait for
+    bool walWaiting;         // connection is parked until the log is on the disk
+    struct tConn *walNext;   // connections of the loop waiting for the log
+    struct tConn *walPrev;
+    bool exporting;          // stream goes through the boards collected in gather
+    int exportPos;           // next board name in gather
+    bool importing;          // content of an import is processed while it arrives
+    bool throttled;          // import content waits in the socket until there is room
+    int importLeft;          // bytes of the content not processed yet
+    char importName[MAX_NAME]; // board of the imported posts, posts collected in gather
+    int importReserve;       // space of the board line not applied yet, -1 - none
+    int importBoards;        // counts for the answer
+    int importPosts;
+    int importErrors;
+} * tConnPtr;
+
+// Board watched by connections of a loop
+typedef struct tWatch
+{
+    char name[MAX_NAME];
+    unsigned int created; // creation of the board, a new board is another one
+    tConnPtr conns;
+    struct tWatch *next;
+} tWatch;
+
+// Message sent to another shard
+typedef struct tMsg
+{
+    struct tMsg *_Atomic next;
+    int type;
+    struct tLoop *from; // shard waiting for the reply
+    tConnPtr conn;      // connection of the sending shard
+    tRqst rqst;         // parsed request
+    string data;        // request message, response or board names
+    char name[MAX_NAME]; // board of a streamed listing
+    int pos;            // ID of the next post of the listing, 0 - no stream
+    int last;           // ID of the last post of the listing
+    unsigned int version; // version of the list of a MSG_LIST_REPLY or the board
+    unsigned int created; // creation of the board of MSG_EVENT and MSG_UNWATCH
+    bool deleted;         // MSG_EVENT of a deleted board
+    bool full;            // MSG_EVENT has the whole listing, not the changes
+    bool json;            // MSG_CHUNK of an export
+    unsigned long lsn;    // reply waits for the log up to this position
+    tPin *pin;            // reference to the event
+    const char *event;    // SSE event followed by the long-poll body
+    int sseLength;
+    int pollLength;
+} * tMsgPtr;
+
+// Lock-free multiple producer, single consumer queue of messages
+typedef struct
+{
+    tMsgPtr _Atomic head; // last pushed message, producers swap it
+    tMsgPtr tail;         // next message to pop, only the consumer uses it
+    struct tMsg stub;
+} tQueue;
+
+// Event loop, each worker thread runs its own
+typedef struct tLoop
+{
+    int id;
+    int efd;          // epoll instance
+    int fd;           // listening socket (shared or own with SO_REUSEPORT)
+    tList *L;         // board store
+    pthread_t thread; // worker running the loop
+    int evfd;         // eventfd waking the loop when a message arrives
+    tQueue queue;     // messages from other shards
+    tList list;       // boards owned by the shard
+    string pool[POOL_SIZE]; // spare buffers for connections and messages
+    int poolCount;
+    string body;      // body of a response for another shard
+    tMsgPtr freeMsgs; // messages for reuse, linked by next
+    tWatch *watches;  // boards watched by connections of the loop
+    tConnPtr polls;   // long-poll watchers, the first deadline first
+    tConnPtr pollsLast;
+    tConnPtr walWaiters;  // connections waiting for the log
+    atomic_int walWaiting; // their count, the log thread wakes the loop
+} tLoop;
+
+tLoop *loops;
+int loopCount;
+_Thread_local tLoop *currentLoop; // loop of the thread, writers notify watchers from it, searches use its pool
+
+// Scanner selected by the CPU features
+int (*scanChar)(const char *buf, int length, char c);
+
+void initScan();
+int scanCharScalar(const char *buf, int length, char c);
+#ifdef SCAN_X86
+int scanCharSse2(const char *buf, int length, char c);
+int scanCharAvx2(const char *buf, int length, char c);
+#endif
+
+void initList(tList *L, bool shared);
+void lockList(tList *L, bool write);
+void lockCache(tList *L);
+void unlockCache(tList *L);
+bool cacheGet(tList *L, tCachePtr *slot, unsigned int version, string *str);
+void cachePut(tList *L, tCachePtr *slot, unsigned int version, string *str);
+void cacheEvict(tList *L, tCachePtr entry);
+void unlockList(tList *L);
+bool lockBoard(tList *L, tBoardPtr B, bool write);
+void unlockBoard(tList *L, tBoardPtr B);
 int newBoard(tList *L, char name[]);
 int deleteBoard(tList *L, char name[]);
 int deletePost(tList *L, char name[], int id);
 tBoardPtr findByName(tList *L, char name[]);
-tElemPtr findById(tBoardPtr B, int id);
-int newPost(tList *L, char name[], char content[]);
-int getBoards(tList *L, string *str);
-int getPosts(tList *L, char name[], string *str);
-int changePost(tList *L, char name[], int id, char content[]);
-void createResponse(tList *L, string *response, char buffer[]);
+void initTable(tTable *T, int size);
+tBoardPtr *tableFind(tTable *T, unsigned int hash, const char *name, int length);
+void tableInsert(tTable *T, tBoardPtr B);
+void indexInsert(tList *L, tBoardPtr B);
+void indexRemove(tList *L, tBoardPtr B);
+void migrateIndex(tList *L, int steps);
+tElemPtr *findById(tBoardPtr B, int id);
+int newPost(tList *L, char name[], char content[], int length);
+int insertPost(tList *L, char name[], int id, char content[], int length);
+int getBoards(tList *L, string *str, unsigned int *version);
+int getPosts(tList *L, char name[], string *str, tRqst *rqst);
+void logChange(tList *L, tBoardPtr B, char type, int id);
+void recordChange(tBoardPtr B, unsigned int version, char type, int id);
+void listChanges(tBoardPtr B, unsigned int since, string *str, bool sse);
+int boardInsert(tBoardPtr B, int id, char content[], int length);
+bool boardChange(tBoardPtr B, int id, char content[], int length);
+bool boardDelete(tBoardPtr B, int id);
+int batchPosts(tList *L, char name[], char ops[], int length, string *str);
+int importPosts(tList *L, char name[], int reserve, char records[], int length, int *created);
+bool exportChunk(tList *L, char name[], int *pos, string *str);
+int beginChunk(string *str);
+void endChunk(string *str, int sizeLine, int start);
+int watchBoard(tList *L, char name[], string *str, tRqst *rqst);
+void unwatchBoard(tList *L, char name[], unsigned int created, int loop);
+void notifyWatchers(tList *L, tBoardPtr B, unsigned int since, bool deleted);
+bool getPostsChunk(tList *L, char name[], int *pos, int last, string *str);
+int listPosts(tBoardPtr B, int id, int last, string *str, int limit);
+int changePost(tList *L, char name[], int id, char content[], int length);
+int createResponse(tList *L, tRqst *rqst, string *response, char buffer[], string *body);
+void initRoutes();
+void matchRoute(tRqst *rqst, char msg[]);
+bool paramName(char msg[], tSlice param, char name[]);
+int paramId(char msg[], tSlice param);
+int sliceNumber(char msg[], tSlice slice);
+bool parseWindow(tRqst *rqst, char msg[], tWindow *w);
+bool parseSearch(tRqst *rqst, char msg[], tQuery *q);
+bool numberParam(tRqst *rqst, char msg[], const char *name, int *number);
+bool queryParam(tRqst *rqst, char msg[], const char *name, tSlice *value);
+int urlDecode(const char *src, int length, char dest[]);
+int handleGetBoards(tList *L, tRqst *rqst, char msg[], string *body);
+int handleNewBoard(tList *L, tRqst *rqst, char msg[], string *body);
+int handleDeleteBoard(tList *L, tRqst *rqst, char msg[], string *body);
+int handleGetPosts(tList *L, tRqst *rqst, char msg[], string *body);
+int handleWatch(tList *L, tRqst *rqst, char msg[], string *body);
+int handleNewPost(tList *L, tRqst *rqst, char msg[], string *body);
+int handleInsertPost(tList *L, tRqst *rqst, char msg[], string *body);
+int handleBatch(tList *L, tRqst *rqst, char msg[], string *body);
+int handleExport(tList *L, tRqst *rqst, char msg[], string *body);
+int handleImport(tList *L, tRqst *rqst, char msg[], string *body);
+int handleLog(tList *L, tRqst *rqst, char msg[], string *body);
+int handleReplication(tList *L, tRqst *rqst, char msg[], string *body);
+int handleSearch(tList *L, tRqst *rqst, char msg[], string *body);
+bool isSearch(tRqst *rqst);
+bool isExport(tRqst *rqst);
+bool isImport(tRqst *rqst, char msg[]);
+int handleChangePost(tList *L, tRqst *rqst, char msg[], string *body);
+int handleDeletePost(tList *L, tRqst *rqst, char msg[], string *body);
 void disposeList(tList *L);
 void disposeBoard(tBoardPtr B);
-bool isBoards(char url[]);
+
+tNodePtr newNode(tArena *A, bool leaf);
+void freeNode(tArena *A, tNodePtr node);
+tElemPtr *treeGet(tNodePtr root, int pos);
+tNodePtr treeLeaf(tNodePtr root, int pos, int *index);
+tNodePtr treeFirst(tNodePtr root);
+void treeInsert(tArena *A, tNodePtr *root, int pos, tElemPtr item, unsigned int doc);
+tNodePtr nodeInsert(tArena *A, tNodePtr node, int pos, tElemPtr item, unsigned int doc);
+tNodePtr splitNode(tArena *A, tNodePtr node);
+tElemPtr treeRemove(tArena *A, tNodePtr *root, int pos);
+tElemPtr nodeRemove(tArena *A, tNodePtr node, int pos);
+void fixChild(tArena *A, tNodePtr node, int i);
+void adoptItems(tArena *A, tNodePtr node, int from, int to);
+unsigned int newDoc(tArena *A);
+int leafPosition(tNodePtr leaf);
+
+void initArena(tArena *A);
+void *arenaAlloc(tChunk **chunks, size_t size, size_t first, size_t max);
+tElemPtr arenaPost(tArena *A, char content[], int length);
+void arenaReserve(tArena *A, size_t size);
+size_t recordSize(unsigned int length);
+void arenaRelease(tArena *A, tElemPtr post);
+void arenaCompact(tArena *A, tNodePtr root);
+void freeChunks(tChunk *chunk);
+void releasePin(tPin *pin, tChunk *chunks);
+tPin *newPin();
+tPin *pinPost(tArena *A, tElemPtr post);
+void unpin(tPin *pin);
+void disposeArena(tArena *A);
+
+void initIndex(tIndex *I);
+void disposeIndex(tIndex *I);
+bool termChar(char c);
+int nextTerm(const char *text, int length, int *pos, char term[]);
+tTermPtr findTerm(tIndex *I, const char *text, int length, bool add);
+void *indexAlloc(tIndex *I, size_t size);
+void termAppend(tIndex *I, tTermPtr t, unsigned int doc);
+void termReserve(tIndex *I, tTermPtr t, int length);
+int putVarint(unsigned char *dest, unsigned int value);
+unsigned int getVarint(const unsigned char *data, int *pos);
+void indexPost(tBoardPtr B, unsigned int doc, tElemPtr post);
+void dropDoc(tBoardPtr B, unsigned int doc, tElemPtr post);
+void rebuildIndex(tBoardPtr B);
+bool cursorNext(tCursor *c);
+bool cursorSeek(tCursor *c, unsigned int doc);
+int searchPosts(tList *L, tQuery *q, string *str);
+void searchBoard(tBoardPtr B, tQuery *q, tHits *hits);
+void addHit(tHits *hits, tBoardPtr B, tNodePtr leaf, int index, uint64_t key);
+void hitUp(tHits *hits, int i);
+void hitDown(tHits *hits, int i);
+void swapHits(tHits *hits, int i, int j);
+int compareHits(const void *a, const void *b);
+int searchResponse(tRqst *rqst, string *hits, string *body);
 
 int strInit(string *s);
 void strFree(string *s);
 int *string_concat(string *s1, const char *s2);
 void strClear(string *s);
 int strAddChar(string *s1, char c);
+int strAddData(string *s1, const char *data, int length);
+int strReserve(string *s, int length);
+int strAddRef(string *s, const char *data, int length, tPin *pin);
+int strAppend(string *s1, string *s2);
+void strAddJson(string *str, const char *data, int length);
+void strFlatten(string *s, char *dest);
+int strMerge(string *s);
+void poolGet(tLoop *loop, string *s);
+void poolPut(tLoop *loop, string *s);
 
 void handleError(char *errorMessage);
 void handleHelp();
 void handleArguments(int argc, char *argv[]);
 bool isNumber(char argv[]);
-void processRequest(char msg[]);
-void processLine(string *line);
+int parseRequest(char msg[], int length, tRqst *rqst);
+bool parseRequestLine(char msg[], int pos, int length, tRqst *rqst);
+bool parseHeader(char msg[], int pos, int length, tRqst *rqst);
+bool sliceEquals(char msg[], tSlice slice, const char *str);
+void sliceCopy(char msg[], tSlice slice, char dest[], int size);
+bool parseImportLine(char line[], int length, tImportLine *item);
+int jsonSpace(char line[], int length, int pos);
+int jsonString(char s[], int length, int *pos);
+bool jsonHex(char s[], int length, int *pos, unsigned int *code);
+int utf8Encode(unsigned int code, char dest[]);
+
+void appendResponse(string *response, tRqst *rqst, int code, string *body);
+int boardsResponse(tRqst *rqst, string *body, unsigned int version);
+bool tagMatches(const char match[], const char etag[]);
+unsigned int hashName(const char *name, int length);
+int requestShard(tRqst *rqst, char msg[]);
+
+void raiseFdLimit();
+void setNonBlocking(int fd);
+int createListener(int port, bool reusePort);
+void initLoop(tLoop *loop, int id, int fd, tList *L);
+void pinThread(int cpu);
+void *runLoop(void *arg);
+void acceptConnections(tLoop *loop);
+void handleConnection(tLoop *loop, tConnPtr conn, uint32_t events);
+void processConnection(tLoop *loop, tConnPtr conn);
+void updateConnection(tLoop *loop, tConnPtr conn);
+bool readConnection(tConnPtr conn);
+bool flushConnection(tConnPtr conn);
+void closeConnection(tConnPtr conn);
+void freeConnection(tConnPtr conn);
+
+void initQueue(tQueue *q);
+void pushMsg(tQueue *q, tMsgPtr m);
+tMsgPtr popMsg(tQueue *q);
+void sendMsg(tLoop *to, tMsgPtr m);
+tMsgPtr newMsg(tLoop *loop, tConnPtr conn, int type);
+void forwardRequest(tLoop *loop, tConnPtr conn, tRqst *rqst, char msg[], int length, int shard);
+void startStream(tLoop *loop, tConnPtr conn, char name[], int pos, int last);
+void streamPosts(tLoop *loop, tConnPtr conn);
+void startExport(tConnPtr conn);
+bool nextExport(tConnPtr conn);
+void startImport(tConnPtr conn);
+bool importLines(tLoop *loop, tConnPtr conn);
+void importLine(tLoop *loop, tConnPtr conn, char line[], int length);
+void flushImport(tLoop *loop, tConnPtr conn);
+void finishImport(tConnPtr conn);
+void shiftInput(tConnPtr conn);
+void handleMessages(tLoop *loop);
+void freeMsg(tLoop *loop, tMsgPtr m);
+void startWatch(tLoop *loop, tConnPtr conn, char name[], tRqst *rqst);
+void stopWatch(tLoop *loop, tConnPtr conn, bool release);
+void deliverEvent(tLoop *loop, tMsgPtr m);
+void expireWatches(tLoop *loop);
+long long monotonicMs();
+void absTime(long long ms, struct timespec *ts);
+bool waitForLog(tLoop *loop, tConnPtr conn);
+void unparkLog(tLoop *loop, tConnPtr conn);
+void releaseLogWaiters(tLoop *loop);
+
+void walOpen(tList *L);
+void walReplay(tList *L, char data[], size_t size, size_t *valid);
+void walApply(tList *L, char ops[], int length);
+void *walWriter(void *arg);
+void walRecord(char type, const char *name, int nameLength, int id, const char *content, int length);
+void walBegin();
+void walEnd();
+void walAppend(string *frame);
+void walFrameStart(string *frame);
+void walFrameOp(string *frame, char type, const char *name, int nameLength, int id, const char *content, int length);
+void walFrameSeal(string *frame);
+long long walDeadline(bool dirty, long long synced);
+void walSnapshotStep();
+void walSnapshotStart();
+void walSnapshotWrite();
+bool snapshotPost(tSnapshot *s, tElemPtr post);
+bool snapshotData(tSnapshot *s, const char *data, size_t length);
+bool snapshotWrite(int fd, uint64_t offset, const void *data, size_t length);
+bool walCompact();
+int walNewLog(unsigned int gen, off_t from, off_t to, off_t *size);
+unsigned int walBase(char data[], size_t size);
+char *walPath(const char *suffix);
+void syncDir(const char *path);
+bool writeAll(int fd, const char *data, size_t length);
+void storeOpen(tList *L);
+bool storeMap(tList *L, int fd, bool verify);
+bool storeBoard(tMapping *m, tStoreBoard *entry, tList side[], bool verify);
+tElemPtr storeRecord(tMapping *m, uint64_t offset);
+void releaseMapping(tMapping *m);
+tList *sideLists();
+void replaceBoards(tList *L, tList side[]);
+void swapBoards(tList *L, tList *side);
+bool loadStoredPosts(tList *L, tBoardPtr B);
+void buildIndex(tList *L, tBoardPtr B);
+bool lockSearch(tList *L, tBoardPtr B);
+tNodePtr treeLoad(tArena *A, const uint64_t offsets[], int count);
+tList *boardOwner(tList *L, const char *name, int length);
+void initCrc();
+uint32_t crc32(const char *data, size_t length);
+
+void startShipping(tConnPtr conn, tRqst *rqst, char msg[]);
+void *shipLog(void *arg);
+bool shipStore(tShip *ship);
+off_t shipWait(tShip *ship, long long beat);
+bool shipFrames(tShip *ship, off_t end);
+bool shipMarker(tShip *ship, char type, unsigned int gen, off_t value);
+void redirectRequest(tConnPtr conn, tRqst *rqst, char msg[]);
+void followStart(tList *L);
+void *followLog(void *arg);
+int followConnect(long long *storeSize);
+bool followHeaders(int fd, long long *storeSize);
+bool followRead(int fd);
+void followStream(int fd, long long storeSize);
+bool followStore(int fd, long long size);
+void followFrame(char ops[], int length);
+long long followLag();
 
 int main(int argc, char *argv[])
 {
-    int fd;
-    int newsock;
-    int len, msg_size, i;
-    struct sockaddr_in server; // the server configuration (socket info)
-    struct sockaddr_in from;   // configuration of an incoming client (socket info)
-    char buffer[BUFFER];
+    int fd = -1;
     tList boardList;
-    string response;
 
-    // Init board list and response string
-    initList(&boardList);
-    strInit(&response);
+    handleArguments(argc, argv);
+    initScan();
+    initRoutes();
+    bootId = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+
+    // Init board list, locking is needed only when more threads share it,
+    // the follower thread changes the boards of all loops
+    initList(&boardList, config.threads > 0 || config.follow != NULL);
+
+    // Writing to a connection closed by the peer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    raiseFdLimit();
+
+    // Single event loop in the main thread, one loop per worker thread
+    // or one loop per shard
+    if (config.shards > 0)
+        loopCount = config.shards;
+    else if (config.threads > 0)
+        loopCount = config.threads;
+    else
+        loopCount = 1;
+
+    if ((loops = malloc(loopCount * sizeof(tLoop))) == NULL)
+        err(1, "malloc() failed");
 
-    // Test the correct number of arguments
-    if (argc >= 4)
+    for (int i = 0; i < loopCount; i++)
     {
-        handleError(USG_MSG);
+        if (config.shards > 0)
+        {
+            // Every shard has its own listener, the kernel spreads the connections
+            initList(&loops[i].list, config.follow != NULL);
+            initLoop(&loops[i], i, createListener(config.port, true), &loops[i].list);
+        }
+        else
+        {
+            if (fd == -1)
+                fd = createListener(config.port, false);
+            initLoop(&loops[i], i, fd, &boardList);
+        }
+    }
+
+    // Boards of the log are restored before the first connection
+    wal.fd = -1;
+    if (config.wal != NULL)
+        walOpen(&boardList);
+
+    // Follower gets the boards from the stream of its primary
+    if (config.follow != NULL)
+        followStart(&boardList);
+
+    if (loopCount == 1 && config.shards == 0)
+    {
+        runLoop(&loops[0]);
     }
     else
     {
-        handleArguments(argc, argv);
+        for (int i = 0; i < loopCount; i++)
+        {
+            if (pthread_create(&loops[i].thread, NULL, runLoop, &loops[i]) != 0)
+                errx(1, "pthread_create() failed");
+        }
+
+        for (int i = 0; i < loopCount; i++)
+        {
+            pthread_join(loops[i].thread, NULL);
+        }
+    }
+
+    // Final cleanup
+    for (int i = 0; i < loopCount; i++)
+    {
+        if (config.shards > 0)
+        {
+            close(loops[i].fd);
+            disposeList(&loops[i].list);
+        }
+        close(loops[i].evfd);
+    }
+    if (fd != -1)
+        close(fd); // close an original server socket
+
+    free(loops);
+    disposeList(&boardList);
+    return 0;
+}
+
+// Raise the limit of open descriptors so thousands of clients can be connected
+void raiseFdLimit()
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+}
+
+// Switch the descriptor to non-blocking mode
+void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        err(1, "fcntl() failed");
+}
+
+// Create the listening socket on the port
+// With reusePort more sockets can listen on the same port
+int createListener(int port, bool reusePort)
+{
+    int fd;
+    struct sockaddr_in server; // the server configuration (socket info)
+    int opt = 1;
 
     // Create a server socket
     // AF_INET = IPv4 Internet address family
@@ -129,14 +1200,19 @@ int main(int argc, char *argv[])
     if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
         err(1, "socket(): could not create the socket");
 
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1)
+        err(1, "setsockopt(SO_REUSEPORT) failed");
+
     // initialize server's sockaddr_in structure
+    memset(&server, 0, sizeof(server));
     server.sin_family = AF_INET;
 
     // wait on every network interface, see <netinet/in.h>
     server.sin_addr.s_addr = INADDR_ANY;
 
     // set the port from program arguments where server is waiting
-    server.sin_port = htons(atoi(argv[2]));
+    server.sin_port = htons(port);
 
     if (bind(fd, (struct sockaddr *)&server, sizeof(server)) < 0) //bind the socket to the port
         err(1, "bind() failed");
@@ -144,742 +1220,7067 @@ int main(int argc, char *argv[])
     if (listen(fd, QUEUE) != 0) //set a queue for incoming connections
         err(1, "listen() failed");
 
-    // accept new connection from an incoming client
-    // parameter "from" retreives information of the client socket
-    // newsock is a file descriptor to a new socket where incoming connection is processed
-    len = sizeof(from);
-    while (1)
-    { // wait for incoming connections (iterative server)
-        if ((newsock = accept(fd, (struct sockaddr *)&from, (socklen_t *)&len)) == -1)
-            err(1, "accept failed");
-
-        // process incoming messages from the client using "newsock" socket
-        // until the client stops sending data (CRLF)
-
-        while ((msg_size = read(newsock, buffer, BUFFER)) > 0)
-        { // read the message
-
-            // Get the exact msg without other characters
-            char newBuffer[msg_size];
-            sprintf(newBuffer, "%.*s", msg_size, buffer);
-
-            // Process the request
-            processRequest(newBuffer);
+    // The listening socket and all client sockets are non-blocking,
+    // readiness is reported by epoll in edge-triggered mode
+    setNonBlocking(fd);
 
-            // Create the response
-            createResponse(&boardList, &response, newBuffer);
-
-            char rspns[BUFFER];
-            sprintf(rspns, response.str);
-            msg_size = strlen(rspns);
-
-            i = write(newsock, rspns, msg_size); // send a converted message to the client
-            if (i == -1)                         // check if data was successfully sent out
-                err(1, "write() failed.");
-            else if (i != msg_size)
-                err(1, "write(): buffer written partially");
-
-            // Clear response string
-            strClear(&response);
-        }
-
-        // no more data from the client -> close the client and wait for a new one
-        close(newsock); // close the new socket
-    }
-    // close the server
-    close(fd); // close an original server socket
-
-    // Final cleanup
-    strFree(&response);
-    disposeList(&boardList);
-    return 0;
+    return fd;
 }
 
-// Function for error handling, print error to stderr and exit the program
-void handleError(char *errorMessage)
+// Create the epoll instance of the loop and register the listening socket
+// and the eventfd of the message queue
+void initLoop(tLoop *loop, int id, int fd, tList *L)
 {
-    fprintf(stderr, "%s", errorMessage);
-    exit(1);
+    struct epoll_event ev;
+
+    loop->id = id;
+    loop->fd = fd;
+    loop->L = L;
+    loop->poolCount = 0;
+    loop->freeMsgs = NULL;
+    loop->watches = NULL;
+    loop->polls = NULL;
+    loop->pollsLast = NULL;
+    loop->walWaiters = NULL;
+    atomic_init(&loop->walWaiting, 0);
+    strInit(&loop->body);
+    initQueue(&loop->queue);
+
+    if ((loop->efd = epoll_create1(0)) == -1)
+        err(1, "epoll_create1() failed");
+
+    if ((loop->evfd = eventfd(0, EFD_NONBLOCK)) == -1)
+        err(1, "eventfd() failed");
+
+    // Listening socket is registered with NULL pointer, eventfd with the loop
+    // and clients with their connection
+    // EPOLLEXCLUSIVE wakes only one of the workers waiting for a new connection
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        err(1, "epoll_ctl() failed");
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->efd, EPOLL_CTL_ADD, loop->evfd, &ev) == -1)
+        err(1, "epoll_ctl() failed");
 }
 
-// Function for printing out help msg
-void handleHelp()
+// Pin the calling thread to the CPU
+void pinThread(int cpu)
 {
-    printf(HLP_MSG);
-    exit(0);
+    cpu_set_t set;
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu % cpus, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
-// Program argument error checking
-void handleArguments(int argc, char *argv[])
+// Event loop, one thread multiplexes all of its connections
+// Connections stay in the loop (and thread) which accepted them
+void *runLoop(void *arg)
 {
-    switch (argc)
+    tLoop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    int timeout;
+
+    // Shard has its data in caches of one core
+    if (config.shards > 0)
+        pinThread(loop->id);
+    currentLoop = loop;
+
+    while (1)
     {
-    case 2:
-        if (strcmp(argv[1], "-h") == 0)
+        // Sleep until the first long-poll ends
+        timeout = -1;
+        if (loop->polls != NULL)
         {
-            // Print out help msg
-            handleHelp();
+            long long left = loop->polls->deadline - monotonicMs();
+            timeout = left > 0 ? (int)left : 0;
         }
-        else
+
+        if ((n = epoll_wait(loop->efd, events, MAX_EVENTS, timeout)) == -1)
         {
-            handleError(USG_MSG);
+            if (errno == EINTR)
+                continue;
+            err(1, "epoll_wait() failed");
         }
-        break;
 
-    case 3:
-        if (strcmp(argv[1], "-p") == 0)
+        for (int i = 0; i < n; i++)
         {
-            if (strcmp(argv[2], "-h") == 0)
+            if (events[i].data.ptr == NULL)
             {
-                handleHelp();
+                acceptConnections(loop);
             }
-            else if (!isNumber(argv[2]))
+            else if (events[i].data.ptr == loop)
             {
-                handleError("Port must be a number!\n");
+                handleMessages(loop);
+            }
+            else
+            {
+                handleConnection(loop, events[i].data.ptr, events[i].events);
             }
         }
-        else if (strcmp(argv[1], "-h") == 0)
-        {
-            handleHelp();
-        }
-        else
+
+        expireWatches(loop);
+
+        // Log thread wakes the loop when the frames are on the disk
+        if (loop->walWaiters != NULL)
+            releaseLogWaiters(loop);
+
+        // Boards must not change while the log thread forks the snapshot
+        if (atomic_load(&wal.pausing))
         {
-            handleError(USG_MSG);
+            pthread_barrier_wait(&wal.paused);
+            pthread_barrier_wait(&wal.resumed);
         }
-        break;
-    default:
-        handleError(USG_MSG);
-        break;
     }
-}
-
-// Port number error checking
-bool isNumber(char argv[])
-{
-    // Can not be negative number
-    if (argv[0] == '-')
-        handleError("Port can not be negative!\n");
 
-    // Check all characters
-    for (int i = 0; argv[i] != 0; i++)
-    {
-        if (!isdigit(argv[i]))
-            return false;
-    }
-    return true;
+    close(loop->efd);
+    return NULL;
 }
 
-// Function gets the whole request as a prameter
-// sends each line of the request message to another function
-void processRequest(char msg[])
+// Accept all pending connections and register them in epoll
+// Edge-triggered listener has to be drained until accept() would block
+void acceptConnections(tLoop *loop)
 {
-    char c;
-
-    string line;
-    strInit(&line);
+    int efd = loop->efd;
+    int fd = loop->fd;
+    int newsock;
+    struct epoll_event ev;
+    tConnPtr conn;
 
-    for (int i = 0; i < strlen(msg); i++)
+    while (1)
     {
-        c = msg[i];
+        if ((newsock = accept(fd, NULL, NULL)) == -1)
+        {
+            // EAGAIN - no more pending connections
+            // other errors (ECONNABORTED, EMFILE, ...) only affect this client
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
 
-        // If end of line, pass line to processLine function,
-        // else append character to string
-        if (c == '\n')
+        setNonBlocking(newsock);
+
+        if ((conn = malloc(sizeof(struct tConn))) == NULL)
         {
-            processLine(&line);
-            strClear(&line);
+            close(newsock);
+            continue;
         }
-        else
+
+        conn->fd = newsock;
+        conn->outPos = 0;
+        conn->refPos = 0;
+        conn->refOff = 0;
+        conn->inPos = 0;
+        memset(&conn->rqst, 0, sizeof(tRqst));
+        conn->pending = 0;
+        conn->eof = false;
+        conn->streaming = false;
+        conn->walWait = 0;
+        conn->walWaiting = false;
+        conn->exporting = false;
+        conn->importing = false;
+        conn->throttled = false;
+        conn->watch = NULL;
+        conn->loop = loop;
+        poolGet(loop, &conn->in);
+        poolGet(loop, &conn->out);
+        poolGet(loop, &conn->gather);
+        poolGet(loop, &conn->body);
+
+        // Wait for both directions, with EPOLLET we are notified only on changes
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, newsock, &ev) == -1)
         {
-            strAddChar(&line, c);
+            closeConnection(conn);
         }
     }
-
-    strFree(&line);
 }
 
-// Function gets a line from the request message
-// Appends information from request to the request structure
-void processLine(string *line)
+// Handle the readiness of a client connection
+void handleConnection(tLoop *loop, tConnPtr conn, uint32_t events)
 {
-    char c;
-    bool isRqst = false;
-    bool isCl = false;
-
-    string word;
-    strInit(&word);
-
-    for (int i = 0; i <= line->length; i++)
+    if (events & (EPOLLERR | EPOLLHUP))
     {
-        c = line->str[i];
+        closeConnection(conn);
+        return;
+    }
 
-        if (c == ' ' || c == '\0')
+    if (events & EPOLLIN)
+    {
+        // Read everything the client sent and process the complete requests
+        if (!readConnection(conn))
         {
-            // Line starts with GET, POST, PUT, DELETE
-            // Sets the request url in struct
-            // These are set in the ELSE section
-            if (isRqst)
-            {
-                sprintf(rqst.url, word.str);
-                isRqst = false;
-            }
-            // Line starts with Content-Length:
-            // Sets the request content length in struct
-            else if (isCl)
-            {
-                rqst.cl = atoi(word.str);
-                isCl = false;
-            }
-            // Set flags based on correct request types and headers
-            else
-            {
-                if ((strcmp(word.str, "GET") == 0) ||
-                    (strcmp(word.str, "POST") == 0) ||
-                    (strcmp(word.str, "PUT") == 0) ||
-                    (strcmp(word.str, "DELETE") == 0))
-                {
-                    sprintf(rqst.type, word.str);
-                    isRqst = true;
-                }
-                else if (strcmp(word.str, "Content-Type:") == 0)
-                {
-                    rqst.ct = true;
-                }
-                else if (strcmp(word.str, "Content-Length:") == 0)
-                {
-                    isCl = true;
-                }
-            }
-            strClear(&word);
+            // Client will not send more, finish the complete requests and close
+            processConnection(loop, conn);
+            conn->eof = true;
         }
         else
         {
-            strAddChar(&word, c);
+            processConnection(loop, conn);
         }
     }
 
-    strFree(&word);
+    updateConnection(loop, conn);
 }
 
-// Create response message based on request structure
-// Structure is filled with info. from processRequest and processLine functions
-void createResponse(tList *L, string *response, char buffer[])
+// Process the requests waiting in the read buffer
+// More requests can arrive at once (pipelining), they are processed in order
+// and their responses are written back-to-back
+// Requests for boards of other shards are forwarded to their owners,
+// the connection waits for the reply and does not start another request
+void processConnection(tLoop *loop, tConnPtr conn)
 {
-    int code = RQ_NOT_FOUND;
-    string body;
-    strInit(&body);
+    int shard, length;
+    char *msg;
+    tQuery query;
 
-    // Get request type
-    if (strcmp(rqst.type, "POST") == 0)
+    while (conn->pending == 0 && conn->watch == NULL)
     {
-        // POST /boards/name
-        if (isBoards(rqst.url))
+        // Streamed listing goes before the next requests, its next chunk
+        // is created when the socket took most of the previous one
+        if (conn->streaming)
         {
-            // Get name from url
-            char name[20];
-            memcpy(name, &rqst.url[8], strlen(rqst.url) - 8);
-            name[strlen(rqst.url) - 8] = '\0';
+            if (conn->out.length + conn->out.refLength >= STREAM_CHUNK)
+                break;
+            streamPosts(loop, conn);
+            continue;
+        }
 
-            code = newBoard(L, name);
+        // Import content received before the end of the connection is processed
+        if (conn->importing)
+        {
+            if (!importLines(loop, conn))
+                break;
+            continue;
         }
-        // POST /board/name
-        else
+
+        if (conn->eof)
+            break;
+
+        // Every request is parsed to its own structure, parsing continues
+        // where it stopped when the request was not complete
+        tRqst *rqst = &conn->rqst;
+
+        msg = conn->in.str + conn->inPos;
+        length = parseRequest(msg, conn->in.length - conn->inPos, rqst);
+
+        // Import does not wait for its whole content
+        if (length != -1 && rqst->state == P_CONTENT && rqst->cl > 0 && rqst->method == M_POST && isImport(rqst, msg))
         {
-            if (rqst.cl == 0)
+            if (config.follow == NULL)
             {
-                code = RQ_CL;
+                startImport(conn);
+                continue;
             }
-            else
-            {
-                // Get name from url
-                char name[20];
-                memcpy(name, &rqst.url[7], strlen(rqst.url) - 7);
-                name[strlen(rqst.url) - 7] = '\0';
 
-                // Get content from message
-                char content[rqst.cl + 1];
-                int poz = strlen(buffer) - rqst.cl - 2;
-                memcpy(content, &buffer[poz], rqst.cl);
-                content[rqst.cl] = '\0';
-
-                code = newPost(L, name, content);
-            }
+            // Content is not read, the client sends it to the primary
+            rqst->close = true;
+            redirectRequest(conn, rqst, msg);
+            conn->eof = true;
+            break;
         }
-    }
-    else if (strcmp(rqst.type, "GET") == 0)
-    {
 
-        // GET /boards
-        if (isBoards(rqst.url))
+        if (length == 0)
         {
-            code = getBoards(L, &body);
+            // Request is not complete yet
+            break;
         }
-        // GET /board/name
-        else
+        else if (length == -1)
         {
-            // Get name from url
-            char name[20];
-            memcpy(name, &rqst.url[7], strlen(rqst.url) - 7);
-            name[strlen(rqst.url) - 7] = '\0';
+            // Headers without the end, answer and close the connection
+            strClear(&conn->body);
+            rqst->close = true;
+            appendResponse(&conn->out, rqst, RQ_CL, &conn->body);
+            conn->eof = true;
+            break;
+        }
 
-            code = getPosts(L, name, &body);
+        conn->inPos += length;
+        matchRoute(rqst, msg);
+        rqst->from = loop->id;
+
+        shard = config.shards > 0 ? requestShard(rqst, msg) : loop->id;
+        if (shard == LOCAL_SHARD)
+            shard = loop->id;
+
+        if (config.follow != NULL && rqst->method != M_GET && rqst->route != NO_ROUTE)
+        {
+            // Follower serves only reads, changes go to the primary
+            redirectRequest(conn, rqst, msg);
         }
-    }
-    else if (strcmp(rqst.type, "DELETE") == 0)
-    {
-        // DELETE /boards/name
-        if (isBoards(rqst.url))
+        else if (shard == ALL_SHARDS && isSearch(rqst) && !parseSearch(rqst, msg, &query))
         {
-            // Get name from url
-            char name[20];
-            memcpy(name, &rqst.url[8], strlen(rqst.url) - 8);
-            name[strlen(rqst.url) - 8] = '\0';
-
-            code = deleteBoard(L, name);
+            strClear(&conn->body);
+            appendResponse(&conn->out, rqst, RQ_CL, &conn->body);
+        }
+        else if (shard == ALL_SHARDS)
+        {
+            // GET /boards, local names and the names from all other shards
+            // GET /search, local hits and the hits of all other shards
+            strClear(&conn->gather);
+            if (isSearch(rqst))
+                searchPosts(loop->L, &query, &conn->gather);
+            else
+                getBoards(loop->L, &conn->gather, &conn->gatherVersion);
+            for (int i = 0; i < loopCount; i++)
+            {
+                if (i != loop->id)
+                    forwardRequest(loop, conn, rqst, msg, length, i);
+            }
+        }
+        else if (shard != loop->id)
+        {
+            forwardRequest(loop, conn, rqst, msg, length, shard);
         }
-        // DELETE /board/name/id
         else
         {
-            // Get name and ID from url
-            char url[50];
-            memcpy(url, &rqst.url[7], strlen(rqst.url) - 7);
-            url[strlen(rqst.url) - 7] = '\0';
+            // Create the response straight into the write buffer
+            walLsn = 0;
+            int code = createResponse(loop->L, rqst, &conn->out, msg, &conn->body);
+            if (walLsn > conn->walWait)
+                conn->walWait = walLsn;
+            char name[MAX_NAME];
+
+            if (code == RQ_STREAM || code == RQ_WATCH)
+                paramName(msg, rqst->params[0], name);
+
+            if (code == RQ_STREAM)
+                startStream(loop, conn, name, rqst->window.first, rqst->window.last);
+            else if (code == RQ_WATCH)
+                startWatch(loop, conn, name, rqst);
+            else if (code == RQ_EXPORT)
+            {
+                getBoards(loop->L, &conn->gather, &conn->gatherVersion);
+                startExport(conn);
+            }
+            else if (code == RQ_SHIP)
+                startShipping(conn, rqst, msg);
+        }
 
-            char *idStart = strrchr(url, '/');
+        // No more requests are processed after Connection: close
+        if (rqst->close)
+            conn->eof = true;
 
-            char name[20];
-            memcpy(name, &url[0], idStart - url);
-            name[idStart - url] = '\0';
+        // Parser is ready for the next request
+        memset(rqst, 0, sizeof(tRqst));
+    }
 
-            char tmpId[10];
-            memcpy(tmpId, &url[idStart - url + 1], strlen(url) - strlen(name));
-            url[strlen(url) - strlen(name)] = '\0';
-            int id = atoi(tmpId);
+    shiftInput(conn);
+}
 
-            code = deletePost(L, name, id);
-        }
-    }
-    else if (strcmp(rqst.type, "PUT") == 0)
+// Move the unprocessed part to the start of the buffer
+void shiftInput(tConnPtr conn)
+{
+    if (conn->inPos > 0)
+    {
+        memmove(conn->in.str, conn->in.str + conn->inPos, conn->in.length - conn->inPos + 1);
+        conn->in.length -= conn->inPos;
+        conn->inPos = 0;
+    }
+}
+
+// Send as much of the pending response as the socket accepts,
+// the rest is sent when EPOLLOUT is reported
+// Streamed listing continues while the socket accepts its chunks
+// Connection is closed when it is broken or the client is done
+void updateConnection(tLoop *loop, tConnPtr conn)
+{
+    bool ok;
+
+    // Responses wait until their changes are in the log on the disk
+    if (waitForLog(loop, conn))
+        return;
+
+    while ((ok = flushConnection(conn)) && conn->streaming && conn->pending == 0 && conn->out.length + conn->out.refLength == 0)
+    {
+        processConnection(loop, conn);
+    }
+
+    // Watcher stays even when the client sent everything
+    if (!ok || (conn->eof && !conn->streaming && conn->pending == 0 && conn->watch == NULL && conn->out.length + conn->out.refLength == 0))
+    {
+        closeConnection(conn);
+    }
+}
+
+// Read all available data to the read buffer
+// Returns false when the client closed the connection or on error
+bool readConnection(tConnPtr conn)
+{
+    int msg_size;
+
+    while (1)
     {
-        if (!isBoards(rqst.url))
+        // Import is read only as fast as it is processed
+        if (conn->importing && conn->in.length - conn->inPos >= IMPORT_BUFFER)
         {
-            // Get name, ID from url and content from request
-            char url[50];
-            memcpy(url, &rqst.url[7], strlen(rqst.url) - 7);
-            url[strlen(rqst.url) - 7] = '\0';
+            conn->throttled = true;
+            return true;
+        }
+
+        // Read straight to the free space at the end of the buffer
+        strReserve(&conn->in, BUFFER);
 
-            char *idStart = strrchr(url, '/');
+        if ((msg_size = read(conn->fd, conn->in.str + conn->in.length, conn->in.allocSize - conn->in.length - 1)) > 0)
+        {
+            conn->in.length += msg_size;
+            conn->in.str[conn->in.length] = '\0';
+        }
+        else if (msg_size == 0)
+        {
+            return false;
+        }
+        else if (errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
 
-            char name[20];
-            memcpy(name, &url[0], idStart - url);
-            name[idStart - url] = '\0';
+// Write the pending data from the write buffer
+// Data of the string and its references are written by one writev(),
+// the cursor remembers where a partial write stopped
+// Returns false when the connection is broken
+bool flushConnection(tConnPtr conn)
+{
+    struct iovec iov[MAX_IOV];
+    string *out = &conn->out;
+    int count, pos, ref, end;
+    ssize_t n;
 
-            char tmpId[10];
-            memcpy(tmpId, &url[idStart - url + 1], strlen(url) - strlen(name));
-            url[strlen(url) - strlen(name)] = '\0';
-            int id = atoi(tmpId);
+    while (conn->outPos < out->length || conn->refPos < out->refCount)
+    {
+        // Segments from the cursor, the references split the string
+        pos = conn->outPos;
+        ref = conn->refPos;
+        n = conn->refOff;
+        for (count = 0; count < MAX_IOV && (pos < out->length || ref < out->refCount); count++)
+        {
+            if (ref < out->refCount && pos == out->refs[ref].at)
+            {
+                iov[count].iov_base = (char *)out->refs[ref].data + n;
+                iov[count].iov_len = out->refs[ref].length - n;
+                ref++;
+                n = 0;
+            }
+            else
+            {
+                end = ref < out->refCount ? out->refs[ref].at : out->length;
+                iov[count].iov_base = out->str + pos;
+                iov[count].iov_len = end - pos;
+                pos = end;
+            }
+        }
 
-            char content[rqst.cl + 1];
-            int poz = strlen(buffer) - rqst.cl - 2;
-            memcpy(content, &buffer[poz], rqst.cl);
-            content[rqst.cl] = '\0';
+        n = writev(conn->fd, iov, count);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            // socket buffer is full, wait for EPOLLOUT
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
 
-            code = changePost(L, name, id, content);
+        // Move the cursor by the written bytes
+        while (n > 0)
+        {
+            if (conn->refPos < out->refCount && conn->outPos == out->refs[conn->refPos].at)
+            {
+                end = out->refs[conn->refPos].length - conn->refOff;
+                if (n < end)
+                {
+                    conn->refOff += n;
+                    break;
+                }
+                n -= end;
+                conn->refOff = 0;
+                conn->refPos++;
+            }
+            else
+            {
+                end = conn->refPos < out->refCount ? out->refs[conn->refPos].at : out->length;
+                if (n < end - conn->outPos)
+                {
+                    conn->outPos += n;
+                    break;
+                }
+                n -= end - conn->outPos;
+                conn->outPos = end;
+            }
         }
     }
-    else
+
+    // Everything was sent, buffer grown by a large response is not kept
+    // Clearing releases the references
+    if (conn->out.allocSize > POOL_MAX_ALLOC)
     {
-        code = RQ_NOT_FOUND;
+        poolPut(conn->loop, &conn->out);
+        poolGet(conn->loop, &conn->out);
     }
+    strClear(&conn->out);
+    conn->outPos = 0;
+    conn->refPos = 0;
+    conn->refOff = 0;
+    return true;
+}
 
-    // Append text based on code
-    char codeName[20];
-    if (code == RQ_OK)
+// Close the client connection
+// Connection waiting for a reply from another shard is freed when the reply comes
+void closeConnection(tConnPtr conn)
+{
+    if (conn->watch != NULL)
+        stopWatch(conn->loop, conn, true);
+
+    if (conn->walWaiting)
+        unparkLog(conn->loop, conn);
+
+    if (conn->fd != -1)
     {
-        sprintf(codeName, "OK\r\n");
+        // Closing alone does not remove the socket from epoll while
+        // the child writing a snapshot holds its copy
+        epoll_ctl(conn->loop->efd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
     }
-    else if (code == RQ_NOT_FOUND)
+
+    if (conn->pending == 0)
+        freeConnection(conn);
+}
+
+// Free the connection, its buffers go back to the pool of the loop
+void freeConnection(tConnPtr conn)
+{
+    poolPut(conn->loop, &conn->in);
+    poolPut(conn->loop, &conn->out);
+    poolPut(conn->loop, &conn->gather);
+    poolPut(conn->loop, &conn->body);
+    free(conn);
+}
+
+// Initialize the queue, it always contains at least the stub message
+void initQueue(tQueue *q)
+{
+    atomic_store(&q->stub.next, NULL);
+    atomic_store(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+// Append the message to the queue, can be called by any thread
+// Producers only swap the head, so they never wait for each other
+void pushMsg(tQueue *q, tMsgPtr m)
+{
+    tMsgPtr prev;
+
+    atomic_store_explicit(&m->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, m, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, m, memory_order_release);
+}
+
+// Take the oldest message from the queue, only the owner of the queue calls it
+// Returns NULL when the queue is empty or a producer has not finished the push,
+// in that case its eventfd write wakes the loop again
+tMsgPtr popMsg(tQueue *q)
+{
+    tMsgPtr tail = q->tail;
+    tMsgPtr next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // Skip the stub
+    if (tail == &q->stub)
     {
-        sprintf(codeName, "Not Found\r\n");
+        if (next == NULL)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
     }
-    else if (code == RQ_EXISTS)
+
+    if (next != NULL)
     {
-        sprintf(codeName, "Conflict\r\n");
+        q->tail = next;
+        return tail;
     }
-    else if (code == RQ_CREATED)
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+
+    // Tail is the last message, put the stub behind it so it can be taken
+    pushMsg(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL)
     {
-        sprintf(codeName, "Created\r\n");
+        q->tail = next;
+        return tail;
     }
-    else if (code == RQ_CL)
+
+    return NULL;
+}
+
+// Put the message to the queue of the shard and wake it up
+void sendMsg(tLoop *to, tMsgPtr m)
+{
+    uint64_t one = 1;
+
+    pushMsg(&to->queue, m);
+    if (write(to->evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        err(1, "write() to eventfd failed");
+}
+
+// Get a message for the connection, the reply is expected
+// Message without a connection is only a notice
+tMsgPtr newMsg(tLoop *loop, tConnPtr conn, int type)
+{
+    tMsgPtr m = loop != NULL ? loop->freeMsgs : NULL;
+
+    // Message comes back with the reply, so the sender reuses it
+    // Follower thread has no loop, its events are allocated
+    if (m != NULL)
+        loop->freeMsgs = m->next;
+    else if ((m = malloc(sizeof(struct tMsg))) == NULL)
+        err(1, "malloc() failed");
+
+    m->type = type;
+    m->from = loop;
+    m->conn = conn;
+    m->pos = 0;
+    m->lsn = 0;
+    if (loop != NULL)
+        poolGet(loop, &m->data);
+    else if (strInit(&m->data) != STR_SUCCESS)
+        err(1, "malloc() failed");
+
+    // Events and notices are not answered
+    if (conn != NULL)
+        conn->pending++;
+    return m;
+}
+
+// Forward the request to the shard which owns the board
+// GET /boards only asks for the names of boards owned by the shard,
+// GET /search for its hits
+void forwardRequest(tLoop *loop, tConnPtr conn, tRqst *rqst, char msg[], int length, int shard)
+{
+    tMsgPtr m = newMsg(loop, conn, requestShard(rqst, msg) == ALL_SHARDS ? MSG_LIST : MSG_REQUEST);
+
+    m->rqst = *rqst;
+    if (m->type == MSG_REQUEST || isSearch(rqst))
+        strAddData(&m->data, msg, length);
+
+    sendMsg(&loops[shard], m);
+}
+
+// Start sending the listing of the board in chunks, posts from pos to last
+// Headers of the response are already in the write buffer
+void startStream(tLoop *loop, tConnPtr conn, char name[], int pos, int last)
+{
+    conn->streaming = true;
+    strcpy(conn->streamName, name);
+    conn->streamPos = pos;
+    conn->streamLast = last;
+}
+
+// Append the next chunk of the listing to the write buffer
+// Board of another shard is asked for the chunk, the reply continues the stream
+void streamPosts(tLoop *loop, tConnPtr conn)
+{
+    int shard = loop->id;
+
+    // Export continues with the next board
+    if (conn->exporting && conn->streamName[0] == '\0' && !nextExport(conn))
+        return;
+
+    if (config.shards > 0)
+        shard = hashName(conn->streamName, strlen(conn->streamName)) % loopCount;
+
+    if (shard == loop->id)
     {
-        sprintf(codeName, "Bad Request\r\n");
+        if (conn->exporting)
+        {
+            if (exportChunk(loop->L, conn->streamName, &conn->streamPos, &conn->out))
+                conn->streamName[0] = '\0';
+        }
+        else if (getPostsChunk(loop->L, conn->streamName, &conn->streamPos, conn->streamLast, &conn->out))
+        {
+            conn->streaming = false;
+        }
+        return;
     }
 
-    // Create header
-    char rqHeader[100] = "HTTP/1.1 ";
-    sprintf(rqHeader, "%s%d %s", rqHeader, code, codeName);
-    string_concat(response, rqHeader);
+    tMsgPtr m = newMsg(loop, conn, MSG_CHUNK);
+    m->json = conn->exporting;
+    strcpy(m->name, conn->streamName);
+    m->pos = conn->streamPos;
+    m->last = conn->streamLast;
+    sendMsg(&loops[shard], m);
+}
 
-    // If there is content, append headers and content after headers
-    if (body.length != 0)
+// Start the export of the boards collected in gather,
+// headers of the response are already in the write buffer
+void startExport(tConnPtr conn)
+{
+    // Cached listing of the boards comes as a reference, the names are read in place
+    if (strMerge(&conn->gather) != STR_SUCCESS)
+        err(1, "malloc() failed");
+
+    conn->streaming = true;
+    conn->exporting = true;
+    conn->exportPos = 0;
+    conn->streamName[0] = '\0';
+}
+
+// Take the next board of the export, the stream ends after the last one
+// Returns false when there are no more boards
+bool nextExport(tConnPtr conn)
+{
+    if (conn->exportPos >= conn->gather.length)
     {
-        char ctHeaders[100] = "Content-Type: text/plain\r\n";
-        sprintf(ctHeaders, "%sContent-Length: %d\r\n\r\n", ctHeaders, body.length);
-        string_concat(response, ctHeaders);
-        string_concat(response, body.str);
+        strAddData(&conn->out, "0\r\n\r\n", 5);
+        conn->streaming = false;
+        conn->exporting = false;
+        return false;
+    }
+
+    int end = scanChar(conn->gather.str + conn->exportPos, conn->gather.length - conn->exportPos, '\n');
+
+    memcpy(conn->streamName, conn->gather.str + conn->exportPos, end);
+    conn->streamName[end] = '\0';
+    conn->exportPos += end + 1;
+    conn->streamPos = 0;
+    return true;
+}
+
+// Start processing the content of POST /import,
+// the headers are not needed anymore
+void startImport(tConnPtr conn)
+{
+    conn->inPos += conn->rqst.contentPos;
+    conn->importLeft = conn->rqst.cl;
+    conn->importing = true;
+    conn->importName[0] = '\0';
+    conn->importReserve = -1;
+    conn->importBoards = 0;
+    conn->importPosts = 0;
+    conn->importErrors = 0;
+    strClear(&conn->gather);
+}
+
+// Import the complete lines received so far
+// Returns false when the connection waits for more content or for the owner of a board
+bool importLines(tLoop *loop, tConnPtr conn)
+{
+    int length = conn->in.length - conn->inPos;
+    char *data = conn->in.str + conn->inPos;
+    int pos = 0, end;
+
+    if (length > conn->importLeft)
+        length = conn->importLeft;
+
+    while (pos < length && conn->pending == 0)
+    {
+        // Last line does not need the line break
+        if ((end = scanChar(data + pos, length - pos, '\n')) == -1)
+        {
+            if (length < conn->importLeft)
+                break;
+            end = length - pos;
+        }
+
+        importLine(loop, conn, data + pos, end);
+        pos += end + 1;
+    }
+
+    if (pos > length)
+        pos = length;
+    conn->inPos += pos;
+    conn->importLeft -= pos;
+
+    if (conn->pending > 0)
+        return false;
+
+    // Content left in the socket fits to the buffer now
+    if (conn->throttled)
+    {
+        shiftInput(conn);
+        conn->throttled = false;
+        if (!readConnection(conn))
+            conn->eof = true;
+        return true;
+    }
+
+    // Posts received so far are imported before waiting for more
+    flushImport(loop, conn);
+    if (conn->importLeft > 0 || conn->pending > 0)
+        return false;
+
+    finishImport(conn);
+    return true;
+}
+
+// Add one line of the import to the posts of the current board
+// Board line sends the posts of the previous board to its owner first
+// Invalid lines and posts before the first board are counted and skipped
+void importLine(tLoop *loop, tConnPtr conn, char line[], int length)
+{
+    tImportLine item;
+
+    if (length > 0 && line[length - 1] == '\r')
+        length--;
+    if (length == 0)
+        return;
+
+    if (!parseImportLine(line, length, &item) || (!item.board && conn->importName[0] == '\0'))
+    {
+        conn->importErrors++;
+        return;
+    }
+
+    if (item.board)
+    {
+        flushImport(loop, conn);
+        strcpy(conn->importName, item.name);
+        conn->importReserve = item.reserve;
+        return;
     }
 
-    string_concat(response, "\r\n");
+    // Record is the length and the content
+    strAddData(&conn->gather, (char *)&item.postLength, sizeof(int));
+    strAddData(&conn->gather, item.post, item.postLength);
 
-    strFree(&body);
+    if (conn->gather.length >= IMPORT_CHUNK)
+        flushImport(loop, conn);
 }
 
-// Check if url is board or boards
-bool isBoards(char url[])
+// Import the collected posts to the current board, the board of another shard
+// gets them in a message and the connection waits for the reply
+void flushImport(tLoop *loop, tConnPtr conn)
 {
-    string str;
-    strInit(&str);
-    bool result;
+    int shard = loop->id;
 
-    for (int i = 1; i <= strlen(url); i++)
+    if (conn->importName[0] == '\0' || (conn->gather.length == 0 && conn->importReserve == -1))
+        return;
+
+    if (config.shards > 0)
+        shard = hashName(conn->importName, strlen(conn->importName)) % loopCount;
+
+    if (shard == loop->id)
+    {
+        walLsn = 0;
+        conn->importPosts += importPosts(loop->L, conn->importName, conn->importReserve, conn->gather.str, conn->gather.length, &conn->importBoards);
+        if (walLsn > conn->walWait)
+            conn->walWait = walLsn;
+        strClear(&conn->gather);
+    }
+    else
+    {
+        // Posts travel with the message, the connection gets its empty buffer
+        tMsgPtr m = newMsg(loop, conn, MSG_IMPORT);
+        string data = m->data;
+
+        strcpy(m->name, conn->importName);
+        m->pos = conn->importReserve;
+        m->data = conn->gather;
+        conn->gather = data;
+        sendMsg(&loops[shard], m);
+    }
+
+    // Board exists now, only its posts follow
+    conn->importReserve = -1;
+}
+
+// Answer the import with the numbers of new boards, posts and rejected lines
+void finishImport(tConnPtr conn)
+{
+    char summary[100];
+
+    strClear(&conn->body);
+    strAddData(&conn->body, summary, sprintf(summary, "boards: %d\nposts: %d\nerrors: %d\n", conn->importBoards, conn->importPosts, conn->importErrors));
+    appendResponse(&conn->out, &conn->rqst, RQ_OK, &conn->body);
+
+    conn->importing = false;
+    if (conn->rqst.close)
+        conn->eof = true;
+    memset(&conn->rqst, 0, sizeof(tRqst));
+}
+
+// Handle all messages from other shards
+void handleMessages(tLoop *loop)
+{
+    uint64_t count;
+    tMsgPtr m;
+    tConnPtr conn;
+
+    // Reset the eventfd before taking the messages, so no wakeup is lost
+    if (read(loop->evfd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        err(1, "read() from eventfd failed");
+
+    while ((m = popMsg(&loop->queue)) != NULL)
     {
-        if (url[i] == '/' || url[i] == '\0')
+        conn = m->conn;
+
+        switch (m->type)
+        {
+        // Owner of the board creates the response and sends it back
+        // Response buffer travels with the message and the request buffer
+        // stays in the pool of the owner
+        case MSG_REQUEST:
         {
-            if (strcmp(str.str, "boards") == 0)
+            string response;
+            poolGet(loop, &response);
+            walLsn = 0;
+            int code = createResponse(loop->L, &m->rqst, &response, m->data.str, &loop->body);
+            m->lsn = walLsn;
+
+            // Asking shard continues with MSG_CHUNK or parks the watcher
+            if (code == RQ_STREAM || code == RQ_WATCH)
+                paramName(m->data.str, m->rqst.params[0], m->name);
+            if (code == RQ_STREAM)
             {
-                result = true;
-                break;
+                m->pos = m->rqst.window.first;
+                m->last = m->rqst.window.last;
+            }
+            poolPut(loop, &m->data);
+            m->data = response;
+            m->type = MSG_REPLY;
+            sendMsg(m->from, m);
+            continue;
+        }
+
+        case MSG_CHUNK:
+            if (m->json ? exportChunk(loop->L, m->name, &m->pos, &m->data) : getPostsChunk(loop->L, m->name, &m->pos, m->last, &m->data))
+                m->pos = 0;
+            m->type = MSG_CHUNK_REPLY;
+            sendMsg(m->from, m);
+            continue;
+
+        case MSG_LIST:
+            if (isSearch(&m->rqst))
+            {
+                // Hits of the shard replace the request message
+                tQuery query;
+                string hits;
+
+                parseSearch(&m->rqst, m->data.str, &query);
+                poolGet(loop, &hits);
+                searchPosts(loop->L, &query, &hits);
+                poolPut(loop, &m->data);
+                m->data = hits;
             }
             else
             {
-                result = false;
-                break;
+                getBoards(loop->L, &m->data, &m->version);
+            }
+            m->type = MSG_LIST_REPLY;
+            sendMsg(m->from, m);
+            continue;
+
+        // Owner of the board imports the posts, the counts go back
+        case MSG_IMPORT:
+        {
+            int created = 0;
+            walLsn = 0;
+            m->pos = importPosts(loop->L, m->name, m->pos, m->data.str, m->data.length, &created);
+            m->last = created;
+            m->lsn = walLsn;
+            m->type = MSG_IMPORT_REPLY;
+            sendMsg(m->from, m);
+            continue;
+        }
+
+        case MSG_EVENT:
+            deliverEvent(loop, m);
+            unpin(m->pin);
+            freeMsg(loop, m);
+            continue;
+
+        case MSG_UNWATCH:
+            unwatchBoard(loop->L, m->name, m->created, m->from->id);
+            freeMsg(loop, m);
+            continue;
+
+        // Reply to the request of a connection of this shard
+        case MSG_REPLY:
+            conn->pending--;
+            if (m->lsn > conn->walWait)
+                conn->walWait = m->lsn;
+            if (conn->fd != -1)
+            {
+                strAppend(&conn->out, &m->data);
+                if (m->pos != 0)
+                    startStream(loop, conn, m->name, m->pos, m->last);
+                else if (m->rqst.watching != 0)
+                    startWatch(loop, conn, m->name, &m->rqst);
+            }
+            else if (m->rqst.watching != 0)
+            {
+                // Client left before the watch started, the owner forgets it
+                tMsgPtr notice = newMsg(loop, NULL, MSG_UNWATCH);
+                strcpy(notice->name, m->name);
+                notice->created = m->rqst.watching;
+                sendMsg(&loops[hashName(m->name, strlen(m->name)) % loopCount], notice);
+            }
+            break;
+
+        case MSG_CHUNK_REPLY:
+            conn->pending--;
+            if (conn->fd != -1)
+            {
+                strAppend(&conn->out, &m->data);
+                conn->streamPos = m->pos;
+
+                // Export goes on with the next board
+                if (!conn->exporting)
+                    conn->streaming = m->pos != 0;
+                else if (m->pos == 0)
+                    conn->streamName[0] = '\0';
+            }
+            break;
+
+        case MSG_IMPORT_REPLY:
+            conn->pending--;
+            if (m->lsn > conn->walWait)
+                conn->walWait = m->lsn;
+            conn->importPosts += m->pos;
+            conn->importBoards += m->last;
+            break;
+
+        case MSG_LIST_REPLY:
+            conn->pending--;
+            strAppend(&conn->gather, &m->data);
+            conn->gatherVersion += m->version;
+
+            // All shards answered, the names create the response body
+            // or tell the boards of the export, hits are merged
+            if (conn->pending == 0 && conn->fd != -1 && isSearch(&m->rqst))
+            {
+                appendResponse(&conn->out, &m->rqst, searchResponse(&m->rqst, &conn->gather, &conn->body), &conn->body);
             }
+            else if (conn->pending == 0 && conn->fd != -1 && isExport(&m->rqst))
+            {
+                strClear(&conn->body);
+                appendResponse(&conn->out, &m->rqst, RQ_EXPORT, &conn->body);
+                startExport(conn);
+            }
+            else if (conn->pending == 0 && conn->fd != -1)
+            {
+                appendResponse(&conn->out, &m->rqst, boardsResponse(&m->rqst, &conn->gather, conn->gatherVersion), &conn->gather);
+            }
+            break;
+        }
+
+        freeMsg(loop, m);
+
+        if (conn->fd == -1)
+        {
+            // Client left while the request was processed
+            if (conn->pending == 0)
+                freeConnection(conn);
         }
         else
         {
-            strAddChar(&str, url[i]);
+            // Continue with the data received meanwhile
+            processConnection(loop, conn);
+            updateConnection(loop, conn);
         }
     }
-
-    strFree(&str);
-    return result;
 }
 
-// Initialize lists
-void initList(tList *L)
+// Return the message to the free list of the loop
+void freeMsg(tLoop *loop, tMsgPtr m)
 {
-    L->First = NULL;
+    poolPut(loop, &m->data);
+    m->next = loop->freeMsgs;
+    loop->freeMsgs = m;
 }
 
-// Create new board if it does not exists
-int newBoard(tList *L, char name[])
+// Park the connection until the board changes, the board has the watcher
+// of the loop registered already
+// Long-poll waits at most WATCH_TIMEOUT, SSE until the connection is closed
+void startWatch(tLoop *loop, tConnPtr conn, char name[], tRqst *rqst)
 {
-    if (strlen(name) > MAX_NAME)
+    tWatch *watch = loop->watches;
+
+    while (watch != NULL && (watch->created != rqst->watching || strcmp(watch->name, name) != 0))
+        watch = watch->next;
+
+    if (watch == NULL)
     {
-        disposeList(L);
-        fprintf(stderr, "Name is too long!");
-        exit(1);
+        if ((watch = malloc(sizeof(tWatch))) == NULL)
+            err(1, "malloc() failed");
+
+        strcpy(watch->name, name);
+        watch->created = rqst->watching;
+        watch->conns = NULL;
+        watch->next = loop->watches;
+        loop->watches = watch;
+    }
+
+    conn->watch = watch;
+    conn->watchPrev = NULL;
+    conn->watchNext = watch->conns;
+    if (watch->conns != NULL)
+        watch->conns->watchPrev = conn;
+    watch->conns = conn;
+
+    conn->sse = rqst->sse;
+    conn->watchClose = rqst->close;
+    conn->watchHttp10 = rqst->http10;
+
+    // Timeout is the same for all, so the list stays sorted by deadlines
+    if (!conn->sse)
+    {
+        conn->deadline = monotonicMs() + WATCH_TIMEOUT;
+        conn->pollNext = NULL;
+        conn->pollPrev = loop->pollsLast;
+        if (loop->pollsLast != NULL)
+            loop->pollsLast->pollNext = conn;
+        else
+            loop->polls = conn;
+        loop->pollsLast = conn;
     }
+}
+
+// End the watch of the connection
+// release - the board still exists, its watcher of the loop is removed
+void stopWatch(tLoop *loop, tConnPtr conn, bool release)
+{
+    tWatch *watch = conn->watch;
+
+    if (conn->watchPrev != NULL)
+        conn->watchPrev->watchNext = conn->watchNext;
     else
+        watch->conns = conn->watchNext;
+    if (conn->watchNext != NULL)
+        conn->watchNext->watchPrev = conn->watchPrev;
+
+    if (!conn->sse)
+    {
+        if (conn->pollPrev != NULL)
+            conn->pollPrev->pollNext = conn->pollNext;
+        else
+            loop->polls = conn->pollNext;
+        if (conn->pollNext != NULL)
+            conn->pollNext->pollPrev = conn->pollPrev;
+        else
+            loop->pollsLast = conn->pollPrev;
+    }
+
+    conn->watch = NULL;
+
+    // Owner of the board in another shard is told by a message
+    if (release)
     {
-        // Check if board already exists
-        tBoardPtr tmp = findByName(L, name);
-        if (tmp != NULL)
+        int shard = config.shards > 0 ? hashName(watch->name, strlen(watch->name)) % loopCount : loop->id;
+
+        if (shard == loop->id)
+        {
+            unwatchBoard(loop->L, watch->name, watch->created, loop->id);
+        }
+        else
         {
-            return RQ_EXISTS;
+            tMsgPtr m = newMsg(loop, NULL, MSG_UNWATCH);
+            strcpy(m->name, watch->name);
+            m->created = watch->created;
+            sendMsg(&loops[shard], m);
         }
     }
 
-    tBoardPtr newBoard = malloc(sizeof(struct tBoard));
+    // Last watcher of the board in the loop
+    if (watch->conns == NULL)
+    {
+        tWatch **prev = &loop->watches;
 
-    if (newBoard == NULL)
+        while (*prev != watch)
+            prev = &(*prev)->next;
+        *prev = watch->next;
+        free(watch);
+    }
+}
+
+// Give the change of the board to its watchers in the loop
+// Event was rendered once by the writer, watchers only reference it
+void deliverEvent(tLoop *loop, tMsgPtr m)
+{
+    tWatch *watch = loop->watches;
+    tConnPtr conn, next;
+    tRqst rqst;
+
+    while (watch != NULL && (watch->created != m->created || strcmp(watch->name, m->name) != 0))
+        watch = watch->next;
+
+    if (watch == NULL)
+        return;
+
+    // Watchers can leave and the watch can be freed meanwhile
+    for (conn = watch->conns; conn != NULL; conn = next)
     {
-        disposeList(L);
-        fprintf(stderr, "Malloc error!");
-        exit(1);
+        next = conn->watchNext;
+
+        if (conn->sse)
+        {
+            atomic_fetch_add(&m->pin->refs, 1);
+            strAddRef(&conn->out, m->event, m->sseLength, m->pin);
+
+            // Stream ends with the board
+            if (m->deleted)
+            {
+                stopWatch(loop, conn, false);
+                conn->eof = true;
+            }
+        }
+        else
+        {
+            // Long-poll gets the change as its response
+            memset(&rqst, 0, sizeof(tRqst));
+            rqst.close = conn->watchClose;
+            rqst.http10 = conn->watchHttp10;
+            strClear(&conn->body);
+
+            if (!m->deleted)
+            {
+                atomic_fetch_add(&m->pin->refs, 1);
+                strAddRef(&conn->body, m->event + m->sseLength, m->pollLength, m->pin);
+                sprintf(rqst.extra, "X-Board-Version: %u\r\nX-Delta: %s\r\n", m->version, m->full ? "full" : "changes");
+            }
+
+            appendResponse(&conn->out, &rqst, m->deleted ? RQ_NOT_FOUND : RQ_OK, &conn->body);
+            stopWatch(loop, conn, !m->deleted);
+            processConnection(loop, conn);
+        }
+
+        updateConnection(loop, conn);
+    }
+}
+
+// Answer the long-polls after their deadline with 304, the board did not change
+void expireWatches(tLoop *loop)
+{
+    long long now = monotonicMs();
+    tRqst rqst;
+
+    while (loop->polls != NULL && loop->polls->deadline <= now)
+    {
+        tConnPtr conn = loop->polls;
+
+        memset(&rqst, 0, sizeof(tRqst));
+        rqst.close = conn->watchClose;
+        rqst.http10 = conn->watchHttp10;
+        strClear(&conn->body);
+
+        appendResponse(&conn->out, &rqst, RQ_NOT_MODIFIED, &conn->body);
+        stopWatch(loop, conn, true);
+        processConnection(loop, conn);
+        updateConnection(loop, conn);
+    }
+}
+
+// Time in ms for the deadlines, it does not jump with the wall clock
+long long monotonicMs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Time ms from now for pthread_cond_timedwait
+void absTime(long long ms, struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// Park the connection until the log with its changes is on the disk
+// Returns false when the changes are there already
+bool waitForLog(tLoop *loop, tConnPtr conn)
+{
+    if (conn->walWait <= atomic_load(&wal.durable))
+        return false;
+
+    if (!conn->walWaiting)
+    {
+        conn->walWaiting = true;
+        conn->walPrev = NULL;
+        conn->walNext = loop->walWaiters;
+        if (loop->walWaiters != NULL)
+            loop->walWaiters->walPrev = conn;
+        loop->walWaiters = conn;
+        atomic_fetch_add(&loop->walWaiting, 1);
+    }
+
+    // Log thread could write the frames before it saw the waiter
+    if (conn->walWait > atomic_load(&wal.durable))
+        return true;
+
+    unparkLog(loop, conn);
+    return false;
+}
+
+// Remove the connection from the waiters for the log
+void unparkLog(tLoop *loop, tConnPtr conn)
+{
+    if (conn->walPrev != NULL)
+        conn->walPrev->walNext = conn->walNext;
+    else
+        loop->walWaiters = conn->walNext;
+    if (conn->walNext != NULL)
+        conn->walNext->walPrev = conn->walPrev;
+
+    conn->walWaiting = false;
+    atomic_fetch_sub(&loop->walWaiting, 1);
+}
+
+// Send the responses whose changes are on the disk now
+void releaseLogWaiters(tLoop *loop)
+{
+    unsigned long durable = atomic_load(&wal.durable);
+    tConnPtr conn = loop->walWaiters, next;
+
+    while (conn != NULL)
+    {
+        next = conn->walNext;
+        if (conn->walWait <= durable)
+        {
+            unparkLog(loop, conn);
+            updateConnection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// Open the store and the log, replay the log to the boards and start the log thread
+// Torn frame at the end (a crash during the write) is cut off
+// Log of the previous generation is left by a crash between the renames
+// of the snapshot, the store already contains its beginning
+void walOpen(tList *L)
+{
+    struct stat st;
+    size_t valid = 0, from = 0;
+    unsigned int gen;
+    int fd;
+
+    initCrc();
+
+    wal.snapshotPath = walPath(".snap");
+    wal.snapshotBlock = malloc(SNAPSHOT_BLOCK);
+    wal.snapshotOffsets = malloc(SNAPSHOT_OFFSETS * sizeof(uint64_t));
+    if (wal.snapshotBlock == NULL || wal.snapshotOffsets == NULL)
+        err(1, "malloc() failed");
+    wal.newPath = walPath(".new");
+    store.path = walPath(".store");
+
+    // Snapshot interrupted by the end of the server is not complete
+    unlink(wal.snapshotPath);
+    unlink(wal.newPath);
+
+    storeOpen(L);
+
+    if ((fd = open(config.wal, O_RDWR | O_CREAT, 0644)) == -1 || fstat(fd, &st) == -1)
+        err(1, "%s", config.wal);
+
+    char *data = NULL;
+    if (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        err(1, "mmap() failed");
+
+    gen = st.st_size > 0 ? walBase(data, st.st_size) : store.gen;
+    if (gen + 1 == store.gen && store.skip <= (uint64_t)st.st_size)
+        from = store.skip;
+    else if (gen != store.gen)
+        errx(1, "%s does not continue %s", config.wal, store.path);
+
+    if (st.st_size > 0)
+    {
+        walReplay(L, data + from, st.st_size - from, &valid);
+        valid += from;
+        munmap(data, st.st_size);
+    }
+
+    if (gen != store.gen || (st.st_size == 0 && store.gen > 0))
+    {
+        // Log starts with the generation of the store
+        off_t size;
+        wal.fd = fd;
+        int newFd = walNewLog(store.gen, from, valid, &size);
+        if (newFd == -1 || rename(wal.newPath, config.wal) == -1)
+            err(1, "%s", config.wal);
+        syncDir(config.wal);
+        close(fd);
+        fd = newFd;
+        valid = size;
+    }
+    else
+    {
+        if (valid < (size_t)st.st_size && ftruncate(fd, valid) == -1)
+            err(1, "%s", config.wal);
+        if (lseek(fd, valid, SEEK_SET) == -1)
+            err(1, "%s", config.wal);
+    }
+
+    // Changes are logged from now on
+    wal.fd = fd;
+    wal.active = true;
+    wal.gen = store.gen;
+    wal.appended = valid;
+    atomic_init(&wal.durable, valid);
+    wal.origin = 0;
+    wal.size = valid;
+    wal.compacted = valid;
+    wal.snapshot = 0;
+    wal.snapshotAt = monotonicMs();
+    atomic_init(&wal.pausing, false);
+    pthread_barrier_init(&wal.paused, NULL, loopCount + 1);
+    pthread_barrier_init(&wal.resumed, NULL, loopCount + 1);
+    strInit(&wal.pending);
+    wal.frames = 0;
+    pthread_mutex_init(&wal.lock, NULL);
+    pthread_cond_init(&wal.cond, NULL);
+    wal.shipped = valid;
+    wal.shipSkip = 0;
+    pthread_mutex_init(&wal.shipLock, NULL);
+    pthread_cond_init(&wal.shipCond, NULL);
+
+    if (pthread_create(&wal.thread, NULL, walWriter, NULL) != 0)
+        errx(1, "pthread_create() failed");
+}
+
+// Generation of the store the log continues, logs without the base frame
+// are older than the first store
+unsigned int walBase(char data[], size_t size)
+{
+    uint32_t length, crc;
+    int gen;
+
+    if (size < WAL_HEADER)
+        return 0;
+
+    memcpy(&length, data, 4);
+    memcpy(&crc, data + 4, 4);
+    if (length < 10 || length > size - WAL_HEADER || crc32(data + WAL_HEADER, length) != crc || data[WAL_HEADER] != W_BASE)
+        return 0;
+
+    memcpy(&gen, data + WAL_HEADER + 2, 4);
+    return gen;
+}
+
+// Path of the file next to the log
+char *walPath(const char *suffix)
+{
+    char *path = malloc(strlen(config.wal) + strlen(suffix) + 1);
+
+    if (path == NULL)
+        err(1, "malloc() failed");
+
+    sprintf(path, "%s%s", config.wal, suffix);
+    return path;
+}
+
+// Apply the frames of the log, valid gets the end of the last complete frame
+void walReplay(tList *L, char data[], size_t size, size_t *valid)
+{
+    uint32_t length, crc;
+    size_t pos = 0;
+
+    while (size - pos >= WAL_HEADER)
+    {
+        memcpy(&length, data + pos, 4);
+        memcpy(&crc, data + pos + 4, 4);
+
+        if (length > size - pos - WAL_HEADER || crc32(data + pos + WAL_HEADER, length) != crc)
+            break;
+
+        walApply(L, data + pos + WAL_HEADER, length);
+        pos += WAL_HEADER + length;
+    }
+
+    *valid = pos;
+}
+
+// Apply the changes of one frame, a change is the type, the board name
+// with its length, the ID and the content with its length
+// Boards go to their shards, the log does not depend on the number of shards
+void walApply(tList *L, char ops[], int length)
+{
+    char name[MAX_NAME];
+    int pos = 0, id, contentLength, nameLength;
+
+    while (length - pos >= 2)
+    {
+        char type = ops[pos];
+        nameLength = (unsigned char)ops[pos + 1];
+        if (nameLength >= MAX_NAME || length - pos - 2 - nameLength < 8)
+            return;
+
+        memcpy(name, ops + pos + 2, nameLength);
+        name[nameLength] = '\0';
+        pos += 2 + nameLength;
+        memcpy(&id, ops + pos, 4);
+        memcpy(&contentLength, ops + pos + 4, 4);
+        pos += 8;
+        if (contentLength < 0 || contentLength > length - pos)
+            return;
+
+        tList *owner = boardOwner(L, name, nameLength);
+
+        switch (type)
+        {
+        case W_NEW_BOARD:
+            newBoard(owner, name);
+            break;
+        case W_DELETE_BOARD:
+            deleteBoard(owner, name);
+            break;
+        case W_INSERT:
+            insertPost(owner, name, id, ops + pos, contentLength);
+            break;
+        case W_CHANGE:
+            changePost(owner, name, id, ops + pos, contentLength);
+            break;
+        case W_DELETE:
+            deletePost(owner, name, id);
+            break;
+        }
+
+        pos += contentLength;
+    }
+}
+
+// List of the board, shards own the boards by the hash of the name
+tList *boardOwner(tList *L, const char *name, int length)
+{
+    return config.shards > 0 ? &loops[hashName(name, length) % loopCount].list : L;
+}
+
+// Log thread, writes the pending frames and syncs them according to the mode
+// Frames appended during the write or fsync form the next group
+// Snapshots are started and finished between the groups
+void *walWriter(void *arg)
+{
+    string group;
+    unsigned long end;
+    int expected = 0;   // frames of the previous group
+    bool dirty = false; // written frames are not synced yet
+    long long synced = monotonicMs();
+
+    strInit(&group);
+
+    while (1)
+    {
+        pthread_mutex_lock(&wal.lock);
+
+        // Interval mode syncs the written frames after the window at the latest,
+        // the running snapshot is checked and the next one started in time
+        while (wal.pending.length == 0)
+        {
+            long long deadline = walDeadline(dirty, synced);
+            if (deadline == 0)
+            {
+                pthread_cond_wait(&wal.cond, &wal.lock);
+                continue;
+            }
+
+            long long left = deadline - monotonicMs();
+            if (left <= 0)
+                break;
+
+            struct timespec ts;
+            absTime(left, &ts);
+            if (pthread_cond_timedwait(&wal.cond, &wal.lock, &ts) == ETIMEDOUT)
+                break;
+        }
+
+        // Lone change is written at once, changes of other connections
+        // join the group during its fsync
+        // Clients of the previous group send their next changes right after
+        // its responses, so the group waits for as many frames as it had,
+        // at most for the window, otherwise a group of one frame and a group
+        // of the rest would alternate
+        if (config.walMode == WAL_BATCH && config.walWindow > 0 && wal.frames > 0 && wal.frames < expected)
+        {
+            struct timespec ts;
+            absTime(config.walWindow, &ts);
+
+            while (wal.frames < expected && pthread_cond_timedwait(&wal.cond, &wal.lock, &ts) != ETIMEDOUT)
+                ;
+        }
+        expected = wal.frames;
+        wal.frames = 0;
+
+        string tmp = group;
+        group = wal.pending;
+        wal.pending = tmp;
+        end = wal.appended;
+        pthread_mutex_unlock(&wal.lock);
+
+        if (!writeAll(wal.fd, group.str, group.length))
+            err(1, "write() to the log failed");
+        wal.size += group.length;
+        if (group.length > 0)
+            dirty = config.walMode != WAL_NONE;
+        strClear(&group);
+
+        if (dirty && (config.walMode == WAL_BATCH || monotonicMs() >= synced + config.walWindow))
+        {
+            if (fdatasync(wal.fd) == -1)
+                err(1, "fdatasync() of the log failed");
+            dirty = false;
+            synced = monotonicMs();
+        }
+
+        // Frames up to the snapshot are written, the file can be replaced
+        walSnapshotStep();
+
+        if (dirty)
+            continue;
+
+        // Shipping threads send the durable frames to the followers
+        pthread_mutex_lock(&wal.shipLock);
+        wal.shipped = wal.size;
+        pthread_cond_broadcast(&wal.shipCond);
+        pthread_mutex_unlock(&wal.shipLock);
+
+        // Loops with waiting responses send them now
+        atomic_store(&wal.durable, end);
+        for (int i = 0; i < loopCount; i++)
+        {
+            uint64_t one = 1;
+            if (atomic_load(&loops[i].walWaiting) > 0 && write(loops[i].evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+                err(1, "write() to eventfd failed");
+        }
+    }
+
+    return NULL;
+}
+
+// Time the log thread has to wake up at without new frames, 0 - none
+long long walDeadline(bool dirty, long long synced)
+{
+    long long deadline = 0;
+
+    if (dirty)
+        deadline = synced + config.walWindow;
+
+    if (wal.snapshot != 0)
+    {
+        long long poll = monotonicMs() + SNAPSHOT_POLL;
+        if (deadline == 0 || poll < deadline)
+            deadline = poll;
+    }
+    else if (config.snapshotInterval > 0 && wal.size > wal.compacted)
+    {
+        long long next = wal.snapshotAt + config.snapshotInterval * 1000LL;
+        if (deadline == 0 || next < deadline)
+            deadline = next;
+    }
+
+    return deadline;
+}
+
+// Finish the running snapshot or start a new one when the log grew enough
+void walSnapshotStep()
+{
+    int status;
+
+    if (wal.snapshot != 0)
+    {
+        pid_t pid = waitpid(wal.snapshot, &status, WNOHANG);
+        if (pid == 0)
+            return;
+
+        wal.snapshot = 0;
+        if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !walCompact())
+        {
+            warnx("snapshot of the boards failed, the log is kept");
+            unlink(wal.snapshotPath);
+        }
+        return;
+    }
+
+    bool bySize = config.snapshotSize > 0 && wal.size - wal.compacted >= (off_t)config.snapshotSize * 1048576;
+    bool byTime = config.snapshotInterval > 0 && wal.size > wal.compacted && monotonicMs() >= wal.snapshotAt + config.snapshotInterval * 1000LL;
+
+    if (bySize || byTime)
+        walSnapshotStart();
+}
+
+// Fork the child writing the snapshot, loops wait at the barrier meanwhile,
+// so every change in the copy of the child is logged before the LSN
+// of the snapshot and no change after it is
+void walSnapshotStart()
+{
+    atomic_store(&wal.pausing, true);
+    for (int i = 0; i < loopCount; i++)
+    {
+        uint64_t one = 1;
+        if (write(loops[i].evfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            err(1, "write() to eventfd failed");
+    }
+    pthread_barrier_wait(&wal.paused);
+
+    pthread_mutex_lock(&wal.lock);
+    wal.snapshotLsn = wal.appended;
+    pthread_mutex_unlock(&wal.lock);
+
+    pid_t pid = fork();
+    if (pid == 0)
+        walSnapshotWrite();
+
+    atomic_store(&wal.pausing, false);
+    pthread_barrier_wait(&wal.resumed);
+
+    wal.snapshotAt = monotonicMs();
+    if (pid == -1)
+        warn("fork() of the snapshot failed");
+    else
+        wal.snapshot = pid;
+}
+
+// Child writes its copy of the boards to the store, the directory lists
+// the boards of a list from the last one, so the startup creates them
+// in the same order
+// Other threads of the parent (log, shipping) could hold the locks of malloc()
+// at the fork(), so the child only uses the buffers allocated before it
+// and does not lock the boards, stored boards not loaded yet are copied
+// from the offsets of the mapped store
+void walSnapshotWrite()
+{
+    tStoreHeader header;
+    tSnapshot s;
+    int boards = 0, k = 0;
+    uint64_t posts = 0;
+
+    // Parent serves the clients, the snapshot can wait
+    // Copies of the sockets would keep the closed connections open
+    closefrom(3);
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    if ((s.fd = open(wal.snapshotPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        _exit(1);
+
+    // Sizes of the boards give the place of the tables
+    for (int i = 0; i < (config.shards > 0 ? loopCount : 1); i++)
+    {
+        for (tBoardPtr B = loops[i].L->First; B != NULL; B = B->nPtr, boards++)
+            posts += atomic_load(&B->unloaded) ? B->storedCount : B->posts->size;
+    }
+
+    s.block = wal.snapshotBlock;
+    s.used = 0;
+    s.table = sizeof(header) + boards * sizeof(tStoreBoard);
+    s.written = s.table + posts * sizeof(uint64_t);
+    s.offsets = wal.snapshotOffsets;
+    s.offsetCount = 0;
+
+    for (int i = 0; i < (config.shards > 0 ? loopCount : 1); i++)
+    {
+        tBoardPtr last = loops[i].L->First;
+
+        while (last != NULL && last->nPtr != NULL)
+            last = last->nPtr;
+
+        for (tBoardPtr B = last; B != NULL; B = B->pPtr, k++)
+        {
+            tStoreBoard entry;
+
+            memset(&entry, 0, sizeof(entry));
+            entry.table = s.table + s.offsetCount * sizeof(uint64_t);
+            entry.nameLength = B->nameLength;
+            memcpy(entry.name, B->name, B->nameLength);
+
+            if (atomic_load(&B->unloaded))
+            {
+                for (int j = 0; j < B->storedCount; j++)
+                {
+                    tElemPtr post = storeRecord(B->arena.pin->mapping, B->stored[j]);
+                    if (post == NULL || !snapshotPost(&s, post))
+                        _exit(1);
+                }
+                entry.posts = B->storedCount;
+            }
+            else
+            {
+                for (tNodePtr leaf = treeFirst(B->posts); leaf != NULL; leaf = leaf->next)
+                {
+                    for (int n = 0; n < leaf->count; n++)
+                    {
+                        if (!snapshotPost(&s, leaf->items[n]))
+                            _exit(1);
+                    }
+                }
+                entry.posts = B->posts->size;
+            }
+
+            if (!snapshotWrite(s.fd, sizeof(header) + k * sizeof(tStoreBoard), &entry, sizeof(entry)))
+                _exit(1);
+        }
+    }
+
+    if (!snapshotWrite(s.fd, s.table, s.offsets, s.offsetCount * sizeof(uint64_t)) ||
+        !snapshotWrite(s.fd, s.written, s.block, s.used))
+        _exit(1);
+
+    memcpy(header.magic, STORE_MAGIC, 4);
+    header.gen = wal.gen + 1;
+    header.skip = wal.snapshotLsn - wal.origin;
+    header.boards = boards;
+    header.reserved = 0;
+    if (!snapshotWrite(s.fd, 0, &header, sizeof(header)))
+        _exit(1);
+
+    _exit(fdatasync(s.fd) == -1 || close(s.fd) == -1 ? 1 : 0);
+}
+
+// Add the record of the post to the snapshot and its offset to the table
+bool snapshotPost(tSnapshot *s, tElemPtr post)
+{
+    unsigned int head[2] = {post->length, STORE_GEN};
+    size_t size = recordSize(post->length);
+    static const char padding[8];
+
+    if (s->offsetCount == SNAPSHOT_OFFSETS)
+    {
+        if (!snapshotWrite(s->fd, s->table, s->offsets, s->offsetCount * sizeof(uint64_t)))
+            return false;
+        s->table += s->offsetCount * sizeof(uint64_t);
+        s->offsetCount = 0;
+    }
+    s->offsets[s->offsetCount++] = s->written + s->used;
+
+    return snapshotData(s, (char *)head, sizeof(head)) && snapshotData(s, post->data, post->length + 1) &&
+           snapshotData(s, padding, size - sizeof(head) - post->length - 1);
+}
+
+// Copy the data to the block of the records, full block is written
+bool snapshotData(tSnapshot *s, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t n = SNAPSHOT_BLOCK - s->used < length ? SNAPSHOT_BLOCK - s->used : length;
+
+        memcpy(s->block + s->used, data, n);
+        s->used += n;
+        data += n;
+        length -= n;
+
+        if (s->used == SNAPSHOT_BLOCK)
+        {
+            if (!snapshotWrite(s->fd, s->written, s->block, s->used))
+                return false;
+            s->written += s->used;
+            s->used = 0;
+        }
+    }
+
+    return true;
+}
+
+// Write the data to the offset of the snapshot file
+bool snapshotWrite(int fd, uint64_t offset, const void *data, size_t length)
+{
+    return lseek(fd, offset, SEEK_SET) != -1 && writeAll(fd, data, length);
+}
+
+// Replace the store by the snapshot and the log by the frames logged since the fork
+// Store is renamed first, after a crash between the renames the current log
+// is still valid with the skip of the new store
+// Shipping threads open the files of one generation, they wait for the renames
+bool walCompact()
+{
+    off_t size, from = wal.snapshotLsn - wal.origin;
+    int fd = walNewLog(wal.gen + 1, from, wal.size, &size);
+
+    if (fd == -1)
+        return false;
+
+    pthread_mutex_lock(&wal.shipLock);
+    if (rename(wal.snapshotPath, store.path) == -1)
+    {
+        pthread_mutex_unlock(&wal.shipLock);
+        close(fd);
+        unlink(wal.newPath);
+        return false;
+    }
+    syncDir(store.path);
+
+    if (rename(wal.newPath, config.wal) == -1)
+    {
+        pthread_mutex_unlock(&wal.shipLock);
+        close(fd);
+        unlink(wal.newPath);
+        return false;
+    }
+    syncDir(config.wal);
+
+    close(wal.fd);
+    wal.fd = fd;
+    wal.gen++;
+    wal.origin = wal.snapshotLsn - (size - (wal.size - from));
+    wal.size = size;
+    wal.compacted = size;
+    wal.shipped = size;
+    wal.shipSkip = from;
+    pthread_cond_broadcast(&wal.shipCond);
+    pthread_mutex_unlock(&wal.shipLock);
+    return true;
+}
+
+// Write the log of the generation to the new file, the base frame is followed
+// by the frames of the current log between the offsets
+// Returns the descriptor of the synced file or -1
+int walNewLog(unsigned int gen, off_t from, off_t to, off_t *size)
+{
+    char buffer[65536];
+    string frame;
+    int fd;
+
+    if ((fd = open(wal.newPath, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
+        return -1;
+
+    if (strInit(&frame) != STR_SUCCESS)
+        err(1, "malloc() failed");
+    walFrameStart(&frame);
+    walFrameOp(&frame, W_BASE, "", 0, gen, NULL, 0);
+    walFrameSeal(&frame);
+    bool ok = writeAll(fd, frame.str, frame.length);
+    *size = frame.length + (to - from);
+    strFree(&frame);
+
+    for (off_t pos = from; ok && pos < to;)
+    {
+        ssize_t n = pread(wal.fd, buffer, sizeof(buffer) < (size_t)(to - pos) ? sizeof(buffer) : (size_t)(to - pos), pos);
+        ok = n > 0 && writeAll(fd, buffer, n);
+        pos += n;
+    }
+
+    if (!ok || fdatasync(fd) == -1)
+    {
+        close(fd);
+        unlink(wal.newPath);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Sync the directory of the file, so the rename survives a crash
+void syncDir(const char *path)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    snprintf(dir, sizeof(dir), "%.*s", slash == NULL ? 1 : (int)(slash - path + 1), slash == NULL ? "." : path);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Write all the data, interrupted writes continue
+bool writeAll(int fd, const char *data, size_t length)
+{
+    for (size_t pos = 0; pos < length;)
+    {
+        ssize_t n = write(fd, data + pos, length - pos);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        pos += n;
+    }
+
+    return true;
+}
+
+// Map the store and create its boards, their posts are loaded on the first
+// use, so the startup does not depend on the number of the posts
+void storeOpen(tList *L)
+{
+    int fd;
+
+    store.gen = 0;
+    store.skip = 0;
+
+    if ((fd = open(store.path, O_RDONLY)) == -1)
+    {
+        if (errno == ENOENT)
+            return;
+        err(1, "%s", store.path);
+    }
+
+    if (!storeMap(L, fd, false))
+        exit(1);
+    close(fd);
+}
+
+// Map the store file and replace the boards by its boards
+// Boards are built on the side and swapped in at once, the loops serve
+// the previous boards until then
+// Records are checked right away with verify (store from the network),
+// otherwise when the board is loaded
+// Returns false when the store can not be used, the boards are kept then
+bool storeMap(tList *L, int fd, bool verify)
+{
+    struct stat st;
+    tStoreHeader header;
+    tMapping *m = malloc(sizeof(tMapping));
+    tList *side = sideLists();
+    bool valid = false;
+
+    if (m == NULL)
+        err(1, "malloc() failed");
+    atomic_init(&m->refs, 1);
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header))
+    {
+        warnx("%s is corrupted", store.path);
+        free(m);
+        replaceBoards(NULL, side);
+        return false;
+    }
+
+    m->size = st.st_size;
+    if ((m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        warn("mmap() of %s failed", store.path);
+        free(m);
+        replaceBoards(NULL, side);
+        return false;
+    }
+
+    memcpy(&header, m->map, sizeof(header));
+    if (memcmp(header.magic, STORE_MAGIC, 4) == 0 && header.boards <= (m->size - sizeof(header)) / sizeof(tStoreBoard))
+    {
+        tStoreBoard *directory = (tStoreBoard *)(m->map + sizeof(header));
+        valid = true;
+
+        for (unsigned int i = 0; i < header.boards && valid; i++)
+            valid = storeBoard(m, &directory[i], side, verify);
+    }
+
+    if (!valid)
+    {
+        warnx("%s is corrupted", store.path);
+        replaceBoards(NULL, side);
+    }
+    else
+    {
+        replaceBoards(L, side);
+        store.gen = header.gen;
+        store.skip = header.skip;
+    }
+
+    releaseMapping(m);
+    return valid;
+}
+
+// Create the board of the directory entry in its side list
+// Returns false when the entry or its records (with verify) are corrupted
+bool storeBoard(tMapping *m, tStoreBoard *entry, tList side[], bool verify)
+{
+    char name[MAX_NAME];
+
+    if (entry->nameLength == 0 || entry->nameLength >= MAX_NAME || memchr(entry->name, '\0', entry->nameLength) != NULL ||
+        entry->table % 8 != 0 || entry->table > m->size || entry->posts > (m->size - entry->table) / sizeof(uint64_t))
+        return false;
+
+    const uint64_t *offsets = (const uint64_t *)(m->map + entry->table);
+    for (uint32_t i = 0; verify && i < entry->posts; i++)
+    {
+        if (storeRecord(m, offsets[i]) == NULL)
+            return false;
+    }
+
+    memcpy(name, entry->name, entry->nameLength);
+    name[entry->nameLength] = '\0';
+
+    tList *owner = &side[config.shards > 0 ? hashName(name, entry->nameLength) % loopCount : 0];
+    if (newBoard(owner, name) != RQ_CREATED)
+        return false;
+
+    tBoardPtr B = findByName(owner, name);
+    freeNode(&B->arena, B->posts);
+    B->posts = NULL;
+    B->stored = offsets;
+    B->storedCount = entry->posts;
+    B->arena.pin->mapping = m;
+    atomic_fetch_add(&m->refs, 1);
+    atomic_store(&B->unloaded, true);
+    return true;
+}
+
+// Record of the post in the mapped store, NULL when it is not inside the store
+tElemPtr storeRecord(tMapping *m, uint64_t offset)
+{
+    if (offset % 8 != 0 || offset > m->size - sizeof(struct tElem))
+        return NULL;
+
+    tElemPtr post = (tElemPtr)(m->map + offset);
+    if (post->length >= m->size - offset - sizeof(struct tElem))
+        return NULL;
+
+    return post;
+}
+
+// Release a reference to the mapping, the last one unmaps the store
+void releaseMapping(tMapping *m)
+{
+    if (m != NULL && atomic_fetch_sub(&m->refs, 1) == 1)
+    {
+        munmap(m->map, m->size);
+        free(m);
+    }
+}
+
+// Empty lists for the boards built on the side, one per list of the loops
+tList *sideLists()
+{
+    int count = config.shards > 0 ? loopCount : 1;
+    tList *side = malloc(count * sizeof(tList));
+
+    if (side == NULL)
+        err(1, "malloc() failed");
+
+    for (int i = 0; i < count; i++)
+        initList(&side[i], false);
+
+    return side;
+}
+
+// Replace the boards of all lists by the boards of the side lists,
+// the previous boards are freed with the side lists
+// NULL list only frees the side lists
+void replaceBoards(tList *L, tList side[])
+{
+    for (int i = 0; i < (config.shards > 0 ? loopCount : 1); i++)
+    {
+        if (L != NULL)
+            swapBoards(config.shards > 0 ? &loops[i].list : L, &side[i]);
+
+        disposeList(&side[i]);
+        free(side[i].table.slots);
+        pthread_rwlock_destroy(&side[i].lock);
+        pthread_mutex_destroy(&side[i].cache.lock);
+    }
+
+    free(side);
+}
+
+// Exchange the boards of the list with the boards of the side list
+// under the write lock, readers see either all the previous boards or all
+// the new ones, versions continue the clock of the list, so the tags
+// of the previous boards do not match
+void swapBoards(tList *L, tList *side)
+{
+    lockList(L, true);
+
+    tBoardPtr First = L->First;
+    tTable table = L->table, old = L->old;
+    int count = L->count;
+
+    L->First = side->First;
+    L->table = side->table;
+    L->old = side->old;
+    L->migrated = side->migrated;
+    L->count = side->count;
+    L->version++;
+
+    for (tBoardPtr B = L->First; B != NULL; B = B->nPtr)
+    {
+        B->version = atomic_fetch_add(&L->clock, 1) + 1;
+        B->base = B->version;
+        B->created = L->version;
+    }
+
+    // Watchers learn that the previous boards are gone
+    for (tBoardPtr B = First; B != NULL; B = B->nPtr)
+    {
+        if (B->watching != NULL)
+            notifyWatchers(L, B, B->version, true);
+
+        lockCache(L);
+        if (B->cache != NULL)
+            cacheEvict(L, B->cache);
+        unlockCache(L);
+    }
+
+    unlockList(L);
+
+    side->First = First;
+    side->table = table;
+    side->old = old;
+    side->migrated = 0;
+    side->count = count;
+}
+
+// Build the tree of the stored posts on the first use of the board
+// Posts stay in the mapped pages, only the nodes are allocated
+// The request using the board first waits for it under the board write lock,
+// the build is linear in the posts but does not read them, the posts are
+// tokenized only by the first search (buildIndex)
+// Changes stay in the memory of the board, the next snapshot merges them
+// to a new store
+// Records of a local store are checked here, a corrupted one breaks only
+// its board, it stays unloaded and its requests get RQ_BROKEN
+// Returns false when the board is broken
+bool loadStoredPosts(tList *L, tBoardPtr B)
+{
+    if (L->shared)
+        pthread_rwlock_wrlock(&B->lock);
+
+    if (atomic_load(&B->unloaded) && !atomic_load(&B->broken))
+    {
+        int i = 0;
+        while (i < B->storedCount && storeRecord(B->arena.pin->mapping, B->stored[i]) != NULL)
+            i++;
+
+        if (i < B->storedCount)
+        {
+            warnx("%s is corrupted, board %s is not served", store.path, B->name);
+            atomic_store(&B->broken, true);
+        }
+        else
+        {
+            B->posts = treeLoad(&B->arena, B->stored, B->storedCount);
+            atomic_store(&B->unindexed, true);
+            atomic_store(&B->unloaded, false);
+        }
+    }
+
+    if (L->shared)
+        pthread_rwlock_unlock(&B->lock);
+    return !atomic_load(&B->broken);
+}
+
+// Log the change, caller holds the lock of the board (or the list),
+// so the changes of a board are logged in the order they are applied
+void walRecord(char type, const char *name, int nameLength, int id, const char *content, int length)
+{
+    if (!wal.active)
+        return;
+
+    if (!walGroup)
+        walFrameStart(&walFrame);
+
+    walFrameOp(&walFrame, type, name, nameLength, id, content, length);
+
+    if (!walGroup)
+        walAppend(&walFrame);
+}
+
+// Collect the following changes to one frame, they are replayed together
+void walBegin()
+{
+    if (!wal.active)
+        return;
+
+    walFrameStart(&walFrame);
+    walGroup = true;
+}
+
+// Log the changes collected since walBegin
+void walEnd()
+{
+    if (!wal.active)
+        return;
+
+    walGroup = false;
+    if (walFrame.length > WAL_HEADER)
+        walAppend(&walFrame);
+}
+
+// Add the frame to the pending frames of the log thread
+void walAppend(string *frame)
+{
+    walFrameSeal(frame);
+
+    pthread_mutex_lock(&wal.lock);
+    strAddData(&wal.pending, frame->str, frame->length);
+    wal.appended += frame->length;
+    wal.frames++;
+    if (config.walMode == WAL_BATCH)
+        walLsn = wal.appended;
+    pthread_cond_signal(&wal.cond);
+    pthread_mutex_unlock(&wal.lock);
+}
+
+// Start an empty frame, its header is written by walFrameSeal
+void walFrameStart(string *frame)
+{
+    if (frame->str == NULL)
+        strInit(frame);
+    strClear(frame);
+    strAddData(frame, "\0\0\0\0\0\0\0\0", WAL_HEADER);
+}
+
+// Add the change to the frame
+void walFrameOp(string *frame, char type, const char *name, int nameLength, int id, const char *content, int length)
+{
+    char head[2 + MAX_NAME + 8];
+
+    head[0] = type;
+    head[1] = nameLength;
+    memcpy(head + 2, name, nameLength);
+    memcpy(head + 2 + nameLength, &id, 4);
+    memcpy(head + 6 + nameLength, &length, 4);
+    strAddData(frame, head, 10 + nameLength);
+    if (length > 0)
+        strAddData(frame, content, length);
+}
+
+// Header of the frame is the length and the CRC-32 of the changes
+void walFrameSeal(string *frame)
+{
+    uint32_t length = frame->length - WAL_HEADER;
+    uint32_t crc = crc32(frame->str + WAL_HEADER, length);
+
+    memcpy(frame->str, &length, 4);
+    memcpy(frame->str + 4, &crc, 4);
+}
+
+// Table of the CRC-32 (IEEE) remainders of the bytes
+void initCrc()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+// CRC-32 of the data
+uint32_t crc32(const char *data, size_t length)
+{
+    uint32_t c = 0xFFFFFFFF;
+
+    for (size_t i = 0; i < length; i++)
+        c = crcTable[(c ^ (unsigned char)data[i]) & 0xFF] ^ (c >> 8);
+
+    return c ^ 0xFFFFFFFF;
+}
+
+// Hand the connection of a follower to its shipping thread
+// ?from=<gen>.<offset> continues the log from the position, otherwise the store
+// goes first and the log follows from its beginning, both are opened under
+// the lock, so they are of the same generation
+// Loop closes its descriptor, the thread sends through a copy of the socket
+void startShipping(tConnPtr conn, tRqst *rqst, char msg[])
+{
+    char query[64];
+    unsigned int gen;
+    long long pos;
+    pthread_t thread;
+    pthread_attr_t attr;
+    tShip *ship = malloc(sizeof(tShip));
+
+    if (ship == NULL)
+        err(1, "malloc() failed");
+
+    sliceCopy(msg, rqst->query, query, sizeof(query));
+    bool resume = sscanf(query, "from=%u.%lld", &gen, &pos) == 2;
+
+    ship->storeFd = -1;
+    ship->file = -1;
+    pthread_mutex_lock(&wal.shipLock);
+    if (!resume)
+    {
+        gen = wal.gen;
+        pos = 0;
+        ship->storeFd = open(store.path, O_RDONLY);
+    }
+    bool gone = gen != wal.gen || pos < 0 || pos > wal.shipped;
+    if (!gone)
+        ship->file = open(config.wal, O_RDONLY);
+    pthread_mutex_unlock(&wal.shipLock);
+
+    // No more requests on the connection
+    conn->eof = true;
+
+    if (gone)
+    {
+        // Position is not in the log anymore, the follower starts again with the store
+        strClear(&conn->body);
+        rqst->close = true;
+        appendResponse(&conn->out, rqst, RQ_GONE, &conn->body);
+        free(ship);
+        return;
+    }
+
+    ship->gen = gen;
+    ship->pos = pos;
+    ship->fd = dup(conn->fd);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (ship->file == -1 || ship->fd == -1 || pthread_create(&thread, &attr, shipLog, ship) != 0)
+    {
+        warnx("shipping of the log to a follower failed");
+        close(ship->file);
+        close(ship->fd);
+        close(ship->storeFd);
+        free(ship);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Shipping thread of one follower, sends the store and then the durable
+// frames of the log as the log thread writes them
+// Position in the new log follows a snapshot, heartbeat with the end
+// of the log comes every SHIP_HEARTBEAT ms, so the follower knows its lag
+void *shipLog(void *arg)
+{
+    tShip *ship = arg;
+    struct timeval timeout = {SHIP_TIMEOUT, 0};
+    long long beat = 0;
+    char headers[160];
+    struct stat st;
+    off_t end;
+
+    // Stalled follower does not keep the thread and the old files forever
+    fcntl(ship->fd, F_SETFL, fcntl(ship->fd, F_GETFL, 0) & ~O_NONBLOCK);
+    setsockopt(ship->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    strInit(&ship->buffer);
+
+    long long storeSize = ship->storeFd != -1 && fstat(ship->storeFd, &st) == 0 ? st.st_size : 0;
+    int length = sprintf(headers, "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Type: application/octet-stream\r\nX-Store-Size: %lld\r\n\r\n", storeSize);
+
+    bool ok = writeAll(ship->fd, headers, length) && shipStore(ship) && shipMarker(ship, W_POSITION, ship->gen, ship->pos);
+
+    while (ok)
+    {
+        unsigned int gen = ship->gen;
+
+        if ((end = shipWait(ship, beat)) == -1)
+            break;
+        if (ship->gen != gen && !shipMarker(ship, W_POSITION, ship->gen, ship->pos))
+            break;
+        if (ship->pos < end && !shipFrames(ship, end))
+            break;
+
+        if (monotonicMs() >= beat)
+        {
+            ok = shipMarker(ship, W_HEARTBEAT, ship->primaryGen, ship->primaryEnd);
+            beat = monotonicMs() + SHIP_HEARTBEAT;
+        }
+    }
+
+    close(ship->fd);
+    close(ship->file);
+    strFree(&ship->buffer);
+    free(ship);
+    return NULL;
+}
+
+// Send the store of a new follower
+bool shipStore(tShip *ship)
+{
+    struct stat st;
+    ssize_t n = 0;
+
+    if (ship->storeFd == -1)
+        return true;
+
+    if (fstat(ship->storeFd, &st) == -1 || strReserve(&ship->buffer, SHIP_BLOCK) != STR_SUCCESS)
+        return false;
+
+    for (off_t pos = 0; pos < st.st_size; pos += n)
+    {
+        n = pread(ship->storeFd, ship->buffer.str, SHIP_BLOCK, pos);
+        if (n <= 0 || !writeAll(ship->fd, ship->buffer.str, n))
+            return false;
+    }
+
+    close(ship->storeFd);
+    ship->storeFd = -1;
+    return true;
+}
+
+// Wait for durable frames after the position or for the next heartbeat,
+// returns the end of the frames to ship or -1 when the stream cannot continue
+// Log replaced by a snapshot does not grow, it is shipped to its end and
+// the stream continues in the new log after the frames copied there,
+// the follower two snapshots behind starts again with the store
+off_t shipWait(tShip *ship, long long beat)
+{
+    struct stat st;
+    struct timespec ts;
+    uint32_t length;
+    off_t end;
+
+    pthread_mutex_lock(&wal.shipLock);
+    while (ship->gen == wal.gen && ship->pos >= wal.shipped)
+    {
+        long long left = beat - monotonicMs();
+        if (left <= 0)
+            break;
+
+        absTime(left, &ts);
+        if (pthread_cond_timedwait(&wal.shipCond, &wal.shipLock, &ts) == ETIMEDOUT)
+            break;
+    }
+
+    ship->primaryGen = wal.gen;
+    ship->primaryEnd = wal.shipped;
+    end = wal.shipped;
+
+    if (ship->gen != wal.gen)
+    {
+        end = fstat(ship->file, &st) == 0 ? st.st_size : -1;
+
+        if (end != -1 && ship->pos >= end)
+        {
+            int file = ship->gen + 1 == wal.gen ? open(config.wal, O_RDONLY) : -1;
+
+            end = -1;
+            if (file != -1 && pread(file, &length, 4, 0) == 4)
+            {
+                close(ship->file);
+                ship->file = file;
+                ship->pos = WAL_HEADER + length + ship->pos - wal.shipSkip;
+                ship->gen = wal.gen;
+                end = wal.shipped;
+            }
+            else if (file != -1)
+                close(file);
+        }
+    }
+    pthread_mutex_unlock(&wal.shipLock);
+
+    return end;
+}
+
+// Send the whole frames between the position and the end, the block read
+// from the log is cut after its last whole frame, a longer frame is read whole
+bool shipFrames(tShip *ship, off_t end)
+{
+    uint32_t length;
+    size_t size = end - ship->pos < SHIP_BLOCK ? end - ship->pos : SHIP_BLOCK;
+    ssize_t n, pos = 0;
+
+    if (strReserve(&ship->buffer, size) != STR_SUCCESS || (n = pread(ship->file, ship->buffer.str, size, ship->pos)) < WAL_HEADER)
+        return false;
+
+    while (n - pos >= WAL_HEADER)
+    {
+        memcpy(&length, ship->buffer.str + pos, 4);
+        if (length > n - pos - WAL_HEADER)
+            break;
+        pos += WAL_HEADER + length;
+    }
+
+    if (pos == 0)
+    {
+        memcpy(&length, ship->buffer.str, 4);
+        pos = WAL_HEADER + length;
+        if (ship->pos + pos > end || strReserve(&ship->buffer, pos) != STR_SUCCESS || pread(ship->file, ship->buffer.str, pos, ship->pos) != pos)
+            return false;
+    }
+
+    if (!writeAll(ship->fd, ship->buffer.str, pos))
+        return false;
+
+    ship->pos += pos;
+    return true;
+}
+
+// Send a frame of the stream which is not in the log, the follower does not
+// count it to its position
+bool shipMarker(tShip *ship, char type, unsigned int gen, off_t value)
+{
+    uint64_t data = value;
+
+    walFrameStart(&ship->buffer);
+    walFrameOp(&ship->buffer, type, "", 0, gen, (char *)&data, sizeof(data));
+    walFrameSeal(&ship->buffer);
+    bool ok = writeAll(ship->fd, ship->buffer.str, ship->buffer.length);
+    strClear(&ship->buffer);
+
+    return ok;
+}
+
+// Answer the change on the follower with the same request on the primary
+void redirectRequest(tConnPtr conn, tRqst *rqst, char msg[])
+{
+    strClear(&conn->body);
+
+    if (snprintf(rqst->extra, MAX_EXTRA, "Location: http://%s%.*s\r\n", config.follow, rqst->url.length, msg + rqst->url.pos) >= MAX_EXTRA)
+    {
+        rqst->extra[0] = '\0';
+        appendResponse(&conn->out, rqst, RQ_CL, &conn->body);
+        return;
+    }
+
+    appendResponse(&conn->out, rqst, RQ_REDIRECT, &conn->body);
+}
+
+// Start the follower thread, the loops serve the boards it applies
+void followStart(tList *L)
+{
+    char *colon = strrchr(config.follow, ':');
+    pthread_t thread;
+
+    initCrc();
+
+    follow.host = strndup(config.follow, colon - config.follow);
+    follow.port = colon + 1;
+    follow.L = L;
+    follow.positioned = false;
+    follow.targetAt = 0;
+    atomic_init(&follow.gen, 0);
+    atomic_init(&follow.offset, 0);
+    atomic_init(&follow.end, 0);
+    atomic_init(&follow.current, monotonicMs());
+    atomic_init(&follow.connected, false);
+    strInit(&follow.buffer);
+
+    if (follow.host == NULL || (store.path = malloc(strlen(config.follow) + 10)) == NULL)
+        err(1, "malloc() failed");
+    sprintf(store.path, "store of %s", config.follow);
+
+    if (pthread_create(&thread, NULL, followLog, NULL) != 0)
+        errx(1, "pthread_create() failed");
+}
+
+// Follower thread, applies the stream of the primary, a broken stream
+// continues from the position on a new connection
+void *followLog(void *arg)
+{
+    long long storeSize;
+    int fd;
+
+    while (1)
+    {
+        if ((fd = followConnect(&storeSize)) != -1)
+        {
+            atomic_store(&follow.connected, true);
+            followStream(fd, storeSize);
+            atomic_store(&follow.connected, false);
+            close(fd);
+        }
+
+        usleep(FOLLOW_RETRY * 1000);
+    }
+
+    return NULL;
+}
+
+// Connect to the primary and ask for the log from the position,
+// or for the store and the whole log when the position is not known
+// Returns the socket with the stream after the headers or -1
+int followConnect(long long *storeSize)
+{
+    struct addrinfo hints, *res;
+    struct timeval timeout = {FOLLOW_TIMEOUT, 0};
+    char request[256];
+    int fd = -1, length;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(follow.host, follow.port, &hints, &res) != 0)
+        return -1;
+
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next)
+    {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1)
+        return -1;
+
+    // Primary sends heartbeats, silence means the connection is lost
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (follow.positioned)
+        length = sprintf(request, "GET /log?from=%u.%llu HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", atomic_load(&follow.gen), atomic_load(&follow.offset), config.follow);
+    else
+        length = sprintf(request, "GET /log HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", config.follow);
+
+    if (!writeAll(fd, request, length) || !followHeaders(fd, storeSize))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Read the headers of the response, the stream after them stays in the buffer
+// 410 Gone forgets the position, the next connection starts with the store
+bool followHeaders(int fd, long long *storeSize)
+{
+    char *end;
+
+    strClear(&follow.buffer);
+    while ((end = memmem(follow.buffer.str, follow.buffer.length, "\r\n\r\n", 4)) == NULL)
+    {
+        if (follow.buffer.length >= MAX_HEADER || !followRead(fd))
+            return false;
+    }
+
+    *end = '\0';
+    int status = follow.buffer.length > 12 ? atoi(follow.buffer.str + 9) : 0;
+    char *size = strcasestr(follow.buffer.str, "\r\nX-Store-Size:");
+    *storeSize = size != NULL ? atoll(size + 15) : 0;
+
+    if (status == RQ_GONE)
+    {
+        warnx("%s does not have the position anymore, the boards are loaded again", config.follow);
+        follow.positioned = false;
+    }
+    if (status != RQ_OK)
+        return false;
+
+    int length = end + 4 - follow.buffer.str;
+    memmove(follow.buffer.str, follow.buffer.str + length, follow.buffer.length - length);
+    follow.buffer.length -= length;
+    return true;
+}
+
+// Read more of the stream to the buffer
+// Returns false when the connection ended
+bool followRead(int fd)
+{
+    ssize_t n;
+
+    if (strReserve(&follow.buffer, SHIP_BLOCK) != STR_SUCCESS)
+        err(1, "malloc() failed");
+
+    while ((n = read(fd, follow.buffer.str + follow.buffer.length, follow.buffer.allocSize - follow.buffer.length - 1)) == -1 && errno == EINTR)
+        ;
+
+    if (n <= 0)
+        return false;
+
+    follow.buffer.length += n;
+    follow.buffer.str[follow.buffer.length] = '\0';
+    return true;
+}
+
+// Load the store of a new stream and apply the frames as they come
+void followStream(int fd, long long storeSize)
+{
+    uint32_t length, crc;
+
+    if (!follow.positioned && !followStore(fd, storeSize))
+        return;
+
+    while (1)
+    {
+        int pos = 0;
+
+        while (follow.buffer.length - pos >= WAL_HEADER)
+        {
+            memcpy(&length, follow.buffer.str + pos, 4);
+            memcpy(&crc, follow.buffer.str + pos + 4, 4);
+            if (length > (uint32_t)(follow.buffer.length - pos - WAL_HEADER))
+                break;
+
+            if (crc32(follow.buffer.str + pos + WAL_HEADER, length) != crc)
+            {
+                warnx("stream of %s is corrupted", config.follow);
+                return;
+            }
+
+            followFrame(follow.buffer.str + pos + WAL_HEADER, length);
+            pos += WAL_HEADER + length;
+        }
+
+        memmove(follow.buffer.str, follow.buffer.str + pos, follow.buffer.length - pos);
+        follow.buffer.length -= pos;
+
+        if (!followRead(fd))
+            return;
+    }
+}
+
+// Replace the boards by the store of the primary, it is received
+// to an unlinked temporary file and mapped like the own store
+// Previous boards are served until the whole store is received and checked,
+// a broken or corrupted store keeps them and the next connection tries again
+bool followStore(int fd, long long size)
+{
+    char path[] = "/tmp/isaserver-XXXXXX";
+    int file;
+    bool received = true;
+
+    // Primary without a store has no boards before its log
+    if (size == 0)
+    {
+        replaceBoards(follow.L, sideLists());
+    }
+    else
+    {
+        if ((file = mkstemp(path)) == -1)
+        {
+            warn("mkstemp() failed");
+            return false;
+        }
+        unlink(path);
+
+        while (size > 0)
+        {
+            if (follow.buffer.length == 0 && !followRead(fd))
+            {
+                received = false;
+                break;
+            }
+
+            int length = follow.buffer.length < size ? follow.buffer.length : size;
+            if (!writeAll(file, follow.buffer.str, length))
+            {
+                warn("write() of the %s failed", store.path);
+                received = false;
+                break;
+            }
+
+            memmove(follow.buffer.str, follow.buffer.str + length, follow.buffer.length - length);
+            follow.buffer.length -= length;
+            size -= length;
+        }
+
+        received = received && storeMap(follow.L, file, true);
+        close(file);
+        if (!received)
+            return false;
+    }
+
+    atomic_store(&follow.offset, 0);
+    atomic_store(&follow.end, 0);
+    return true;
+}
+
+// Apply a frame of the stream, a position moves the follower to another log,
+// a heartbeat gives the end of the log of the primary
+// Follower has all the primary had when the heartbeat came once it reaches its end
+void followFrame(char ops[], int length)
+{
+    unsigned int gen = 0;
+    uint64_t value = 0;
+
+    if (length >= 18)
+    {
+        memcpy(&gen, ops + 2, 4);
+        memcpy(&value, ops + 10, 8);
+    }
+
+    if (ops[0] == W_POSITION && length >= 18)
+    {
+        atomic_store(&follow.gen, gen);
+        atomic_store(&follow.offset, value);
+        atomic_store(&follow.end, value);
+        follow.positioned = true;
+        follow.targetAt = 0;
+    }
+    else if (ops[0] == W_HEARTBEAT && length >= 18)
+    {
+        if (gen != atomic_load(&follow.gen))
+            return;
+
+        atomic_store(&follow.end, value);
+        if (follow.targetAt == 0)
+        {
+            follow.target = value;
+            follow.targetAt = monotonicMs();
+        }
+    }
+    else
+    {
+        walApply(follow.L, ops, length);
+        atomic_fetch_add(&follow.offset, WAL_HEADER + length);
+    }
+
+    if (follow.targetAt != 0 && atomic_load(&follow.offset) >= follow.target)
+    {
+        atomic_store(&follow.current, follow.targetAt);
+        follow.targetAt = 0;
+    }
+}
+
+// Ms since the follower had all the frames of the primary
+long long followLag()
+{
+    return monotonicMs() - atomic_load(&follow.current);
+}
+
+// Function for error handling, print error to stderr and exit the program
+void handleError(char *errorMessage)
+{
+    fprintf(stderr, "%s", errorMessage);
+    exit(1);
+}
+
+// Function for printing out help msg
+void handleHelp()
+{
+    printf(HLP_MSG);
+    exit(0);
+}
+
+// Program argument error checking, fills the config structure
+void handleArguments(int argc, char *argv[])
+{
+    config.port = -1;
+    config.threads = 0;
+    config.shards = 0;
+    config.cache = CACHE_DEFAULT;
+    config.wal = NULL;
+    config.walMode = WAL_BATCH;
+    config.walWindow = WAL_WINDOW;
+    config.snapshotSize = SNAPSHOT_SIZE;
+    config.snapshotInterval = 0;
+    config.follow = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-h") == 0)
+        {
+            // Print out help msg
+            handleHelp();
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "-h") == 0)
+            {
+                handleHelp();
+            }
+            else if (!isNumber(argv[i]))
+            {
+                handleError("Port must be a number!\n");
+            }
+            config.port = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]) || atoi(argv[i]) < 1)
+            {
+                handleError("Number of threads must be a positive number!\n");
+            }
+            config.threads = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]) || atoi(argv[i]) < 1)
+            {
+                handleError("Number of shards must be a positive number!\n");
+            }
+            config.shards = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]))
+            {
+                handleError("Cache size must be a number!\n");
+            }
+            config.cache = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+        {
+            config.wal = argv[++i];
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "batch") == 0)
+                config.walMode = WAL_BATCH;
+            else if (strcmp(argv[i], "interval") == 0)
+                config.walMode = WAL_INTERVAL;
+            else if (strcmp(argv[i], "none") == 0)
+                config.walMode = WAL_NONE;
+            else
+                handleError("Durability must be batch, interval or none!\n");
+        }
+        else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]))
+            {
+                handleError("Group commit window must be a number!\n");
+            }
+            config.walWindow = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]))
+            {
+                handleError("Snapshot size must be a number!\n");
+            }
+            config.snapshotSize = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (!isNumber(argv[i]))
+            {
+                handleError("Snapshot interval must be a number!\n");
+            }
+            config.snapshotInterval = atoi(argv[i]);
+        }
+        else if ((strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--follow") == 0) && i + 1 < argc)
+        {
+            i++;
+            char *colon = strrchr(argv[i], ':');
+            if (colon == NULL || colon == argv[i] || !isNumber(colon + 1) || strlen(argv[i]) > 128)
+            {
+                handleError("Primary must be <host>:<port>!\n");
+            }
+            config.follow = argv[i];
+        }
+        else
+        {
+            handleError(USG_MSG);
+        }
+    }
+
+    if (config.port == -1)
+    {
+        handleError(USG_MSG);
+    }
+
+    if (config.threads > 0 && config.shards > 0)
+    {
+        handleError("Options -t and -s can not be combined!\n");
+    }
+
+    if (config.follow != NULL && config.wal != NULL)
+    {
+        handleError("Follower has no log of its own, options -f and -w can not be combined!\n");
+    }
+}
+
+// Number argument error checking, the caller reports the option
+// Negative numbers are rejected by the sign like any other non-digit
+bool isNumber(char argv[])
+{
+    if (argv[0] == 0)
+        return false;
+
+    // Check all characters
+    for (int i = 0; argv[i] != 0; i++)
+    {
+        if (!isdigit((unsigned char)argv[i]))
+            return false;
+    }
+    return true;
+}
+
+// Parse the request in place, the message is never copied
+// Parser remembers its state in the request structure, so when the request
+// is not complete it continues from the same place after more data is read
+// Returns the length of the request (with the empty lines before it),
+// 0 when more data is needed and -1 when the request is invalid or too long
+int parseRequest(char msg[], int length, tRqst *rqst)
+{
+    int end;
+    int lineLength;
+
+    while (1)
+    {
+        switch (rqst->state)
+        {
+        // Skip empty lines before the request line (CRLF sent after the content)
+        case P_START:
+            while (rqst->pos < length && (msg[rqst->pos] == '\r' || msg[rqst->pos] == '\n'))
+                rqst->pos++;
+
+            if (rqst->pos == length)
+                return 0;
+
+            rqst->scan = rqst->pos;
+            rqst->state = P_LINE;
+            break;
+
+        // Request line and headers are processed line by line
+        case P_LINE:
+        case P_HEADER:
+            end = scanChar(msg + rqst->scan, length - rqst->scan, '\n');
+            if (end == -1)
+            {
+                // Line is not complete, do not search the same part again
+                rqst->scan = length;
+                return rqst->scan - rqst->pos > MAX_HEADER ? -1 : 0;
+            }
+
+            end += rqst->scan;
+            lineLength = end - rqst->pos;
+            if (lineLength > 0 && msg[rqst->pos + lineLength - 1] == '\r')
+                lineLength--;
+
+            if (rqst->state == P_LINE)
+            {
+                if (!parseRequestLine(msg, rqst->pos, lineLength, rqst))
+                    return -1;
+                rqst->state = P_HEADER;
+            }
+            else if (lineLength == 0)
+            {
+                // Empty line, content follows
+                // Persistent connection is the default only since HTTP/1.1
+                if (rqst->http10 && !rqst->keepAlive)
+                    rqst->close = true;
+
+                rqst->contentPos = end + 1;
+                rqst->state = P_CONTENT;
+            }
+            else if (!parseHeader(msg, rqst->pos, lineLength, rqst))
+            {
+                return -1;
+            }
+
+            rqst->pos = end + 1;
+            rqst->scan = rqst->pos;
+
+            if (rqst->state != P_CONTENT && rqst->pos > MAX_HEADER)
+                return -1;
+            break;
+
+        // Request is complete when the whole content arrived
+        case P_CONTENT:
+            if (length - rqst->contentPos < rqst->cl)
+                return 0;
+
+            return rqst->contentPos + rqst->cl;
+        }
+    }
+}
+
+// Parse the request line: method url version
+bool parseRequestLine(char msg[], int pos, int length, tRqst *rqst)
+{
+    int sp = scanChar(msg + pos, length, ' ');
+    int urlEnd;
+
+    if (sp == -1)
+        return false;
+
+    // Method
+    tSlice method = {pos, sp};
+    if (sliceEquals(msg, method, "GET"))
+        rqst->method = M_GET;
+    else if (sliceEquals(msg, method, "POST"))
+        rqst->method = M_POST;
+    else if (sliceEquals(msg, method, "PUT"))
+        rqst->method = M_PUT;
+    else if (sliceEquals(msg, method, "DELETE"))
+        rqst->method = M_DELETE;
+    else
+        rqst->method = M_OTHER;
+
+    // Url
+    rqst->url.pos = pos + sp + 1;
+    if ((urlEnd = scanChar(msg + rqst->url.pos, length - sp - 1, ' ')) == -1)
+        return false;
+    rqst->url.length = urlEnd;
+
+    // HTTP version follows the url
+    tSlice version = {rqst->url.pos + urlEnd + 1, length - sp - urlEnd - 2};
+    rqst->http10 = sliceEquals(msg, version, "HTTP/1.0");
+
+    return rqst->url.length > 0;
+}
+
+// Parse one header line, the name and value are remembered as slices
+// Headers needed by the server are converted to the request structure
+bool parseHeader(char msg[], int pos, int length, tRqst *rqst)
+{
+    int colon = scanChar(msg + pos, length, ':');
+    tSlice name, value;
+
+    if (colon == -1)
+        return false;
+
+    name.pos = pos;
+    name.length = colon;
+
+    // Value without the surrounding spaces
+    value.pos = pos + colon + 1;
+    value.length = length - colon - 1;
+    while (value.length > 0 && (msg[value.pos] == ' ' || msg[value.pos] == '\t'))
+    {
+        value.pos++;
+        value.length--;
+    }
+    while (value.length > 0 && (msg[value.pos + value.length - 1] == ' ' || msg[value.pos + value.length - 1] == '\t'))
+        value.length--;
+
+    if (rqst->headerCount < MAX_HEADERS)
+    {
+        rqst->headers[rqst->headerCount][0] = name;
+        rqst->headers[rqst->headerCount][1] = value;
+        rqst->headerCount++;
+    }
+
+    if (sliceEquals(msg, name, "Content-Length"))
+    {
+        if (value.length == 0 || value.length > 9)
+            return false;
+
+        rqst->cl = 0;
+        for (int i = 0; i < value.length; i++)
+        {
+            if (!isdigit(msg[value.pos + i]))
+                return false;
+            rqst->cl = rqst->cl * 10 + msg[value.pos + i] - '0';
+        }
+    }
+    else if (sliceEquals(msg, name, "Content-Type"))
+    {
+        rqst->ct = true;
+    }
+    else if (sliceEquals(msg, name, "Accept"))
+    {
+        rqst->sse = memmem(msg + value.pos, value.length, "text/event-stream", 17) != NULL;
+    }
+    else if (sliceEquals(msg, name, "If-None-Match"))
+    {
+        if (value.length < MAX_MATCH)
+            sliceCopy(msg, value, rqst->match, MAX_MATCH);
+    }
+    else if (sliceEquals(msg, name, "Connection"))
+    {
+        if (sliceEquals(msg, value, "close"))
+            rqst->close = true;
+        else if (sliceEquals(msg, value, "keep-alive"))
+            rqst->keepAlive = true;
+    }
+
+    return true;
+}
+
+// Compare the slice of the message with the string, case is ignored
+bool sliceEquals(char msg[], tSlice slice, const char *str)
+{
+    return strlen(str) == slice.length && strncasecmp(msg + slice.pos, str, slice.length) == 0;
+}
+
+// Copy the slice to the array as a string, longer slices are cut
+void sliceCopy(char msg[], tSlice slice, char dest[], int size)
+{
+    int length = slice.length < size - 1 ? slice.length : size - 1;
+
+    memcpy(dest, msg + slice.pos, length);
+    dest[length] = '\0';
+}
+
+// Parse one line of an import, a flat JSON object with string or number values,
+// {"board":"name","posts":N,"bytes":N} or {"post":"content"}
+// Strings are unescaped in place, other members are ignored
+bool parseImportLine(char line[], int length, tImportLine *item)
+{
+    int pos = jsonSpace(line, length, 0);
+    bool post = false;
+
+    item->board = false;
+    item->reserve = 0;
+
+    if (pos == length || line[pos++] != '{')
+        return false;
+
+    while (1)
+    {
+        // Member name
+        pos = jsonSpace(line, length, pos);
+        if (pos == length || line[pos++] != '"')
+            return false;
+        char *key = line + pos;
+        int keyLength = jsonString(line, length, &pos);
+
+        pos = jsonSpace(line, length, pos);
+        if (keyLength == -1 || pos == length || line[pos++] != ':')
+            return false;
+        pos = jsonSpace(line, length, pos);
+
+        // Value is a string or a number
+        char *value = NULL;
+        int valueLength = 0;
+        long number = 0;
+
+        if (pos < length && line[pos] == '"')
+        {
+            value = line + ++pos;
+            if ((valueLength = jsonString(line, length, &pos)) == -1)
+                return false;
+        }
+        else
+        {
+            if (pos == length || !isdigit(line[pos]))
+                return false;
+            while (pos < length && isdigit(line[pos]))
+            {
+                if (number < IMPORT_RESERVE)
+                    number = number * 10 + line[pos] - '0';
+                pos++;
+            }
+        }
+
+        if (keyLength == 5 && memcmp(key, "board", 5) == 0)
+        {
+            // Name has to be usable in the urls
+            if (value == NULL || valueLength == 0 || valueLength >= MAX_NAME)
+                return false;
+            for (int i = 0; i < valueLength; i++)
+            {
+                if ((unsigned char)value[i] <= ' ' || value[i] == '/' || value[i] == '?' || value[i] == '#' || value[i] == 127)
+                    return false;
+            }
+            memcpy(item->name, value, valueLength);
+            item->name[valueLength] = '\0';
+            item->board = true;
+        }
+        else if (keyLength == 4 && memcmp(key, "post", 4) == 0)
+        {
+            if (value == NULL)
+                return false;
+            item->post = value;
+            item->postLength = valueLength;
+            post = true;
+        }
+        else if (keyLength == 5 && memcmp(key, "bytes", 5) == 0)
+        {
+            item->reserve = number > IMPORT_RESERVE ? IMPORT_RESERVE : number;
+        }
+
+        pos = jsonSpace(line, length, pos);
+        if (pos == length)
+            return false;
+        if (line[pos] == '}')
+            break;
+        if (line[pos++] != ',')
+            return false;
+    }
+
+    // Line is one object, a board or a post
+    return jsonSpace(line, length, pos + 1) == length && item->board != post;
+}
+
+// Skip the whitespace, returns the next position
+int jsonSpace(char line[], int length, int pos)
+{
+    while (pos < length && (line[pos] == ' ' || line[pos] == '\t' || line[pos] == '\r' || line[pos] == '\n'))
+        pos++;
+    return pos;
+}
+
+// Unescape the JSON string in place, pos is after the opening quote
+// and it is moved after the closing one
+// Returns the length of the text or -1 when the string is not valid
+int jsonString(char s[], int length, int *pos)
+{
+    int i = *pos, out = *pos;
+    unsigned int code, low;
+
+    while (i < length)
+    {
+        char c = s[i++];
+
+        if (c == '"')
+        {
+            int textLength = out - *pos;
+            *pos = i;
+            return textLength;
+        }
+
+        if (c != '\\')
+        {
+            s[out++] = c;
+            continue;
+        }
+
+        if (i == length)
+            return -1;
+
+        switch (s[i++])
+        {
+        case '"':
+            s[out++] = '"';
+            break;
+        case '\\':
+            s[out++] = '\\';
+            break;
+        case '/':
+            s[out++] = '/';
+            break;
+        case 'b':
+            s[out++] = '\b';
+            break;
+        case 'f':
+            s[out++] = '\f';
+            break;
+        case 'n':
+            s[out++] = '\n';
+            break;
+        case 'r':
+            s[out++] = '\r';
+            break;
+        case 't':
+            s[out++] = '\t';
+            break;
+        case 'u':
+            if (!jsonHex(s, length, &i, &code))
+                return -1;
+
+            // Characters outside the BMP are written as surrogate pairs
+            if (code >= 0xD800 && code < 0xDC00 && i + 1 < length && s[i] == '\\' && s[i + 1] == 'u')
+            {
+                int next = i + 2;
+                if (jsonHex(s, length, &next, &low) && low >= 0xDC00 && low < 0xE000)
+                {
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    i = next;
+                }
+            }
+
+            // UTF-8 is never longer than the escape
+            out += utf8Encode(code, s + out);
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+// Read 4 hex digits of the \u escape
+bool jsonHex(char s[], int length, int *pos, unsigned int *code)
+{
+    *code = 0;
+
+    if (length - *pos < 4)
+        return false;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char c = s[(*pos)++];
+
+        if (!isxdigit(c))
+            return false;
+        *code = *code * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+    }
+
+    return true;
+}
+
+// Write the character as UTF-8, returns the number of bytes
+int utf8Encode(unsigned int code, char dest[])
+{
+    if (code < 0x80)
+    {
+        dest[0] = code;
+        return 1;
+    }
+    if (code < 0x800)
+    {
+        dest[0] = 0xC0 | code >> 6;
+        dest[1] = 0x80 | (code & 0x3F);
+        return 2;
+    }
+    if (code < 0x10000)
+    {
+        dest[0] = 0xE0 | code >> 12;
+        dest[1] = 0x80 | (code >> 6 & 0x3F);
+        dest[2] = 0x80 | (code & 0x3F);
+        return 3;
+    }
+
+    dest[0] = 0xF0 | code >> 18;
+    dest[1] = 0x80 | (code >> 12 & 0x3F);
+    dest[2] = 0x80 | (code >> 6 & 0x3F);
+    dest[3] = 0x80 | (code & 0x3F);
+    return 4;
+}
+
+// API routes, the patterns are compiled to segments by initRoutes
+tRoute routes[] = {
+    {M_GET, "/boards", handleGetBoards, true},
+    {M_GET, "/boards/export", handleExport, true},
+    {M_POST, "/boards/:name", handleNewBoard, false},
+    {M_DELETE, "/boards/:name", handleDeleteBoard, false},
+    {M_GET, "/board/:name", handleGetPosts, false},
+    {M_GET, "/board/:name/watch", handleWatch, false},
+    {M_POST, "/board/:name", handleNewPost, false},
+    {M_POST, "/board/:name/batch", handleBatch, false},
+    {M_POST, "/board/:name/:id", handleInsertPost, false},
+    {M_PUT, "/board/:name/:id", handleChangePost, false},
+    {M_DELETE, "/board/:name/:id", handleDeletePost, false},
+    {M_GET, "/log", handleLog, false},
+    {M_GET, "/replication", handleReplication, false},
+    {M_GET, "/search", handleSearch, false},
+    {M_POST, "/import", handleImport, false},
+};
+
+#define ROUTE_COUNT (int)(sizeof(routes) / sizeof(routes[0]))
+
+// Check if the request is GET /boards/export, shards answer it like GET /boards
+bool isExport(tRqst *rqst)
+{
+    return rqst->route != NO_ROUTE && routes[rqst->route].handler == handleExport;
+}
+
+// Check if the request is POST /import, the path is matched before the content
+// arrives, import is outside of /boards, so every board name can be created
+bool isImport(tRqst *rqst, char msg[])
+{
+    matchRoute(rqst, msg);
+    return rqst->route != NO_ROUTE && routes[rqst->route].handler == handleImport;
+}
+
+// Check if the request is GET /search, shards search their boards like
+// they list them for GET /boards
+bool isSearch(tRqst *rqst)
+{
+    return rqst->route != NO_ROUTE && routes[rqst->route].handler == handleSearch;
+}
+
+// Split the route patterns to segments, done once at startup
+void initRoutes()
+{
+    for (int i = 0; i < ROUTE_COUNT; i++)
+    {
+        const char *part = routes[i].pattern + 1;
+        tRoute *route = &routes[i];
+
+        route->segmentCount = 0;
+        while (*part != '\0' && route->segmentCount < MAX_SEGMENTS)
+        {
+            tSegment *seg = &route->segments[route->segmentCount++];
+
+            seg->param = *part == ':';
+            seg->text = part;
+            seg->length = strcspn(part, "/");
+
+            part += seg->length;
+            if (*part == '/')
+                part++;
+        }
+    }
+}
+
+// Find the route of the request, the path is split to segments in one pass
+// and compared with the compiled patterns, parameters are stored as slices
+void matchRoute(tRqst *rqst, char msg[])
+{
+    tSlice segments[MAX_SEGMENTS];
+    int count = 0;
+    int pos = rqst->url.pos;
+    int end = rqst->url.pos + rqst->url.length;
+    int found;
+
+    rqst->route = NO_ROUTE;
+
+    // Query string is not a part of the path
+    if ((found = scanChar(msg + pos, end - pos, '?')) != -1)
+    {
+        rqst->query.pos = pos + found + 1;
+        rqst->query.length = end - rqst->query.pos;
+        end = pos + found;
+    }
+
+    if (pos == end || msg[pos] != '/')
+        return;
+    pos++;
+
+    // Split the path to segments
+    while (pos <= end)
+    {
+        if (count == MAX_SEGMENTS)
+            return;
+
+        if ((found = scanChar(msg + pos, end - pos, '/')) == -1)
+            found = end - pos;
+
+        segments[count].pos = pos;
+        segments[count].length = found;
+        count++;
+        pos += found + 1;
+    }
+
+    // Compare segments with the routes
+    for (int i = 0; i < ROUTE_COUNT; i++)
+    {
+        tRoute *route = &routes[i];
+        int params = 0;
+        int j;
+
+        if (route->method != rqst->method || route->segmentCount != count)
+            continue;
+
+        for (j = 0; j < count; j++)
+        {
+            tSegment *seg = &route->segments[j];
+
+            if (seg->param)
+            {
+                if (segments[j].length == 0)
+                    break;
+                rqst->params[params++] = segments[j];
+            }
+            else if (seg->length != segments[j].length ||
+                     memcmp(seg->text, msg + segments[j].pos, seg->length) != 0)
+            {
+                break;
+            }
+        }
+
+        if (j == count)
+        {
+            rqst->route = i;
+            return;
+        }
+    }
+}
+
+// Copy the board name parameter to the array
+// Returns false when the name is too long
+bool paramName(char msg[], tSlice param, char name[])
+{
+    if (param.length >= MAX_NAME)
+        return false;
+
+    memcpy(name, msg + param.pos, param.length);
+    name[param.length] = '\0';
+    return true;
+}
+
+// Convert the ID parameter to a number, returns 0 when it is not a valid ID
+int paramId(char msg[], tSlice param)
+{
+    int id = 0;
+
+    if (param.length > 9)
+        return 0;
+
+    for (int i = 0; i < param.length; i++)
+    {
+        if (!isdigit(msg[param.pos + i]))
+            return 0;
+        id = id * 10 + msg[param.pos + i] - '0';
+    }
+
+    return id;
+}
+
+// Get the number from the slice, -1 when it is not a number
+int sliceNumber(char msg[], tSlice slice)
+{
+    int number = 0;
+
+    if (slice.length == 0 || slice.length > 9)
+        return -1;
+
+    for (int i = 0; i < slice.length; i++)
+    {
+        if (!isdigit(msg[slice.pos + i]))
+            return -1;
+        number = number * 10 + msg[slice.pos + i] - '0';
+    }
+
+    return number;
+}
+
+// Get the window of the listing from the query and the Range header
+// ?offset=K&limit=L&tail=N, Range: items=A-B, items=A- or items=-N (IDs from 1)
+// Range of other units is ignored, the whole listing is sent
+// ?since=V asks for the changes after the version V
+// Returns false when a value is not valid
+bool parseWindow(tRqst *rqst, char msg[], tWindow *w)
+{
+    tSlice value;
+
+    w->offset = w->limit = w->tail = w->since = -1;
+    w->range = false;
+
+    // Parameters of the query, unknown ones are ignored
+    if (!numberParam(rqst, msg, "offset", &w->offset) || !numberParam(rqst, msg, "limit", &w->limit) ||
+        !numberParam(rqst, msg, "tail", &w->tail) || !numberParam(rqst, msg, "since", &w->since))
+        return false;
+
+    for (int i = 0; i < rqst->headerCount; i++)
+    {
+        if (!sliceEquals(msg, rqst->headers[i][0], "Range"))
+            continue;
+
+        value = rqst->headers[i][1];
+        if (value.length < 6 || strncasecmp(msg + value.pos, "items=", 6) != 0)
+            continue;
+
+        int dash = value.pos + 6;
+        while (dash < value.pos + value.length && msg[dash] != '-')
+            dash++;
+        if (dash == value.pos + value.length)
+            return false;
+
+        tSlice from = {value.pos + 6, dash - value.pos - 6};
+        tSlice to = {dash + 1, value.pos + value.length - dash - 1};
+        int a = from.length > 0 ? sliceNumber(msg, from) : 0;
+        int b = to.length > 0 ? sliceNumber(msg, to) : 0;
+
+        if (from.length == 0)
+        {
+            // Last b posts
+            if (b <= 0)
+                return false;
+            w->tail = b;
+        }
+        else
+        {
+            if (a <= 0 || b == -1 || (to.length > 0 && b < a))
+                return false;
+            w->offset = a - 1;
+            if (to.length > 0)
+                w->limit = b - a + 1;
+        }
+        w->range = true;
+    }
+
+    return true;
+}
+
+// Get the terms of GET /search from ?q=, the board from ?board= and the
+// number of hits from ?limit=
+// Returns false when there is no term, too many of them or a value is not valid
+// Query is decoded to a buffer of the pool of the loop, searches run on the loops
+bool parseSearch(tRqst *rqst, char msg[], tQuery *q)
+{
+    tSlice value;
+    string text;
+    char term[TERM_MAX];
+    int pos = 0;
+    int length;
+    int n;
+    bool valid = true;
+
+    q->count = 0;
+    q->board[0] = '\0';
+    q->limit = SEARCH_LIMIT;
+
+    if (!queryParam(rqst, msg, "q", &value))
+        return false;
+
+    poolGet(currentLoop, &text);
+    if (strReserve(&text, value.length) != STR_SUCCESS)
+        err(1, "malloc() failed");
+
+    // Terms are taken from the query like from the posts, repeated ones once
+    length = urlDecode(msg + value.pos, value.length, text.str);
+    while (valid && (n = nextTerm(text.str, length, &pos, term)) > 0)
+    {
+        int i = 0;
+        while (i < q->count && (q->lengths[i] != n || memcmp(q->terms[i], term, n) != 0))
+            i++;
+        if (i < q->count)
+            continue;
+
+        if ((valid = q->count < MAX_TERMS))
+        {
+            memcpy(q->terms[q->count], term, n);
+            q->lengths[q->count++] = n;
+        }
+    }
+
+    poolPut(currentLoop, &text);
+    if (!valid || q->count == 0)
+        return false;
+
+    if (queryParam(rqst, msg, "board", &value) && !paramName(msg, value, q->board))
+        return false;
+
+    if (queryParam(rqst, msg, "limit", &value) && (q->limit = sliceNumber(msg, value)) <= 0)
+        return false;
+    if (q->limit > SEARCH_MAX)
+        q->limit = SEARCH_MAX;
+
+    // Shards merging their hits know the limit from the request
+    rqst->window.limit = q->limit;
+    return true;
+}
+
+// Find the parameter of the query, its value is stored as a slice
+// Returns false when the query does not have it
+bool queryParam(tRqst *rqst, char msg[], const char *name, tSlice *value)
+{
+    int pos = rqst->query.pos, end = rqst->query.pos + rqst->query.length;
+
+    while (pos < end)
+    {
+        int next = pos;
+        while (next < end && msg[next] != '&')
+            next++;
+
+        int eq = pos;
+        while (eq < next && msg[eq] != '=')
+            eq++;
+
+        tSlice param = {pos, eq - pos};
+        if (sliceEquals(msg, param, name))
+        {
+            value->pos = eq + 1;
+            value->length = eq < next ? next - eq - 1 : 0;
+            return true;
+        }
+
+        pos = next + 1;
+    }
+
+    return false;
+}
+
+// Get the number of the parameter of the query, number is not changed
+// when the query does not have the parameter
+// Returns false when the value is not a number
+bool numberParam(tRqst *rqst, char msg[], const char *name, int *number)
+{
+    tSlice value;
+
+    if (!queryParam(rqst, msg, name, &value))
+        return true;
+
+    return (*number = sliceNumber(msg, value)) != -1;
+}
+
+// Decode '+' and %XX of the query value, dest has room for length bytes
+// Returns the length of the decoded value
+int urlDecode(const char *src, int length, char dest[])
+{
+    int n = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        if (src[i] == '+')
+        {
+            dest[n++] = ' ';
+        }
+        else if (src[i] == '%' && i + 2 < length && isxdigit((unsigned char)src[i + 1]) && isxdigit((unsigned char)src[i + 2]))
+        {
+            char hex[3] = {src[i + 1], src[i + 2], '\0'};
+            dest[n++] = strtol(hex, NULL, 16);
+            i += 2;
+        }
+        else
+        {
+            dest[n++] = src[i];
+        }
+    }
+
+    return n;
+}
+
+// Create response message based on request structure
+// Structure is filled with info. from parseRequest and matchRoute functions
+// Body is created in the buffer of the caller, it is reused by next requests
+// Returns the code of the handler, RQ_STREAM asks the caller for the listing
+int createResponse(tList *L, tRqst *rqst, string *response, char buffer[], string *body)
+{
+    int code = RQ_NOT_FOUND;
+    strClear(body);
+
+    if (rqst->route != NO_ROUTE)
+    {
+        code = routes[rqst->route].handler(L, rqst, buffer, body);
+    }
+
+    appendResponse(response, rqst, code, body);
+    return code;
+}
+
+// GET /boards
+int handleGetBoards(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    unsigned int version;
+
+    getBoards(L, body, &version);
+    return boardsResponse(rqst, body, version);
+}
+
+// GET /boards/export - the loop collects the names and streams the boards
+int handleExport(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    return RQ_EXPORT;
+}
+
+// POST /import without content, the content is imported by the loop
+// while it arrives
+int handleImport(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    return RQ_CL;
+}
+
+// GET /log - the connection is handed to a thread shipping the log to a follower
+int handleLog(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    return wal.active ? RQ_SHIP : RQ_NOT_FOUND;
+}
+
+// GET /replication - position of the log, the follower adds its primary and lag
+int handleReplication(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char line[256];
+
+    if (config.follow != NULL)
+    {
+        unsigned long long offset = atomic_load(&follow.offset), end = atomic_load(&follow.end);
+
+        strAddData(body, line, sprintf(line, "role follower\nprimary %s\nstate %s\nposition %u.%llu\nbehind %llu\nlag %lld\n",
+                                       config.follow, atomic_load(&follow.connected) ? "streaming" : "connecting",
+                                       atomic_load(&follow.gen), offset, end > offset ? end - offset : 0, followLag()));
+        return RQ_OK;
+    }
+
+    if (!wal.active)
+        return RQ_NOT_FOUND;
+
+    pthread_mutex_lock(&wal.shipLock);
+    strAddData(body, line, sprintf(line, "role primary\nposition %u.%lld\n", wal.gen, (long long)wal.shipped));
+    pthread_mutex_unlock(&wal.shipLock);
+    return RQ_OK;
+}
+
+// GET /search?q=terms[&board=name][&limit=n] - posts containing all terms,
+// the best first
+int handleSearch(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    tQuery query;
+    string hits;
+    int code;
+
+    if (!parseSearch(rqst, msg, &query))
+        return RQ_CL;
+
+    strInit(&hits);
+    if ((code = searchPosts(L, &query, &hits)) == RQ_OK)
+        code = searchResponse(rqst, &hits, body);
+    strFree(&hits);
+    return code;
+}
+
+// POST /boards/name
+int handleNewBoard(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_CL;
+
+    return newBoard(L, name);
+}
+
+// DELETE /boards/name
+int handleDeleteBoard(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_NOT_FOUND;
+
+    return deleteBoard(L, name);
+}
+
+// GET /board/name
+int handleGetPosts(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_NOT_FOUND;
+
+    if (!parseWindow(rqst, msg, &rqst->window))
+        return RQ_CL;
+
+    return getPosts(L, name, body, rqst);
+}
+
+// GET /board/name/watch - long-poll or SSE (Accept: text/event-stream)
+int handleWatch(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_NOT_FOUND;
+
+    if (!parseWindow(rqst, msg, &rqst->window))
+        return RQ_CL;
+
+    return watchBoard(L, name, body, rqst);
+}
+
+// POST /board/name
+int handleNewPost(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (rqst->cl == 0)
+        return RQ_CL;
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_NOT_FOUND;
+
+    return newPost(L, name, &msg[rqst->contentPos], rqst->cl);
+}
+
+// POST /board/name/id - new post on the position, later posts move down
+int handleInsertPost(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+    int id = paramId(msg, rqst->params[1]);
+
+    if (rqst->cl == 0)
+        return RQ_CL;
+
+    if (!paramName(msg, rqst->params[0], name) || id == 0)
+        return RQ_NOT_FOUND;
+
+    return insertPost(L, name, id, &msg[rqst->contentPos], rqst->cl);
+}
+
+// POST /board/name/batch - operations on lines, status of each is returned
+int handleBatch(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+
+    if (rqst->cl == 0)
+        return RQ_CL;
+
+    if (!paramName(msg, rqst->params[0], name))
+        return RQ_NOT_FOUND;
+
+    return batchPosts(L, name, &msg[rqst->contentPos], rqst->cl, body);
+}
+
+// PUT /board/name/id
+int handleChangePost(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+    int id = paramId(msg, rqst->params[1]);
+
+    if (!paramName(msg, rqst->params[0], name) || id == 0)
+        return RQ_NOT_FOUND;
+
+    return changePost(L, name, id, &msg[rqst->contentPos], rqst->cl);
+}
+
+// DELETE /board/name/id
+int handleDeletePost(tList *L, tRqst *rqst, char msg[], string *body)
+{
+    char name[MAX_NAME];
+    int id = paramId(msg, rqst->params[1]);
+
+    if (!paramName(msg, rqst->params[0], name) || id == 0)
+        return RQ_NOT_FOUND;
+
+    return deletePost(L, name, id);
+}
+
+// Append the status line, headers and body of the response
+// Content-Length is sent, so the client knows where the response ends,
+// streamed listing ends with the last chunk instead
+void appendResponse(string *response, tRqst *rqst, int code, string *body)
+{
+    // Long-poll is answered when the board changes, the shipping thread
+    // sends its own headers
+    if ((code == RQ_WATCH && !rqst->sse) || code == RQ_SHIP)
+        return;
+
+    // Streams are sent with the status of their listing
+    int status = code;
+    if (code == RQ_STREAM)
+        status = rqst->window.range ? RQ_PARTIAL : RQ_OK;
+    else if (code == RQ_WATCH || code == RQ_EXPORT)
+        status = RQ_OK;
+
+    // Append text based on code
+    char codeName[32];
+    if (status == RQ_OK)
+    {
+        sprintf(codeName, "OK\r\n");
+    }
+    else if (code == RQ_NOT_FOUND)
+    {
+        sprintf(codeName, "Not Found\r\n");
+    }
+    else if (code == RQ_EXISTS)
+    {
+        sprintf(codeName, "Conflict\r\n");
+    }
+    else if (code == RQ_CREATED)
+    {
+        sprintf(codeName, "Created\r\n");
+    }
+    else if (status == RQ_PARTIAL)
+    {
+        sprintf(codeName, "Partial Content\r\n");
+    }
+    else if (code == RQ_RANGE)
+    {
+        sprintf(codeName, "Range Not Satisfiable\r\n");
+    }
+    else if (code == RQ_CL)
+    {
+        sprintf(codeName, "Bad Request\r\n");
+    }
+    else if (code == RQ_NOT_MODIFIED)
+    {
+        sprintf(codeName, "Not Modified\r\n");
+    }
+    else if (code == RQ_REDIRECT)
+    {
+        sprintf(codeName, "Temporary Redirect\r\n");
+    }
+    else if (code == RQ_GONE)
+    {
+        sprintf(codeName, "Gone\r\n");
+    }
+    else if (code == RQ_BROKEN)
+    {
+        sprintf(codeName, "Internal Server Error\r\n");
+    }
+
+    // Headers are shorter than 128 bytes, so the response is copied only once
+    strReserve(response, body->length + 128);
+
+    // Create header
+    char rqHeader[100];
+    sprintf(rqHeader, "HTTP/1.1 %d %s", status, codeName);
+    string_concat(response, rqHeader);
+
+    // Tell the client if the connection stays open
+    // Events are sent until the connection is closed
+    if (rqst->close || code == RQ_WATCH)
+    {
+        string_concat(response, "Connection: close\r\n");
+    }
+    else if (rqst->http10)
+    {
+        string_concat(response, "Connection: keep-alive\r\n");
+    }
+
+    // Version of the listing, the client revalidates its copy with it
+    if (rqst->etag[0] != '\0')
+    {
+        char tagHeader[MAX_TAG + 10];
+        sprintf(tagHeader, "ETag: %s\r\n", rqst->etag);
+        string_concat(response, tagHeader);
+    }
+    string_concat(response, rqst->extra);
+
+    // Data of the follower are as old as its replication lag
+    if (config.follow != NULL)
+    {
+        char lagHeader[48];
+        sprintf(lagHeader, "X-Replication-Lag: %lld\r\n", followLag());
+        string_concat(response, lagHeader);
+    }
+
+    // If there is content, append headers and content after headers
+    if (code == RQ_STREAM)
+    {
+        // Body is the first chunk, the listing follows
+        char chunk[20];
+        string_concat(response, "Content-Type: text/plain\r\nTransfer-Encoding: chunked\r\n\r\n");
+        sprintf(chunk, "%x\r\n", body->length + body->refLength);
+        string_concat(response, chunk);
+        strAppend(response, body);
+        string_concat(response, "\r\n");
+    }
+    else if (code == RQ_WATCH)
+    {
+        string_concat(response, "Content-Type: text/event-stream\r\nCache-Control: no-cache\r\n\r\n");
+    }
+    else if (code == RQ_EXPORT)
+    {
+        // Chunks of the boards follow
+        string_concat(response, "Content-Type: application/x-ndjson\r\nTransfer-Encoding: chunked\r\n\r\n");
+    }
+    else if (code == RQ_NOT_MODIFIED)
+    {
+        // 304 never has a body, the client uses its copy
+        string_concat(response, "\r\n");
+    }
+    else if (body->length + body->refLength != 0)
+    {
+        char ctHeaders[100];
+        sprintf(ctHeaders, "Content-Type: text/plain\r\nContent-Length: %d\r\n\r\n", body->length + body->refLength);
+        string_concat(response, ctHeaders);
+        strAppend(response, body);
+    }
+    else
+    {
+        string_concat(response, "Content-Length: 0\r\n\r\n");
+    }
+}
+
+// Status of GET /boards, the ETag is created from the version of the list
+// (sum of the versions of all shards), the same list is not sent again
+int boardsResponse(tRqst *rqst, string *body, unsigned int version)
+{
+    if (body->length + body->refLength == 0)
+        return RQ_NOT_FOUND;
+
+    sprintf(rqst->etag, "\"%x-%x\"", bootId, version);
+    if (tagMatches(rqst->match, rqst->etag))
+    {
+        strClear(body);
+        return RQ_NOT_MODIFIED;
+    }
+
+    return RQ_OK;
+}
+
+// Check if the ETag is in If-None-Match ("*" or a list of tags)
+// Weak tags are compared as the strong ones
+bool tagMatches(const char match[], const char etag[])
+{
+    int length = strlen(etag);
+
+    while (*match != '\0')
+    {
+        while (*match == ' ' || *match == ',')
+            match++;
+
+        if (*match == '*')
+            return true;
+        if (strncmp(match, "W/", 2) == 0)
+            match += 2;
+        if (strncmp(match, etag, length) == 0 && (match[length] == '\0' || match[length] == ',' || match[length] == ' '))
+            return true;
+
+        while (*match != '\0' && *match != ',')
+            match++;
+    }
+
+    return false;
+}
+
+// FNV-1a hash of the board name
+unsigned int hashName(const char *name, int length)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+// Get the shard owning the board from the matched route
+// Returns ALL_SHARDS for GET /boards, which needs boards of every shard
+int requestShard(tRqst *rqst, char msg[])
+{
+    tSlice board;
+
+    // Unknown request, any shard responds with 404
+    if (rqst->route == NO_ROUTE)
+        return 0;
+
+    // Search of one board goes to its owner, of all boards to every shard
+    if (isSearch(rqst))
+    {
+        if (queryParam(rqst, msg, "board", &board) && board.length > 0)
+            return hashName(msg + board.pos, board.length) % loopCount;
+        return ALL_SHARDS;
+    }
+
+    if (routes[rqst->route].allShards)
+        return ALL_SHARDS;
+
+    // Routes without the board name are answered by any shard
+    if (strchr(routes[rqst->route].pattern, ':') == NULL)
+        return LOCAL_SHARD;
+
+    // First parameter of all other routes is the board name
+    return hashName(msg + rqst->params[0].pos, rqst->params[0].length) % loopCount;
+}
+
+// Find the first occurrence of the character, returns its index or -1
+// Scalar version used on CPUs without SIMD and for the tails of buffers
+int scanCharScalar(const char *buf, int length, char c)
+{
+    for (int i = 0; i < length; i++)
+    {
+        if (buf[i] == c)
+            return i;
+    }
+    return -1;
+}
+
+#ifdef SCAN_X86
+// SSE2 is available on every x86-64 CPU, 16 bytes are compared at once
+int scanCharSse2(const char *buf, int length, char c)
+{
+    __m128i needle = _mm_set1_epi8(c);
+    int i = 0, found;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    found = scanCharScalar(buf + i, length - i, c);
+    return found == -1 ? -1 : i + found;
+}
+
+// AVX2 version compares 32 bytes at once, compiled for AVX2 only
+// and selected at runtime when the CPU supports it
+__attribute__((target("avx2"))) int scanCharAvx2(const char *buf, int length, char c)
+{
+    __m256i needle = _mm256_set1_epi8(c);
+    int i = 0, found;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+
+    found = scanCharSse2(buf + i, length - i, c);
+    return found == -1 ? -1 : i + found;
+}
+
+#endif
+
+// Select the fastest scanner supported by the CPU
+void initScan()
+{
+    scanChar = scanCharScalar;
+
+#ifdef SCAN_X86
+    scanChar = scanCharSse2;
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scanChar = scanCharAvx2;
+#endif
+}
+
+// Initialize lists
+void initList(tList *L, bool shared)
+{
+    L->First = NULL;
+    initTable(&L->table, TABLE_MIN);
+    initTable(&L->old, 0);
+    L->migrated = 0;
+    L->count = 0;
+    L->version = 0;
+    atomic_init(&L->clock, 0);
+    L->cached = NULL;
+    L->shared = shared;
+    pthread_rwlock_init(&L->lock, NULL);
+
+    L->cache.First = NULL;
+    L->cache.Last = NULL;
+    L->cache.size = 0;
+    L->cache.budget = (size_t)config.cache * 1024 / (config.shards > 0 ? config.shards : 1);
+    pthread_mutex_init(&L->cache.lock, NULL);
+}
+
+// Lock the directory of boards
+// Readers (all operations with posts) can run in parallel,
+// writer (new or deleted board) has the whole store for itself
+void lockList(tList *L, bool write)
+{
+    if (!L->shared)
+        return;
+
+    if (write)
+        pthread_rwlock_wrlock(&L->lock);
+    else
+        pthread_rwlock_rdlock(&L->lock);
+}
+
+// Unlock the directory of boards
+void unlockList(tList *L)
+{
+    if (L->shared)
+        pthread_rwlock_unlock(&L->lock);
+}
+
+// Lock the cache, readers of the same board can use it at once
+void lockCache(tList *L)
+{
+    if (L->shared)
+        pthread_mutex_lock(&L->cache.lock);
+}
+
+// Unlock the cache
+void unlockCache(tList *L)
+{
+    if (L->shared)
+        pthread_mutex_unlock(&L->cache.lock);
+}
+
+// Append the cached body to the string when its version is current
+// Body is not copied, the string references it
+// Returns false when the body has to be rendered
+bool cacheGet(tList *L, tCachePtr *slot, unsigned int version, string *str)
+{
+    lockCache(L);
+    tCachePtr entry = *slot;
+
+    if (entry == NULL || entry->version != version)
+    {
+        unlockCache(L);
+        return false;
+    }
+
+    atomic_fetch_add(&entry->pin->refs, 1);
+    strAddRef(str, entry->chunk->data, entry->length, entry->pin);
+
+    // Move the entry to the front of the LRU list
+    if (entry != L->cache.First)
+    {
+        entry->pPtr->nPtr = entry->nPtr;
+        if (entry->nPtr != NULL)
+            entry->nPtr->pPtr = entry->pPtr;
+        else
+            L->cache.Last = entry->pPtr;
+
+        entry->pPtr = NULL;
+        entry->nPtr = L->cache.First;
+        L->cache.First->pPtr = entry;
+        L->cache.First = entry;
+    }
+
+    unlockCache(L);
+    return true;
+}
+
+// Cache the rendered body with the version of the board (list)
+// Older entry of the slot and the least recently used entries are evicted
+void cachePut(tList *L, tCachePtr *slot, unsigned int version, string *str)
+{
+    int length = str->length + str->refLength;
+
+    if ((size_t)length > L->cache.budget)
+        return;
+
+    tCachePtr entry = malloc(sizeof(struct tCacheEntry));
+    tChunk *chunk = malloc(sizeof(tChunk) + length);
+
+    if (entry == NULL || chunk == NULL)
+        err(1, "malloc() failed");
+
+    chunk->next = NULL;
+    chunk->size = length;
+    chunk->used = length;
+    strFlatten(str, chunk->data);
+
+    entry->version = version;
+    entry->length = length;
+    entry->chunk = chunk;
+    entry->pin = newPin();
+
+    lockCache(L);
+
+    if (*slot != NULL)
+        cacheEvict(L, *slot);
+
+    while (L->cache.size + length > L->cache.budget && L->cache.Last != NULL)
+        cacheEvict(L, L->cache.Last);
+
+    entry->slot = slot;
+    entry->pPtr = NULL;
+    entry->nPtr = L->cache.First;
+    if (L->cache.First != NULL)
+        L->cache.First->pPtr = entry;
+    else
+        L->cache.Last = entry;
+    L->cache.First = entry;
+    L->cache.size += length;
+    *slot = entry;
+
+    unlockCache(L);
+}
+
+// Remove the entry from the cache, caller holds the cache lock
+// Body is freed when the responses sending it are written
+void cacheEvict(tList *L, tCachePtr entry)
+{
+    if (entry->pPtr != NULL)
+        entry->pPtr->nPtr = entry->nPtr;
+    else
+        L->cache.First = entry->nPtr;
+
+    if (entry->nPtr != NULL)
+        entry->nPtr->pPtr = entry->pPtr;
+    else
+        L->cache.Last = entry->pPtr;
+
+    L->cache.size -= entry->length;
+    *entry->slot = NULL;
+
+    pthread_mutex_lock(&entry->pin->lock);
+    entry->pin->owned = false;
+    entry->pin->chunks = entry->chunk;
+    pthread_mutex_unlock(&entry->pin->lock);
+
+    unpin(entry->pin);
+    free(entry);
+}
+
+// Lock posts of the board, the directory has to be locked already
+// Returns false without the lock when the stored posts are corrupted
+bool lockBoard(tList *L, tBoardPtr B, bool write)
+{
+    if (atomic_load(&B->unloaded) && !loadStoredPosts(L, B))
+        return false;
+
+    if (!L->shared)
+        return true;
+
+    if (write)
+        pthread_rwlock_wrlock(&B->lock);
+    else
+        pthread_rwlock_rdlock(&B->lock);
+    return true;
+}
+
+// Unlock posts of the board
+void unlockBoard(tList *L, tBoardPtr B)
+{
+    if (L->shared)
+        pthread_rwlock_unlock(&B->lock);
+}
+
+// Create new board if it does not exists
+int newBoard(tList *L, char name[])
+{
+    if (strlen(name) > MAX_NAME)
+    {
+        disposeList(L);
+        fprintf(stderr, "Name is too long!");
+        exit(1);
+    }
+
+    lockList(L, true);
+
+    // Check if board already exists
+    if (findByName(L, name) != NULL)
+    {
+        unlockList(L);
+        return RQ_EXISTS;
+    }
+
+    tBoardPtr newBoard = malloc(sizeof(struct tBoard));
+
+    if (newBoard == NULL)
+    {
+        disposeList(L);
+        fprintf(stderr, "Malloc error!");
+        exit(1);
+    }
+    else
+    {
+        strcpy(newBoard->name, name);
+        newBoard->nameLength = strlen(name);
+        newBoard->hash = hashName(name, newBoard->nameLength);
+        pthread_rwlock_init(&newBoard->lock, NULL);
+        initArena(&newBoard->arena);
+        newBoard->posts = newNode(&newBoard->arena, true);
+        initIndex(&newBoard->index);
+        newBoard->version = atomic_fetch_add(&L->clock, 1) + 1;
+        newBoard->cache = NULL;
+        newBoard->changes = NULL;
+        newBoard->changeCount = 0;
+        newBoard->changeNext = 0;
+        newBoard->base = newBoard->version;
+        newBoard->watching = NULL;
+        newBoard->stored = NULL;
+        newBoard->storedCount = 0;
+        atomic_init(&newBoard->unloaded, false);
+        atomic_init(&newBoard->unindexed, false);
+        atomic_init(&newBoard->broken, false);
+
+        if (L->First != NULL)
+        {
+            L->First->pPtr = newBoard;
+        }
+        newBoard->nPtr = L->First;
+        newBoard->pPtr = NULL;
+
+        L->First = newBoard;
+        indexInsert(L, newBoard);
+        L->version++;
+        newBoard->created = L->version;
+        walRecord(W_NEW_BOARD, name, newBoard->nameLength, 0, NULL, 0);
+
+        unlockList(L);
+        return RQ_CREATED;
+    }
+}
+
+// Find board by name and return the pointer to it
+// Boards not moved from the old index yet are searched there
+tBoardPtr findByName(tList *L, char name[])
+{
+    int length = strlen(name);
+    unsigned int hash = hashName(name, length);
+    tBoardPtr *slot = tableFind(&L->table, hash, name, length);
+
+    if (slot == NULL && L->old.size > 0)
+        slot = tableFind(&L->old, hash, name, length);
+
+    return slot != NULL ? *slot : NULL;
+}
+
+// Initialize the hash table with the number of slots (power of two)
+void initTable(tTable *T, int size)
+{
+    T->size = size;
+    T->used = 0;
+    T->slots = NULL;
+
+    if (size > 0 && (T->slots = calloc(size, sizeof(tBoardPtr))) == NULL)
+        err(1, "calloc() failed");
+}
+
+// Find the slot of the board, returns NULL when the board is not in the table
+tBoardPtr *tableFind(tTable *T, unsigned int hash, const char *name, int length)
+{
+    unsigned int mask = T->size - 1;
+
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask)
+    {
+        tBoardPtr B = T->slots[i];
+
+        if (B == NULL)
+            return NULL;
+
+        // Stored hash and length filter out almost all other boards
+        if (B != TOMBSTONE && B->hash == hash && B->nameLength == length &&
+            memcmp(B->name, name, length) == 0)
+            return &T->slots[i];
+    }
+}
+
+// Insert the board to the first free slot of its probe sequence
+void tableInsert(tTable *T, tBoardPtr B)
+{
+    unsigned int mask = T->size - 1;
+    unsigned int i = B->hash & mask;
+
+    while (T->slots[i] != NULL && T->slots[i] != TOMBSTONE)
+        i = (i + 1) & mask;
+
+    if (T->slots[i] == NULL)
+        T->used++;
+    T->slots[i] = B;
+}
+
+// Add the board to the index
+// When the table gets full, a bigger one is created and the boards are moved
+// to it a few at a time by the following operations, so there is no long pause
+void indexInsert(tList *L, tBoardPtr B)
+{
+    migrateIndex(L, MIGRATE_STEP);
+
+    if ((L->table.used + 1) * 4 > L->table.size * 3)
+    {
+        // Previous resize has to be finished first
+        migrateIndex(L, L->old.size);
+
+        // Size is computed from the boards in the table, tombstones are dropped
+        int size = TABLE_MIN;
+        while (size < (L->count + 1) * 4)
+            size *= 2;
+
+        L->old = L->table;
+        L->migrated = 0;
+        initTable(&L->table, size);
+    }
+
+    tableInsert(&L->table, B);
+    L->count++;
+}
+
+// Remove the board from the index, tombstone keeps the probe sequences unbroken
+void indexRemove(tList *L, tBoardPtr B)
+{
+    tBoardPtr *slot = tableFind(&L->table, B->hash, B->name, B->nameLength);
+
+    if (slot == NULL && L->old.size > 0)
+        slot = tableFind(&L->old, B->hash, B->name, B->nameLength);
+
+    if (slot != NULL)
+    {
+        *slot = TOMBSTONE;
+        L->count--;
+    }
+
+    migrateIndex(L, MIGRATE_STEP);
+}
+
+// Move boards from the old table to the new one, at most steps slots
+void migrateIndex(tList *L, int steps)
+{
+    if (L->old.size == 0)
+        return;
+
+    while (steps-- > 0 && L->migrated < L->old.size)
+    {
+        tBoardPtr B = L->old.slots[L->migrated];
+
+        if (B != NULL && B != TOMBSTONE)
+        {
+            tableInsert(&L->table, B);
+            // Old table is still searched, tombstone keeps its probe sequences
+            L->old.slots[L->migrated] = TOMBSTONE;
+        }
+        L->migrated++;
+    }
+
+    // Everything was moved
+    if (L->migrated == L->old.size)
+    {
+        free(L->old.slots);
+        initTable(&L->old, 0);
+    }
+}
+
+// Find element by ID and return the pointer to its place in the tree
+tElemPtr *findById(tBoardPtr B, int id)
+{
+    if (id < 1 || id > B->posts->size)
+    {
+        return NULL;
+    }
+
+    return treeGet(B->posts, id - 1);
+}
+
+// Create new post at the end of the board
+int newPost(tList *L, char name[], char content[], int length)
+{
+    return insertPost(L, name, 0, content, length);
+}
+
+// Create new post with the ID, posts from the ID move one position down
+// ID 0 appends the post after the last one
+int insertPost(tList *L, char name[], int id, char content[], int length)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, true))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+
+    if ((id = boardInsert(tmp, id, content, length)) == 0)
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    logChange(L, tmp, CH_INSERT, id);
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return RQ_CREATED;
+}
+
+// Apply the operations to the board at once, one per line:
+// "add content", "insert ID content", "update ID content" or "delete ID"
+// Readers see all of them or none, they get one version of the board
+// Status of every operation is appended to the body on its own line
+int batchPosts(tList *L, char name[], char ops[], int length, string *str)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, true))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+    walBegin();
+
+    unsigned int since = tmp->version;
+    unsigned int version = 0;
+    int pos = 0;
+    char status[8];
+
+    while (pos < length)
+    {
+        int end = pos + scanChar(ops + pos, length - pos, '\n') + 1;
+        if (end == pos)
+            end = length + 1;
+
+        // Line without the line break, empty lines are skipped
+        int lineEnd = end - 1;
+        if (lineEnd > pos && ops[lineEnd - 1] == '\r')
+            lineEnd--;
+        if (lineEnd == pos)
+        {
+            pos = end;
+            continue;
+        }
+
+        // Operation, ID and content are separated by one space
+        tSlice op = {pos, 0}, id = {0, 0};
+        while (op.pos + op.length < lineEnd && ops[op.pos + op.length] != ' ')
+            op.length++;
+        int content = op.pos + op.length + 1;
+
+        if (!sliceEquals(ops, op, "add"))
+        {
+            id.pos = content;
+            while (id.pos + id.length < lineEnd && ops[id.pos + id.length] != ' ')
+                id.length++;
+            content = id.pos + id.length + 1;
+        }
+        if (content > lineEnd)
+            content = lineEnd;
+
+        int n = sliceNumber(ops, id);
+        int code = RQ_CL;
+        char type = 0;
+
+        if (sliceEquals(ops, op, "add") && content < lineEnd)
+        {
+            n = boardInsert(tmp, 0, ops + content, lineEnd - content);
+            code = RQ_CREATED;
+            type = CH_INSERT;
+        }
+        else if (sliceEquals(ops, op, "insert") && n > 0 && content < lineEnd)
+        {
+            n = boardInsert(tmp, n, ops + content, lineEnd - content);
+            code = n > 0 ? RQ_CREATED : RQ_NOT_FOUND;
+            type = CH_INSERT;
+        }
+        else if (sliceEquals(ops, op, "update") && n > 0 && content < lineEnd)
+        {
+            code = boardChange(tmp, n, ops + content, lineEnd - content) ? RQ_OK : RQ_NOT_FOUND;
+            type = CH_CHANGE;
+        }
+        else if (sliceEquals(ops, op, "delete") && n > 0 && content == lineEnd)
+        {
+            code = boardDelete(tmp, n) ? RQ_OK : RQ_NOT_FOUND;
+            type = CH_DELETE;
+        }
+
+        if (code == RQ_OK || code == RQ_CREATED)
+        {
+            if (version == 0)
+                version = atomic_fetch_add(&L->clock, 1) + 1;
+            recordChange(tmp, version, type, n);
+        }
+
+        strAddData(str, status, sprintf(status, "%d\n", code));
+        pos = end;
+    }
+
+    if (version != 0 && tmp->watching != NULL)
+        notifyWatchers(L, tmp, since, false);
+
+    // Replay applies the whole batch or nothing of it
+    walEnd();
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return RQ_OK;
+}
+
+// Append the imported posts to the board, records are the length and the content
+// Board line comes with reserve >= 0, the board is created when it does not exist
+// and the space of its posts is reserved at once
+// Readers get all the posts with one version, older changes are forgotten
+// Returns the number of the imported posts
+int importPosts(tList *L, char name[], int reserve, char records[], int length, int *created)
+{
+    int count = 0, postLength;
+
+    if (reserve >= 0 && newBoard(L, name) == RQ_CREATED)
+        (*created)++;
+
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return 0;
+    }
+
+    if (!lockBoard(L, tmp, true))
+    {
+        unlockList(L);
+        return 0;
+    }
+
+    if (reserve > 0)
+        arenaReserve(&tmp->arena, reserve);
+
+    walBegin();
+    for (int pos = 0; pos < length; pos += sizeof(int) + postLength)
+    {
+        memcpy(&postLength, records + pos, sizeof(int));
+        boardInsert(tmp, 0, records + pos + sizeof(int), postLength);
+        count++;
+    }
+    walEnd();
+
+    if (count > 0)
+    {
+        unsigned int since = tmp->version;
+
+        // Changes of an import would be longer than the listing
+        tmp->version = atomic_fetch_add(&L->clock, 1) + 1;
+        tmp->changeCount = 0;
+        tmp->base = tmp->version;
+
+        if (tmp->watching != NULL)
+            notifyWatchers(L, tmp, since, false);
+    }
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return count;
+}
+
+// Insert the post to the board, caller holds the board write lock
+// ID 0 appends the post, returns the ID of the post or 0 when it is too big
+int boardInsert(tBoardPtr B, int id, char content[], int length)
+{
+    if (id == 0)
+        id = B->posts->size + 1;
+    else if (id > B->posts->size + 1)
+        return 0;
+
+    tElemPtr post = arenaPost(&B->arena, content, length);
+    unsigned int doc = newDoc(&B->arena);
+
+    treeInsert(&B->arena, &B->posts, id - 1, post, doc);
+    indexPost(B, doc, post);
+    walRecord(W_INSERT, B->name, B->nameLength, id, content, length);
+
+    // Posts behind the cursor of the compaction moved
+    if (B->arena.old != NULL && id - 1 < B->arena.cursor)
+        B->arena.cursor++;
+
+    arenaCompact(&B->arena, B->posts);
+    return id;
+}
+
+// Delete board
+int deleteBoard(tList *L, char name[])
+{
+    // Nobody else can use the board while the directory is write locked
+    lockList(L, true);
+    tBoardPtr tmp = findByName(L, name);
+
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (tmp == L->First)
+    {
+        L->First = tmp->nPtr;
+    }
+
+    tBoardPtr next = tmp->nPtr;
+    tBoardPtr prev = tmp->pPtr;
+
+    if (tmp->pPtr != NULL)
+    {
+        tmp->pPtr->nPtr = next;
+    }
+
+    if (tmp->nPtr != NULL)
+    {
+        tmp->nPtr->pPtr = prev;
+    }
+
+    indexRemove(L, tmp);
+    L->version++;
+    walRecord(W_DELETE_BOARD, tmp->name, tmp->nameLength, 0, NULL, 0);
+
+    // Watchers learn that the board is gone
+    if (tmp->watching != NULL)
+        notifyWatchers(L, tmp, tmp->version, true);
+
+    lockCache(L);
+    if (tmp->cache != NULL)
+        cacheEvict(L, tmp->cache);
+    unlockCache(L);
+
+    disposeBoard(tmp);
+    pthread_rwlock_destroy(&tmp->lock);
+    free(tmp);
+
+    unlockList(L);
+    return RQ_OK;
+}
+
+// Get all boards, version of the list is written to version
+int getBoards(tList *L, string *str, unsigned int *version)
+{
+    strClear(str);
+    lockList(L, false);
+    tBoardPtr tmp = L->First;
+    *version = L->version;
+
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    // List did not change since it was rendered
+    if (cacheGet(L, &L->cached, L->version, str))
+    {
+        unlockList(L);
+        return RQ_OK;
+    }
+
+    strReserve(str, L->count * MAX_NAME);
+
+    while (tmp != NULL)
+    {
+        strAddData(str, tmp->name, tmp->nameLength);
+        string_concat(str, "\n");
+        tmp = tmp->nPtr;
+    }
+
+    cachePut(L, &L->cached, L->version, str);
+
+    unlockList(L);
+    return RQ_OK;
+}
+
+// Get all posts with IDs, or only the posts in the window
+// Large listing is not created when it can be streamed, RQ_STREAM is returned
+// with the board name in the body, window tells the posts of the stream
+// ETag of the listing goes to the request, RQ_NOT_MODIFIED is returned when
+// the request has it in If-None-Match
+// ?since= gets only the changes when the log of the board has all of them
+int getPosts(tList *L, char name[], string *str, tRqst *rqst)
+{
+    tWindow *w = &rqst->window;
+
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, false))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+
+    char tmpName[23];
+    sprintf(tmpName, "[%s]\n", name);
+
+    // Changes after the version, older version gets the whole listing
+    if (w->since != -1)
+    {
+        bool delta = (unsigned int)w->since >= tmp->base && (unsigned int)w->since <= tmp->version;
+
+        sprintf(rqst->extra, "X-Board-Version: %u\r\nX-Delta: %s\r\n", tmp->version, delta ? "changes" : "full");
+        if (delta)
+        {
+            string_concat(str, tmpName);
+            listChanges(tmp, w->since, str, false);
+
+            unlockBoard(L, tmp);
+            unlockList(L);
+            return RQ_OK;
+        }
+    }
+    else
+    {
+        sprintf(rqst->extra, "X-Board-Version: %u\r\n", tmp->version);
+    }
+
+    // Window is found in the tree, the cost depends only on its size
+    int size = tmp->posts->size;
+    w->first = w->tail >= 0 ? size - w->tail + 1 : w->offset + 1;
+    if (w->first < 1)
+        w->first = 1;
+    w->last = w->limit >= 0 && w->limit <= size - w->first ? w->first + w->limit - 1 : size;
+    bool all = w->first == 1 && w->last == size;
+
+    // Range without posts can not be satisfied
+    if (w->range && w->first > size)
+    {
+        sprintf(rqst->extra + strlen(rqst->extra), "Content-Range: items */%d\r\n", size);
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_RANGE;
+    }
+
+    // Same version of the board and the same window give the same listing,
+    // the board is recognized by its creation, a new board of the same
+    // name does not match
+    if (all)
+        sprintf(rqst->etag, "\"%x-%x-%x\"", bootId, tmp->created, tmp->version);
+    else
+        sprintf(rqst->etag, "\"%x-%x-%x-%x-%x\"", bootId, tmp->created, tmp->version, w->first, w->last);
+
+    if (tagMatches(rqst->match, rqst->etag))
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_NOT_MODIFIED;
+    }
+
+    // Range header gets the part with its position in the board
+    int code = RQ_OK;
+    if (w->range)
+    {
+        sprintf(rqst->extra + strlen(rqst->extra), "Content-Range: items %d-%d/%d\r\n", w->first, w->last, size);
+        code = RQ_PARTIAL;
+    }
+
+    // HTTP/1.0 clients do not know the chunked encoding
+    if (!rqst->http10 && w->last - w->first + 1 > STREAM_POSTS)
+    {
+        string_concat(str, tmpName);
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_STREAM;
+    }
+
+    // Whole listings are cached until the board changes
+    if (all && cacheGet(L, &tmp->cache, tmp->version, str))
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return code;
+    }
+
+    string_concat(str, tmpName);
+
+    // Records are larger than their content, 12 bytes are left for the ID
+    if (all)
+        strReserve(str, tmp->arena.live + size * 12);
+    listPosts(tmp, w->first, w->last, str, -1);
+
+    if (all)
+        cachePut(L, &tmp->cache, tmp->version, str);
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return code;
+}
+
+// Give the board a new version and remember the change,
+// caller holds the board write lock
+// Versions come from the clock of the list, so a new board of the same
+// name does not reuse the versions of the deleted one
+void logChange(tList *L, tBoardPtr B, char type, int id)
+{
+    unsigned int since = B->version;
+
+    recordChange(B, atomic_fetch_add(&L->clock, 1) + 1, type, id);
+
+    if (B->watching != NULL)
+        notifyWatchers(L, B, since, false);
+}
+
+// Remember the change in the ring of the board, the board gets its version
+// More changes of one batch share the version
+void recordChange(tBoardPtr B, unsigned int version, char type, int id)
+{
+    B->version = version;
+
+    if (B->changes == NULL && (B->changes = malloc(CHANGE_LOG * sizeof(tChange))) == NULL)
+        err(1, "malloc() failed");
+
+    // Full ring forgets the oldest change
+    if (B->changeCount == CHANGE_LOG)
+        B->base = B->changes[B->changeNext].version;
+    else
+        B->changeCount++;
+
+    B->changes[B->changeNext].version = version;
+    B->changes[B->changeNext].id = id;
+    B->changes[B->changeNext].type = type;
+    B->changeNext = (B->changeNext + 1) % CHANGE_LOG;
+}
+
+// Append the changes after the version, caller holds the board lock
+// Changes have the IDs of their time, so the client applies them in order,
+// "+ID. content", "=ID. content" or "-ID.", or SSE events of the changes
+// Content is the current one, posts deleted later are sent empty
+void listChanges(tBoardPtr B, unsigned int since, string *str, bool sse)
+{
+    int count = 0;
+    char line[64];
+
+    while (count < B->changeCount && B->changes[(B->changeNext - 1 - count + CHANGE_LOG) % CHANGE_LOG].version > since)
+        count++;
+
+    // From the oldest change
+    for (int i = count - 1; i >= 0; i--)
+    {
+        tChange *change = &B->changes[(B->changeNext - 1 - i + CHANGE_LOG) % CHANGE_LOG];
+        tElemPtr post = NULL;
+
+        // Position of the post now, later changes move it or delete it
+        int pos = change->type == CH_DELETE ? 0 : change->id;
+        for (int j = i - 1; j >= 0 && pos > 0; j--)
+        {
+            tChange *later = &B->changes[(B->changeNext - 1 - j + CHANGE_LOG) % CHANGE_LOG];
+
+            if (later->type == CH_INSERT && later->id <= pos)
+                pos++;
+            else if (later->type == CH_DELETE && later->id < pos)
+                pos--;
+            else if (later->type == CH_DELETE && later->id == pos)
+                pos = 0;
+        }
+        if (pos > 0)
+            post = *treeGet(B->posts, pos - 1);
+
+        if (sse)
+        {
+            const char *kind = change->type == CH_INSERT ? "insert" : change->type == CH_CHANGE ? "change" : "delete";
+
+            strAddData(str, line, sprintf(line, "id: %u\nevent: %s\ndata: %d.", change->version, kind, change->id));
+            if (change->type != CH_DELETE)
+                strAddChar(str, ' ');
+
+            // SSE lines can not contain a line break, content continues on more data lines
+            for (int k = 0; post != NULL && k < (int)post->length;)
+            {
+                int end = scanChar(post->data + k, post->length - k, '\n');
+                if (end == -1)
+                {
+                    strAddData(str, post->data + k, post->length - k);
+                    break;
+                }
+
+                strAddData(str, post->data + k, end);
+                string_concat(str, "\ndata: ");
+                k += end + 1;
+            }
+            string_concat(str, "\n\n");
+            continue;
+        }
+
+        strAddData(str, line, sprintf(line, change->type == CH_DELETE ? "%c%d." : "%c%d. ", change->type, change->id));
+        if (post != NULL)
+        {
+            if (post->length >= REF_MIN)
+                strAddRef(str, post->data, post->length, pinPost(&B->arena, post));
+            else
+                strAddData(str, post->data, post->length);
+        }
+        strAddChar(str, '\n');
+    }
+}
+
+// Append the next chunk of the streamed listing of the board
+// pos is ID of the next post, posts after last are not listed
+// Posts changed between chunks are listed as they are when their chunk is created
+// Returns true when the listing is finished, the last chunk ends the stream
+bool getPostsChunk(tList *L, char name[], int *pos, int last, string *str)
+{
+    bool done = true;
+    int sizeLine = beginChunk(str);
+    int start = str->length + str->refLength;
+
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+
+    // Deleted (or broken) board ends the listing
+    if (tmp != NULL && lockBoard(L, tmp, false))
+    {
+        *pos = listPosts(tmp, *pos, last, str, STREAM_CHUNK);
+        done = *pos > last || *pos > tmp->posts->size;
+        unlockBoard(L, tmp);
+    }
+
+    unlockList(L);
+    endChunk(str, sizeLine, start);
+
+    if (done)
+        strAddData(str, "0\r\n\r\n", 5);
+
+    return done;
+}
+
+// Append the next chunk of the export of the board, NDJSON lines
+// {"board":"name","posts":N,"bytes":N} and {"post":"content"} of its posts
+// pos is ID of the next post, 0 before the board line
+// Returns true when the board is exported, deleted board is skipped
+bool exportChunk(tList *L, char name[], int *pos, string *str)
+{
+    bool done = true;
+    int sizeLine = beginChunk(str);
+    int start = str->length + str->refLength;
+    char line[64];
+
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+
+    if (tmp != NULL && lockBoard(L, tmp, false))
+    {
+        // Importer reserves the space of the posts at once
+        if (*pos == 0)
+        {
+            string_concat(str, "{\"board\":");
+            strAddJson(str, tmp->name, tmp->nameLength);
+            strAddData(str, line, sprintf(line, ",\"posts\":%d,\"bytes\":%zu}\n", tmp->posts->size, tmp->arena.live));
+            *pos = 1;
+        }
+
+        if (*pos <= tmp->posts->size)
+        {
+            int i;
+            tNodePtr leaf = treeLeaf(tmp->posts, *pos - 1, &i);
+
+            for (; leaf != NULL && str->length + str->refLength - start < STREAM_CHUNK; leaf = leaf->next, i = 0)
+            {
+                for (; i < leaf->count && str->length + str->refLength - start < STREAM_CHUNK; i++, (*pos)++)
+                {
+                    string_concat(str, "{\"post\":");
+                    strAddJson(str, leaf->items[i]->data, leaf->items[i]->length);
+                    string_concat(str, "}\n");
+                }
+            }
+        }
+
+        done = *pos > tmp->posts->size;
+        unlockBoard(L, tmp);
+    }
+
+    unlockList(L);
+    endChunk(str, sizeLine, start);
+    return done;
+}
+
+// Start a chunk of the chunked encoding, its size is written by endChunk
+// Returns the position of the size line
+int beginChunk(string *str)
+{
+    int sizeLine = str->length;
+
+    // Size of the chunk is written to the placeholder when it is known
+    strAddData(str, "00000000\r\n", 10);
+    return sizeLine;
+}
+
+// Finish the chunk, start is the length of the string after the size line
+void endChunk(string *str, int sizeLine, int start)
+{
+    int length = str->length + str->refLength - start;
+
+    if (length > 0)
+    {
+        char size[9];
+        sprintf(size, "%08x", length);
+        memcpy(str->str + sizeLine, size, 8);
+        strAddData(str, "\r\n", 2);
+    }
+    else
+    {
+        // Empty chunk would end the stream
+        str->length = sizeLine;
+        str->str[sizeLine] = '\0';
+    }
+}
+
+// Append posts of the board from the ID to the last ID, caller holds the board lock
+// Stops after limit bytes, -1 lists all posts
+// Returns ID of the next post
+int listPosts(tBoardPtr B, int id, int last, string *str, int limit)
+{
+    if (last > B->posts->size)
+        last = B->posts->size;
+    if (id > last)
+        return id;
+
+    int i, end = str->length + str->refLength + limit;
+    tNodePtr leaf = treeLeaf(B->posts, id - 1, &i);
+    char cId[14];
+
+    // Append ID s to posts, leaves are walked in order
+    while (leaf != NULL)
+    {
+        for (; i < leaf->count; i++)
+        {
+            if (id > last || (limit != -1 && str->length + str->refLength >= end))
+                return id;
+
+            strAddData(str, cId, sprintf(cId, "%d. ", id));
+
+            // Long posts are sent straight from the arena
+            if (leaf->items[i]->length >= REF_MIN)
+                strAddRef(str, leaf->items[i]->data, leaf->items[i]->length, pinPost(&B->arena, leaf->items[i]));
+            else
+                strAddData(str, leaf->items[i]->data, leaf->items[i]->length);
+            strAddChar(str, '\n');
+
+            id++;
+        }
+        leaf = leaf->next;
+        i = 0;
+    }
+
+    return id;
+}
+
+// Register the watcher of the loop of the request on the board,
+// the caller parks the connection when RQ_WATCH is returned
+// Long-poll with an older version than the board gets the changes at once
+int watchBoard(tList *L, char name[], string *str, tRqst *rqst)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, false))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+
+    if (!rqst->sse && rqst->window.since != -1 && (unsigned int)rqst->window.since != tmp->version)
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return getPosts(L, name, str, rqst);
+    }
+
+    // Readers of the board may race to create the counters, one of them wins
+    atomic_int *watching = atomic_load(&tmp->watching);
+    if (watching == NULL)
+    {
+        atomic_int *fresh = calloc(loopCount, sizeof(atomic_int));
+        if (fresh == NULL)
+            err(1, "calloc() failed");
+
+        if (atomic_compare_exchange_strong(&tmp->watching, &watching, fresh))
+            watching = fresh;
+        else
+            free(fresh);
+    }
+
+    atomic_fetch_add(&watching[rqst->from], 1);
+    rqst->watching = tmp->created;
+    sprintf(rqst->extra, "X-Board-Version: %u\r\n", tmp->version);
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return RQ_WATCH;
+}
+
+// Remove the watcher of the loop from the board
+// Board deleted meanwhile took its watchers with it
+void unwatchBoard(tList *L, char name[], unsigned int created, int loop)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+
+    if (tmp != NULL && tmp->created == created && lockBoard(L, tmp, false))
+    {
+        atomic_fetch_sub(&tmp->watching[loop], 1);
+        unlockBoard(L, tmp);
+    }
+
+    unlockList(L);
+}
+
+// Send the changes after the version to the loops with watchers of the board,
+// caller holds the board (or list) write lock
+// Events are rendered once, the SSE events and the long-poll body are in one
+// chunk referenced by all watchers
+// Changes not kept by the log are sent as the whole listing (SSE reset event)
+void notifyWatchers(tList *L, tBoardPtr B, unsigned int since, bool deleted)
+{
+    bool full = since < B->base;
+    char line[MAX_NAME + 64];
+    string event;
+
+    strInit(&event);
+
+    if (deleted)
+        strAddData(&event, line, sprintf(line, "id: %u\nevent: deleted\ndata: \n\n", B->version));
+    else if (full)
+        strAddData(&event, line, sprintf(line, "id: %u\nevent: reset\ndata: \n\n", B->version));
+    else
+        listChanges(B, since, &event, true);
+    int sseLength = event.length;
+
+    // Long-poll body is the listing of the changes
+    if (!deleted)
+    {
+        strAddData(&event, line, sprintf(line, "[%s]\n", B->name));
+        if (full)
+            listPosts(B, 1, B->posts->size, &event, -1);
+        else
+            listChanges(B, since, &event, false);
+    }
+
+    int length = event.length + event.refLength;
+    tChunk *chunk = malloc(sizeof(tChunk) + length);
+    if (chunk == NULL)
+        err(1, "malloc() failed");
+
+    chunk->next = NULL;
+    chunk->size = chunk->used = length;
+    strFlatten(&event, chunk->data);
+    tPin *pin = newPin();
+
+    for (int i = 0; i < loopCount; i++)
+    {
+        if (B->watching[i] == 0)
+            continue;
+
+        tMsgPtr m = newMsg(currentLoop, NULL, MSG_EVENT);
+        strcpy(m->name, B->name);
+        m->created = B->created;
+        m->version = B->version;
+        m->deleted = deleted;
+        m->full = full;
+        m->event = chunk->data;
+        m->sseLength = sseLength;
+        m->pollLength = length - sseLength;
+        m->pin = pin;
+        atomic_fetch_add(&pin->refs, 1);
+        sendMsg(&loops[i], m);
+    }
+
+    // Chunk is freed by the last watcher
+    pthread_mutex_lock(&pin->lock);
+    pin->owned = false;
+    pin->chunks = chunk;
+    pthread_mutex_unlock(&pin->lock);
+    unpin(pin);
+
+    strFree(&event);
+}
+
+// Change post content
+int changePost(tList *L, char name[], int id, char content[], int length)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, true))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+    if (!boardChange(tmp, id, content, length))
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    logChange(L, tmp, CH_CHANGE, id);
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return RQ_OK;
+}
+
+// Change the post of the board, caller holds the board write lock
+// Returns false when there is no post with the ID
+bool boardChange(tBoardPtr B, int id, char content[], int length)
+{
+    int i;
+
+    if (findById(B, id) == NULL)
+        return false;
+
+    // New record replaces the old one in the tree, it is a new document
+    tNodePtr leaf = treeLeaf(B->posts, id - 1, &i);
+    tElemPtr old = leaf->items[i];
+    unsigned int oldDoc = leaf->docs[i];
+
+    leaf->items[i] = arenaPost(&B->arena, content, length);
+    leaf->docs[i] = newDoc(&B->arena);
+    B->arena.leaves[leaf->docs[i]] = leaf;
+    indexPost(B, leaf->docs[i], leaf->items[i]);
+    dropDoc(B, oldDoc, old);
+    arenaRelease(&B->arena, old);
+    walRecord(W_CHANGE, B->name, B->nameLength, id, content, length);
+    arenaCompact(&B->arena, B->posts);
+    return true;
+}
+
+// Delete post
+int deletePost(tList *L, char name[], int id)
+{
+    lockList(L, false);
+    tBoardPtr tmp = findByName(L, name);
+    if (tmp == NULL)
+    {
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    if (!lockBoard(L, tmp, true))
+    {
+        unlockList(L);
+        return RQ_BROKEN;
+    }
+    if (!boardDelete(tmp, id))
+    {
+        unlockBoard(L, tmp);
+        unlockList(L);
+        return RQ_NOT_FOUND;
+    }
+
+    logChange(L, tmp, CH_DELETE, id);
+
+    unlockBoard(L, tmp);
+    unlockList(L);
+    return RQ_OK;
+}
+
+// Delete the post of the board, caller holds the board write lock
+// Returns false when there is no post with the ID
+bool boardDelete(tBoardPtr B, int id)
+{
+    int i;
+
+    if (findById(B, id) == NULL)
+        return false;
+
+    unsigned int doc = treeLeaf(B->posts, id - 1, &i)->docs[i];
+
+    // Following posts get IDs smaller by one
+    tElemPtr post = treeRemove(&B->arena, &B->posts, id - 1);
+    dropDoc(B, doc, post);
+    arenaRelease(&B->arena, post);
+    walRecord(W_DELETE, B->name, B->nameLength, id, NULL, 0);
+
+    if (B->arena.old != NULL && id - 1 < B->arena.cursor)
+        B->arena.cursor--;
+
+    arenaCompact(&B->arena, B->posts);
+    return true;
+}
+
+// Free the list of boards
+void disposeList(tList *L)
+{
+    tBoardPtr tmp;
+
+    while (L->First != NULL)
+    {
+        tmp = L->First;
+
+        disposeBoard(tmp);
+
+        L->First = L->First->nPtr;
+        free(tmp);
+    }
+
+    while (L->cache.First != NULL)
+        cacheEvict(L, L->cache.First);
+
+    free(L->table.slots);
+    free(L->old.slots);
+    initTable(&L->table, TABLE_MIN);
+    initTable(&L->old, 0);
+    L->count = 0;
+}
+
+// Free posts(board items), they are all in the arena, and their index
+void disposeBoard(tBoardPtr B)
+{
+    disposeArena(&B->arena);
+    disposeIndex(&B->index);
+    B->posts = NULL;
+    free(B->changes);
+    B->changes = NULL;
+    free(B->watching);
+    B->watching = NULL;
+}
+
+// Get an empty node of the tree from the arena
+tNodePtr newNode(tArena *A, bool leaf)
+{
+    tNodePtr node = A->free;
+
+    if (node != NULL)
+        A->free = node->next;
+    else
+        node = arenaAlloc(&A->nodes, sizeof(struct tNode), sizeof(struct tNode), NODE_CHUNK_MAX * sizeof(struct tNode));
+
+    node->leaf = leaf;
+    node->count = 0;
+    node->size = 0;
+    node->next = NULL;
+    node->parent = NULL;
+    return node;
+}
+
+// Return the node to the arena for reuse
+void freeNode(tArena *A, tNodePtr node)
+{
+    node->next = A->free;
+    A->free = node;
+}
+
+// Get the place of the post on the position (from 0)
+tElemPtr *treeGet(tNodePtr root, int pos)
+{
+    int i;
+    tNodePtr leaf = treeLeaf(root, pos, &i);
+
+    return &leaf->items[i];
+}
+
+// Get the leaf with the position (from 0) and the index of the position in it
+// Subtree sizes tell which child contains the position
+tNodePtr treeLeaf(tNodePtr root, int pos, int *index)
+{
+    tNodePtr node = root;
+
+    while (!node->leaf)
+    {
+        int i = 0;
+        while (pos >= node->children[i]->size)
+        {
+            pos -= node->children[i]->size;
+            i++;
+        }
+        node = node->children[i];
+    }
+
+    *index = pos;
+    return node;
+}
+
+// Get the first leaf, the following ones are linked by next
+tNodePtr treeFirst(tNodePtr root)
+{
+    tNodePtr node = root;
+
+    while (!node->leaf)
+        node = node->children[0];
+
+    return node;
+}
+
+// Build the tree of the stored posts at once, nodes of every level
+// are filled evenly, so none of them is smaller than NODE_MIN
+// Records are checked by the caller (loadStoredPosts)
+tNodePtr treeLoad(tArena *A, const uint64_t offsets[], int count)
+{
+    int n = count > NODE_MAX ? (count + NODE_MAX - 1) / NODE_MAX : 1;
+    tNodePtr *level = malloc(n * sizeof(tNodePtr));
+
+    if (level == NULL)
+        err(1, "malloc() failed");
+
+    for (int i = 0, pos = 0; i < n; i++)
+    {
+        tNodePtr leaf = newNode(A, true);
+
+        leaf->count = leaf->size = (count - pos) / (n - i);
+        for (int j = 0; j < leaf->count; j++)
+        {
+            leaf->items[j] = storeRecord(A->pin->mapping, offsets[pos + j]);
+            leaf->docs[j] = newDoc(A);
+            A->leaves[leaf->docs[j]] = leaf;
+        }
+        pos += leaf->count;
+
+        if (i > 0)
+            level[i - 1]->next = leaf;
+        level[i] = leaf;
+    }
+
+    // Every level is a parent of the previous one, nodes are replaced in place
+    while (n > 1)
+    {
+        int parents = (n + NODE_MAX - 1) / NODE_MAX;
+
+        for (int i = 0, pos = 0; i < parents; i++)
+        {
+            tNodePtr node = newNode(A, false);
+
+            node->count = (n - pos) / (parents - i);
+            for (int j = 0; j < node->count; j++)
+            {
+                node->children[j] = level[pos + j];
+                node->size += level[pos + j]->size;
+                level[pos + j]->parent = node;
+            }
+            pos += node->count;
+            level[i] = node;
+        }
+
+        n = parents;
+    }
+
+    tNodePtr root = level[0];
+    free(level);
+    return root;
+}
+
+// Insert the post of the document to the position (from 0), the root grows
+// when it splits
+void treeInsert(tArena *A, tNodePtr *root, int pos, tElemPtr item, unsigned int doc)
+{
+    tNodePtr right = nodeInsert(A, *root, pos, item, doc);
+
+    if (right != NULL)
+    {
+        tNodePtr newRoot = newNode(A, false);
+        newRoot->children[0] = *root;
+        newRoot->children[1] = right;
+        newRoot->count = 2;
+        newRoot->size = (*root)->size + right->size;
+        adoptItems(A, newRoot, 0, 2);
+        *root = newRoot;
+    }
+}
+
+// Insert the post to the subtree
+// Returns the new right sibling when the node was split, NULL otherwise
+tNodePtr nodeInsert(tArena *A, tNodePtr node, int pos, tElemPtr item, unsigned int doc)
+{
+    node->size++;
+
+    if (node->leaf)
+    {
+        memmove(&node->items[pos + 1], &node->items[pos], (node->count - pos) * sizeof(tElemPtr));
+        memmove(&node->docs[pos + 1], &node->docs[pos], (node->count - pos) * sizeof(unsigned int));
+        node->items[pos] = item;
+        node->docs[pos] = doc;
+        node->count++;
+        adoptItems(A, node, pos, pos + 1);
+    }
+    else
+    {
+        // Position right after the last post of a child belongs to that child
+        int i = 0;
+        while (i < node->count - 1 && pos > node->children[i]->size)
+        {
+            pos -= node->children[i]->size;
+            i++;
+        }
+
+        tNodePtr right = nodeInsert(A, node->children[i], pos, item, doc);
+        if (right != NULL)
+        {
+            memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i - 1) * sizeof(tNodePtr));
+            node->children[i + 1] = right;
+            node->count++;
+            adoptItems(A, node, i + 1, i + 2);
+        }
+    }
+
+    return node->count > NODE_MAX ? splitNode(A, node) : NULL;
+}
+
+// Move the upper half of the node to a new right sibling
+tNodePtr splitNode(tArena *A, tNodePtr node)
+{
+    tNodePtr right = newNode(A, node->leaf);
+    int half = node->count / 2;
+
+    right->count = node->count - half;
+    node->count = half;
+
+    if (node->leaf)
+    {
+        memcpy(right->items, &node->items[half], right->count * sizeof(tElemPtr));
+        memcpy(right->docs, &node->docs[half], right->count * sizeof(unsigned int));
+        right->size = right->count;
+
+        right->next = node->next;
+        node->next = right;
+    }
+    else
+    {
+        memcpy(right->children, &node->children[half], right->count * sizeof(tNodePtr));
+        for (int i = 0; i < right->count; i++)
+            right->size += right->children[i]->size;
+    }
+
+    adoptItems(A, right, 0, right->count);
+    node->size -= right->size;
+    return right;
+}
+
+// Remove the post on the position (from 0) and return it
+// Root with one child is replaced by the child, so the tree gets lower
+tElemPtr treeRemove(tArena *A, tNodePtr *root, int pos)
+{
+    tElemPtr item = nodeRemove(A, *root, pos);
+
+    if (!(*root)->leaf && (*root)->count == 1)
+    {
+        tNodePtr old = *root;
+        *root = old->children[0];
+        (*root)->parent = NULL;
+        freeNode(A, old);
+    }
+
+    return item;
+}
+
+// Remove the post from the subtree, too small children are fixed on the way up
+tElemPtr nodeRemove(tArena *A, tNodePtr node, int pos)
+{
+    tElemPtr item;
+
+    node->size--;
+
+    if (node->leaf)
+    {
+        item = node->items[pos];
+        memmove(&node->items[pos], &node->items[pos + 1], (node->count - pos - 1) * sizeof(tElemPtr));
+        memmove(&node->docs[pos], &node->docs[pos + 1], (node->count - pos - 1) * sizeof(unsigned int));
+        node->count--;
+        return item;
+    }
+
+    int i = 0;
+    while (pos >= node->children[i]->size)
+    {
+        pos -= node->children[i]->size;
+        i++;
+    }
+
+    item = nodeRemove(A, node->children[i], pos);
+
+    if (node->children[i]->count < NODE_MIN)
+        fixChild(A, node, i);
+
+    return item;
+}
+
+// Child has too few entries, take one from a sibling or merge them
+void fixChild(tArena *A, tNodePtr node, int i)
+{
+    // Work with the pair of the child and its right (or left) sibling
+    if (i == node->count - 1)
+        i--;
+    if (i < 0)
+        return;
+
+    tNodePtr left = node->children[i];
+    tNodePtr right = node->children[i + 1];
+    int moved;
+
+    if (left->count + right->count <= NODE_MAX)
+    {
+        // Merge the right node to the left one
+        if (left->leaf)
+        {
+            memcpy(&left->items[left->count], right->items, right->count * sizeof(tElemPtr));
+            memcpy(&left->docs[left->count], right->docs, right->count * sizeof(unsigned int));
+            left->next = right->next;
+        }
+        else
+        {
+            memcpy(&left->children[left->count], right->children, right->count * sizeof(tNodePtr));
+        }
+
+        adoptItems(A, left, left->count, left->count + right->count);
+        left->count += right->count;
+        left->size += right->size;
+        freeNode(A, right);
+
+        memmove(&node->children[i + 1], &node->children[i + 2], (node->count - i - 2) * sizeof(tNodePtr));
+        node->count--;
+    }
+    else if (left->count < right->count)
+    {
+        // Take the first entry of the right node
+        if (left->leaf)
+        {
+            left->items[left->count] = right->items[0];
+            left->docs[left->count] = right->docs[0];
+            memmove(&right->items[0], &right->items[1], (right->count - 1) * sizeof(tElemPtr));
+            memmove(&right->docs[0], &right->docs[1], (right->count - 1) * sizeof(unsigned int));
+            moved = 1;
+        }
+        else
+        {
+            left->children[left->count] = right->children[0];
+            memmove(&right->children[0], &right->children[1], (right->count - 1) * sizeof(tNodePtr));
+            moved = left->children[left->count]->size;
+        }
+
+        adoptItems(A, left, left->count, left->count + 1);
+        left->count++;
+        right->count--;
+        left->size += moved;
+        right->size -= moved;
+    }
+    else
+    {
+        // Take the last entry of the left node
+        if (left->leaf)
+        {
+            memmove(&right->items[1], &right->items[0], right->count * sizeof(tElemPtr));
+            memmove(&right->docs[1], &right->docs[0], right->count * sizeof(unsigned int));
+            right->items[0] = left->items[left->count - 1];
+            right->docs[0] = left->docs[left->count - 1];
+            moved = 1;
+        }
+        else
+        {
+            memmove(&right->children[1], &right->children[0], right->count * sizeof(tNodePtr));
+            right->children[0] = left->children[left->count - 1];
+            moved = right->children[0]->size;
+        }
+
+        adoptItems(A, right, 0, 1);
+
+        left->count--;
+        right->count++;
+        left->size -= moved;
+        right->size += moved;
+    }
+}
+
+// Entries from..to moved to the node, the map of leaves (the children)
+// points to it
+void adoptItems(tArena *A, tNodePtr node, int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        if (node->leaf)
+            A->leaves[node->docs[i]] = node;
+        else
+            node->children[i]->parent = node;
+    }
+}
+
+// Give out the next document ID, the map of leaves grows with them
+unsigned int newDoc(tArena *A)
+{
+    if (A->docs == A->docAlloc)
+    {
+        A->docAlloc = A->docAlloc == 0 ? NODE_MAX : A->docAlloc * 2;
+        if ((A->leaves = realloc(A->leaves, A->docAlloc * sizeof(tNodePtr))) == NULL)
+            err(1, "realloc() failed");
+    }
+
+    return A->docs++;
+}
+
+// Position (from 0) of the first post of the leaf, sizes of the subtrees
+// left of the path to the root are added up
+int leafPosition(tNodePtr leaf)
+{
+    int pos = 0;
+
+    for (tNodePtr node = leaf; node->parent != NULL; node = node->parent)
+    {
+        for (int i = 0; node->parent->children[i] != node; i++)
+            pos += node->parent->children[i]->size;
+    }
+
+    return pos;
+}
+
+// Initialize empty arena, chunks are allocated on the first use
+void initArena(tArena *A)
+{
+    A->chunks = NULL;
+    A->old = NULL;
+    A->nodes = NULL;
+    A->free = NULL;
+    A->gen = 0;
+    A->live = 0;
+    A->dead = 0;
+    A->cursor = 0;
+    A->pin = newPin();
+    A->oldPin = NULL;
+    A->leaves = NULL;
+    A->docs = 0;
+    A->docAlloc = 0;
+}
+
+// Bump the size from the first chunk of the list
+// New chunk is twice the size of the previous one, from first up to max
+void *arenaAlloc(tChunk **chunks, size_t size, size_t first, size_t max)
+{
+    tChunk *chunk = *chunks;
+
+    if (chunk == NULL || chunk->used + size > chunk->size)
+    {
+        size_t chunkSize = chunk == NULL ? first : chunk->size * 2;
+
+        if (chunkSize > max)
+            chunkSize = max;
+        if (chunkSize < size)
+            chunkSize = size;
+
+        chunk = malloc(sizeof(tChunk) + chunkSize);
+        if (chunk == NULL)
+            err(1, "malloc() failed");
+
+        chunk->next = *chunks;
+        chunk->size = chunkSize;
+        chunk->used = 0;
+        *chunks = chunk;
+    }
+
+    void *data = &chunk->data[chunk->used];
+    chunk->used += size;
+    return data;
+}
+
+// Size of the record with the content, records are aligned to 8 bytes
+size_t recordSize(unsigned int length)
+{
+    return (sizeof(struct tElem) + length + 1 + 7) & ~(size_t)7;
+}
+
+// Write new post to the arena
+tElemPtr arenaPost(tArena *A, char content[], int length)
+{
+    size_t size = recordSize(length);
+    tElemPtr post = arenaAlloc(&A->chunks, size, ARENA_MIN, ARENA_MAX);
+
+    post->length = length;
+    post->gen = A->gen;
+    memcpy(post->data, content, length);
+    post->data[length] = '\0';
+
+    A->live += size;
+    return post;
+}
+
+// Make room for the records of size bytes in one chunk, import knows the size
+// of the board before its posts
+void arenaReserve(tArena *A, size_t size)
+{
+    if (A->chunks != NULL && A->chunks->size - A->chunks->used >= size)
+        return;
+
+    if (size > IMPORT_RESERVE)
+        size = IMPORT_RESERVE;
+
+    tChunk *chunk = malloc(sizeof(tChunk) + size);
+    if (chunk == NULL)
+        err(1, "malloc() failed");
+
+    chunk->next = A->chunks;
+    chunk->size = size;
+    chunk->used = 0;
+    A->chunks = chunk;
+}
+
+// Post is not in the tree anymore, its space waits for the compaction
+// Records of the old generation are freed with their chunks
+void arenaRelease(tArena *A, tElemPtr post)
+{
+    size_t size = recordSize(post->length);
+
+    // Records of the store are not in the arena
+    if (post->gen == STORE_GEN)
+        return;
+
+    A->live -= size;
+    if (post->gen == A->gen)
+        A->dead += size;
+}
+
+// One step of the compaction, called after every change of the board
+// It starts when released records take more space than live ones
+// Posts in the mapped store stay there
+void arenaCompact(tArena *A, tNodePtr root)
+{
+    if (A->old == NULL)
+    {
+        if (A->dead < ARENA_MIN || A->dead < A->live)
+            return;
+
+        // Current chunks become the old generation with their pin,
+        // responses refer to the moved posts by the pin of the new one
+        A->old = A->chunks;
+        A->chunks = NULL;
+        A->dead = 0;
+        A->cursor = 0;
+        A->gen++;
+        A->oldPin = A->pin;
+        A->pin = newPin();
+        if ((A->pin->mapping = A->oldPin->mapping) != NULL)
+            atomic_fetch_add(&A->pin->mapping->refs, 1);
+    }
+
+    // Move posts of the old generation after the cursor
+    for (int i = 0; i < COMPACT_STEP && A->cursor < root->size; i++, A->cursor++)
+    {
+        tElemPtr *post = treeGet(root, A->cursor);
+
+        if ((*post)->gen != A->gen && (*post)->gen != STORE_GEN)
+        {
+            tElemPtr old = *post;
+            *post = arenaPost(A, old->data, old->length);
+            A->live -= recordSize(old->length);
+        }
+    }
+
+    // All posts are moved, old chunks are freed with the last reference to them
+    if (A->cursor >= root->size)
+    {
+        releasePin(A->oldPin, A->old);
+        A->old = NULL;
+        A->oldPin = NULL;
+    }
+}
+
+// Free the list of chunks
+void freeChunks(tChunk *chunk)
+{
+    while (chunk != NULL)
+    {
+        tChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// Give the chunks to the pin and release the reference of its owner,
+// the chunks are freed with the last reference
+// Compaction and board deletion hold the board lock, so no reference
+// is added meanwhile
+void releasePin(tPin *pin, tChunk *chunks)
+{
+    pthread_mutex_lock(&pin->lock);
+    tChunk *last = chunks;
+    while (last != NULL && last->next != NULL)
+        last = last->next;
+    if (last != NULL)
+    {
+        last->next = pin->chunks;
+        pin->chunks = chunks;
+    }
+    pin->owned = false;
+    pthread_mutex_unlock(&pin->lock);
+
+    unpin(pin);
+}
+
+// Create a pin with the reference of its owner
+tPin *newPin()
+{
+    tPin *pin = malloc(sizeof(tPin));
+
+    if (pin == NULL)
+        err(1, "malloc() failed");
+
+    atomic_init(&pin->refs, 1);
+    pthread_mutex_init(&pin->lock, NULL);
+    pin->chunks = NULL;
+    pin->owned = true;
+    pin->mapping = NULL;
+    return pin;
+}
+
+// Add a reference to the record of the post, caller holds the board lock
+// Posts of the old generation not moved yet are pinned by its pin
+tPin *pinPost(tArena *A, tElemPtr post)
+{
+    tPin *pin = A->old != NULL && post->gen != A->gen && post->gen != STORE_GEN ? A->oldPin : A->pin;
+
+    atomic_fetch_add(&pin->refs, 1);
+    return pin;
+}
+
+// Release the reference, it can be done by any thread
+// Waiting chunks are freed when only the owner is left, the pin is freed
+// with the last reference
+void unpin(tPin *pin)
+{
+    pthread_mutex_lock(&pin->lock);
+    int refs = atomic_fetch_sub(&pin->refs, 1) - 1;
+
+    if (refs == 0 || (refs == 1 && pin->owned))
+    {
+        freeChunks(pin->chunks);
+        pin->chunks = NULL;
+    }
+    pthread_mutex_unlock(&pin->lock);
+
+    if (refs == 0)
+    {
+        releaseMapping(pin->mapping);
+        pthread_mutex_destroy(&pin->lock);
+        free(pin);
+    }
+}
+
+// Free all memory of the arena, posts and the tree at once
+// Records sent by responses stay until the responses are written
+void disposeArena(tArena *A)
+{
+    releasePin(A->pin, A->chunks);
+    if (A->oldPin != NULL)
+        releasePin(A->oldPin, A->old);
+    freeChunks(A->nodes);
+
+    A->chunks = NULL;
+    A->old = NULL;
+    A->nodes = NULL;
+    A->free = NULL;
+    A->pin = NULL;
+    A->oldPin = NULL;
+
+    free(A->leaves);
+    A->leaves = NULL;
+    A->docs = 0;
+    A->docAlloc = 0;
+}
+
+// Initialize empty index, buckets are allocated with the first term
+void initIndex(tIndex *I)
+{
+    I->chunks = NULL;
+    I->buckets = NULL;
+    I->size = 0;
+    I->terms = 0;
+    I->dead = 0;
+    I->lengths = NULL;
+    I->lengthAlloc = 0;
+    I->total = 0;
+}
+
+// Free the terms and their posting lists by the chunks
+void disposeIndex(tIndex *I)
+{
+    freeChunks(I->chunks);
+    free(I->buckets);
+    free(I->lengths);
+    initIndex(I);
+}
+
+// Space of size bytes from the chunks of the index, aligned to 8 bytes
+void *indexAlloc(tIndex *I, size_t size)
+{
+    return arenaAlloc(&I->chunks, (size + 7) & ~(size_t)7, ARENA_MIN, INDEX_CHUNK_MAX);
+}
+
+// Letters, digits and bytes of UTF-8 sequences are parts of terms
+bool termChar(char c)
+{
+    return isalnum((unsigned char)c) || (unsigned char)c >= 0x80;
+}
+
+// Get the next term of the text from pos, ASCII letters are lowercased
+// Returns the length of the term, 0 at the end of the text
+int nextTerm(const char *text, int length, int *pos, char term[])
+{
+    int i = *pos;
+    int n = 0;
+
+    while (i < length && !termChar(text[i]))
+        i++;
+
+    // Longer words are cut, the search cuts its terms the same way
+    for (; i < length && termChar(text[i]); i++)
+    {
+        if (n < TERM_MAX)
+            term[n++] = tolower((unsigned char)text[i]);
+    }
+
+    *pos = i;
+    return n;
+}
+
+// Find the posting list of the term, a new empty one is added when asked
+// Table doubles when it has more terms than buckets
+tTermPtr findTerm(tIndex *I, const char *text, int length, bool add)
+{
+    unsigned int hash = hashName(text, length);
+
+    for (tTermPtr t = I->size > 0 ? I->buckets[hash & (I->size - 1)] : NULL; t != NULL; t = t->next)
+    {
+        if (t->hash == hash && t->length == length && memcmp(t->text, text, length) == 0)
+            return t;
+    }
+
+    if (!add)
+        return NULL;
+
+    if (I->terms >= I->size)
+    {
+        int size = I->size == 0 ? TABLE_MIN : I->size * 2;
+        tTermPtr *buckets = calloc(size, sizeof(tTermPtr));
+
+        if (buckets == NULL)
+            err(1, "calloc() failed");
+
+        for (int i = 0; i < I->size; i++)
+        {
+            while (I->buckets[i] != NULL)
+            {
+                tTermPtr moved = I->buckets[i];
+                I->buckets[i] = moved->next;
+                moved->next = buckets[moved->hash & (size - 1)];
+                buckets[moved->hash & (size - 1)] = moved;
+            }
+        }
+
+        free(I->buckets);
+        I->buckets = buckets;
+        I->size = size;
+    }
+
+    tTermPtr t = indexAlloc(I, sizeof(struct tTerm));
+
+    memset(t, 0, sizeof(struct tTerm));
+    t->hash = hash;
+    t->length = length;
+    memcpy(t->text, text, length);
+    t->next = I->buckets[hash & (I->size - 1)];
+    I->buckets[hash & (I->size - 1)] = t;
+    I->terms++;
+    return t;
+}
+
+// Make room for length more bytes of postings, the list is copied
+// to twice the space
+void termReserve(tIndex *I, tTermPtr t, int length)
+{
+    if (t->size + length <= t->alloc)
+        return;
+
+    t->alloc = t->alloc == 0 ? 16 : t->alloc * 2;
+    if (t->alloc < t->size + length)
+        t->alloc = t->size + length;
+
+    unsigned char *data = indexAlloc(I, t->alloc);
+    if (t->size > 0)
+        memcpy(data, t->data, t->size);
+    t->data = data;
+}
+
+// Append the posting of the document with the count 1, documents come
+// in ascending order, every BLOCK_POSTS postings start a new block
+void termAppend(tIndex *I, tTermPtr t, unsigned int doc)
+{
+    if (t->count % BLOCK_POSTS == 0)
+    {
+        if (t->skipCount == t->skipAlloc)
+        {
+            t->skipAlloc = t->skipAlloc == 0 ? 1 : t->skipAlloc * 2;
+
+            tSkip *skips = indexAlloc(I, t->skipAlloc * sizeof(tSkip));
+            if (t->skipCount > 0)
+                memcpy(skips, t->skips, t->skipCount * sizeof(tSkip));
+            t->skips = skips;
+        }
+
+        t->skips[t->skipCount].first = doc;
+        t->skips[t->skipCount].offset = t->size;
+        t->skipCount++;
+        t->last = doc;
+    }
+
+    termReserve(I, t, 10);
+    t->size += putVarint(t->data + t->size, doc - t->last);
+    t->tail = t->size;
+    t->data[t->size++] = 1;
+    t->last = doc;
+    t->count++;
+}
+
+// Write the number by 7 bits, the high bit tells that more bytes follow
+// Returns the number of bytes written
+int putVarint(unsigned char *dest, unsigned int value)
+{
+    int n = 0;
+
+    while (value >= 0x80)
+    {
+        dest[n++] = value | 0x80;
+        value >>= 7;
+    }
+    dest[n++] = value;
+    return n;
+}
+
+// Read the number written by putVarint, pos moves behind it
+unsigned int getVarint(const unsigned char *data, int *pos)
+{
+    unsigned int value = 0;
+
+    for (int shift = 0;; shift += 7)
+    {
+        unsigned char byte = data[(*pos)++];
+        value |= (unsigned int)(byte & 0x7F) << shift;
+        if (byte < 0x80)
+            return value;
+    }
+}
+
+// Add the terms of the post of the document to the index of the board
+// Repeated term of the post increments the count of its last posting
+// Boards with the index not built yet only give out the document IDs
+void indexPost(tBoardPtr B, unsigned int doc, tElemPtr post)
+{
+    tIndex *I = &B->index;
+    char term[TERM_MAX];
+    int pos = 0;
+    int length;
+
+    if (atomic_load(&B->unindexed))
+        return;
+
+    if (doc >= I->lengthAlloc)
+    {
+        I->lengthAlloc = I->lengthAlloc == 0 ? NODE_MAX : I->lengthAlloc * 2;
+        if (I->lengthAlloc <= doc)
+            I->lengthAlloc = doc + 1;
+        if ((I->lengths = realloc(I->lengths, I->lengthAlloc * sizeof(unsigned int))) == NULL)
+            err(1, "realloc() failed");
     }
-    else
+    I->lengths[doc] = 0;
+
+    while ((length = nextTerm(post->data, post->length, &pos, term)) > 0)
     {
-        strcpy(newBoard->name, name);
-        newBoard->First = NULL;
-        newBoard->Last = NULL;
+        tTermPtr t = findTerm(I, term, length, true);
 
-        if (L->First != NULL)
+        I->lengths[doc]++;
+        I->total++;
+
+        if (t->count == 0 || t->last != doc)
         {
-            L->First->pPtr = newBoard;
+            termAppend(I, t, doc);
+            t->docs++;
+            continue;
         }
-        newBoard->nPtr = L->First;
-        newBoard->pPtr = NULL;
 
-        L->First = newBoard;
+        int end = t->tail;
+        unsigned int count = getVarint(t->data, &end) + 1;
 
-        return RQ_CREATED;
+        t->size = t->tail;
+        termReserve(I, t, 5);
+        t->size += putVarint(t->data + t->size, count);
     }
 }
 
-// Find board by name and return the pointer to it
-tBoardPtr findByName(tList *L, char name[])
+// Post of the document is gone (changed or deleted), searches skip its
+// postings until the gone documents outnumber the posts and the index is rebuilt
+// Its terms are counted out of the posts containing them, so the ranking
+// does not depend on the gone posts
+void dropDoc(tBoardPtr B, unsigned int doc, tElemPtr post)
 {
-    tBoardPtr tmp = L->First;
+    char term[TERM_MAX];
+    int pos = 0;
+    int length;
 
-    while (tmp != NULL)
+    if (!atomic_load(&B->unindexed))
     {
-        if (strcmp(tmp->name, name) == 0)
+        while ((length = nextTerm(post->data, post->length, &pos, term)) > 0)
         {
-            return tmp;
-        }
-        else
-        {
-            tmp = tmp->nPtr;
+            tTermPtr t = findTerm(&B->index, term, length, false);
+
+            if (t->gone != doc + 1)
+            {
+                t->gone = doc + 1;
+                t->docs--;
+            }
         }
+        B->index.total -= B->index.lengths[doc];
     }
 
-    return NULL;
+    B->arena.leaves[doc] = NULL;
+    B->index.dead++;
+
+    if (B->index.dead >= INDEX_MIN && B->index.dead > B->posts->size)
+        rebuildIndex(B);
 }
 
-// Find element by ID and return the pointer to it
-tElemPtr findById(tBoardPtr B, int id)
+// Index all posts of the board again, they get document IDs from 0
+// in their order, so the postings of gone posts are dropped
+// Board without the index only numbers its posts again
+void rebuildIndex(tBoardPtr B)
 {
-    int tmpId = 1;
-    tElemPtr tmp = B->First;
+    tArena *A = &B->arena;
 
-    while (tmpId != id)
-    {
-        tmp = tmp->nPtr;
-        tmpId++;
+    disposeIndex(&B->index);
+    A->docs = 0;
 
-        if (tmp == NULL)
+    for (tNodePtr leaf = treeFirst(B->posts); leaf != NULL; leaf = leaf->next)
+    {
+        for (int i = 0; i < leaf->count; i++)
         {
-            return NULL;
+            leaf->docs[i] = newDoc(A);
+            A->leaves[leaf->docs[i]] = leaf;
+            indexPost(B, leaf->docs[i], leaf->items[i]);
         }
     }
-
-    return tmp;
 }
 
-// Create new post
-int newPost(tList *L, char name[], char content[])
+// Move to the next posting of the list, returns false at its end
+bool cursorNext(tCursor *c)
 {
-    tBoardPtr tmp = findByName(L, name);
+    tTermPtr t = c->term;
 
-    if (tmp == NULL)
+    if (c->pos >= c->end)
     {
-        return RQ_NOT_FOUND;
+        if (++c->block >= t->skipCount)
+        {
+            c->block = t->skipCount;
+            return false;
+        }
+
+        c->pos = t->skips[c->block].offset;
+        c->end = c->block + 1 < t->skipCount ? t->skips[c->block + 1].offset : t->size;
+        c->doc = t->skips[c->block].first;
     }
 
-    tElemPtr newPost = malloc(sizeof(struct tElem));
+    c->doc += getVarint(t->data, &c->pos);
+    c->count = getVarint(t->data, &c->pos);
+    return true;
+}
 
-    if (newPost == NULL)
-    {
-        disposeList(L);
-        fprintf(stderr, "Malloc error!");
-        exit(1);
-    }
-    else
+// Move to the first posting of the document or a larger one
+// Blocks starting at or before the document are found by binary search
+// of the skips, only the last of them is decoded
+// Returns false when the list has no such posting
+bool cursorSeek(tCursor *c, unsigned int doc)
+{
+    tTermPtr t = c->term;
+
+    if (c->block >= t->skipCount)
+        return false;
+    if (c->block >= 0 && c->doc >= doc)
+        return true;
+
+    int low = c->block + 1;
+    int high = t->skipCount - 1;
+    int found = -1;
+
+    while (low <= high)
     {
-        strcpy(newPost->data, content);
-        newPost->nPtr = NULL;
+        int mid = (low + high) / 2;
 
-        if (tmp->First == NULL)
+        if (t->skips[mid].first <= doc)
         {
-            tmp->First = newPost;
-            tmp->Last = newPost;
-            newPost->pPtr = NULL;
+            found = mid;
+            low = mid + 1;
         }
         else
         {
-            newPost->pPtr = tmp->Last;
-            tmp->Last->nPtr = newPost;
-            tmp->Last = newPost;
+            high = mid - 1;
         }
+    }
 
-        return RQ_CREATED;
+    // Continue from the start of the found block
+    if (found != -1)
+    {
+        c->block = found - 1;
+        c->pos = c->end = 0;
+    }
+
+    while (cursorNext(c))
+    {
+        if (c->doc >= doc)
+            return true;
     }
+
+    return false;
 }
 
-// Delete board
-int deleteBoard(tList *L, char name[])
+// Search the boards of the list (or the one of the query) for the posts
+// containing all terms, the best hits are appended to the string as records
+// of their score and line after the count of all matching posts, so the
+// records of more shards can be merged by searchResponse
+int searchPosts(tList *L, tQuery *q, string *str)
 {
-    tBoardPtr tmp = findByName(L, name);
+    tHits hits;
+    tBoardPtr B;
 
-    if (tmp == NULL)
-    {
-        return RQ_NOT_FOUND;
-    }
+    hits.hits = malloc(q->limit * sizeof(tHit));
+    hits.lines = malloc(q->limit * sizeof(string));
+    if (hits.hits == NULL || hits.lines == NULL)
+        err(1, "malloc() failed");
+    hits.count = 0;
+    hits.limit = q->limit;
+    hits.matched = 0;
+    strInit(&hits.scratch);
 
-    if (tmp == L->First)
+    lockList(L, false);
+
+    if (q->board[0] != '\0')
     {
-        L->First = tmp->nPtr;
-    }
+        if ((B = findByName(L, q->board)) == NULL)
+        {
+            unlockList(L);
+            strFree(&hits.scratch);
+            free(hits.hits);
+            free(hits.lines);
+            return RQ_NOT_FOUND;
+        }
 
-    tBoardPtr next = tmp->nPtr;
-    tBoardPtr prev = tmp->pPtr;
+        if (!lockSearch(L, B))
+        {
+            unlockList(L);
+            strFree(&hits.scratch);
+            free(hits.hits);
+            free(hits.lines);
+            return RQ_BROKEN;
+        }
 
-    if (tmp->pPtr != NULL)
+        searchBoard(B, q, &hits);
+        unlockBoard(L, B);
+    }
+    else
     {
-        tmp->pPtr->nPtr = next;
+        // Broken boards are left out, the others are searched
+        for (B = L->First; B != NULL; B = B->nPtr)
+        {
+            if (!lockSearch(L, B))
+                continue;
+
+            searchBoard(B, q, &hits);
+            unlockBoard(L, B);
+        }
     }
 
-    if (tmp->nPtr != NULL)
+    unlockList(L);
+
+    strAddChar(str, 'N');
+    strAddData(str, (char *)&hits.matched, sizeof(int));
+
+    for (int i = 0; i < hits.count; i++)
     {
-        tmp->nPtr->pPtr = prev;
+        strAddChar(str, 'H');
+        strAddData(str, (char *)&hits.hits[i].key, sizeof(uint64_t));
+        strAddData(str, (char *)&hits.hits[i].length, sizeof(int));
+        strAddData(str, hits.hits[i].line, hits.hits[i].length);
+        strFree(&hits.lines[i]);
     }
 
-    disposeBoard(tmp);
-
+    strFree(&hits.scratch);
+    free(hits.hits);
+    free(hits.lines);
     return RQ_OK;
 }
 
-// Get all boards
-int getBoards(tList *L, string *str)
+// Lock the board for the search, the index of the stored posts is built first
+// Returns false without the lock when the board is broken
+bool lockSearch(tList *L, tBoardPtr B)
 {
-    strClear(str);
-    tBoardPtr tmp = L->First;
+    if (atomic_load(&B->unloaded) || atomic_load(&B->unindexed))
+        buildIndex(L, B);
 
-    if (tmp == NULL)
-    {
-        return RQ_NOT_FOUND;
-    }
+    return lockBoard(L, B, false);
+}
 
-    while (tmp != NULL)
+// Index the stored posts on the first search of the board
+// The search waits for it under the board write lock, it tokenizes all posts
+// of the board, so the first search after the start pays for the boards
+// it searches
+void buildIndex(tList *L, tBoardPtr B)
+{
+    if (!lockBoard(L, B, true))
+        return;
+
+    if (atomic_load(&B->unindexed))
     {
-        string_concat(str, tmp->name);
-        string_concat(str, "\n");
-        tmp = tmp->nPtr;
+        atomic_store(&B->unindexed, false);
+        rebuildIndex(B);
     }
 
-    return RQ_OK;
+    unlockBoard(L, B);
 }
 
-// Get all posts with IDs
-int getPosts(tList *L, char name[], string *str)
+// Add the posts of the board containing all terms to the hits, caller
+// holds the board lock
+// Posting lists are intersected from the shortest one, the others skip to
+// its documents and it skips to theirs, so the work depends on the rarest
+// term, not on the size of the board
+// Hits are ranked by BM25 with the statistics of the board
+void searchBoard(tBoardPtr B, tQuery *q, tHits *hits)
 {
-    tBoardPtr tmp = findByName(L, name);
-    if (tmp == NULL)
+    tCursor cursors[MAX_TERMS];
+    double weights[MAX_TERMS];
+    int size = B->posts->size;
+    int n = q->count;
+
+    if (size == 0)
+        return;
+
+    // Cursors are sorted by the length of their lists
+    for (int i = 0; i < n; i++)
     {
-        return RQ_NOT_FOUND;
-    }
+        tTermPtr t = findTerm(&B->index, q->terms[i], q->lengths[i], false);
+        int j = i;
 
-    char tmpName[23];
-    sprintf(tmpName, "[%s]\n", name);
-    string_concat(str, tmpName);
+        if (t == NULL || t->docs == 0)
+            return;
+
+        while (j > 0 && cursors[j - 1].term->count > t->count)
+        {
+            cursors[j] = cursors[j - 1];
+            j--;
+        }
+
+        cursors[j].term = t;
+        cursors[j].block = -1;
+        cursors[j].pos = cursors[j].end = 0;
+    }
 
-    tElemPtr post = tmp->First;
+    // Terms of fewer posts weigh more
+    for (int i = 0; i < n; i++)
+        weights[i] = log(1 + (size - cursors[i].term->docs + 0.5) / (cursors[i].term->docs + 0.5));
 
-    int id = 1;
-    char cId[10];
+    double average = (double)B->index.total / size;
+    bool more = cursorNext(&cursors[0]);
 
-    // Append ID s to posts
-    while (post != NULL)
+    while (more)
     {
-        sprintf(cId, "%d", id);
-        string_concat(str, cId);
-        string_concat(str, ". ");
-        string_concat(str, post->data);
-        string_concat(str, "\n");
+        unsigned int doc = cursors[0].doc;
+        int i;
 
-        id++;
-        post = post->nPtr;
-    }
+        for (i = 1; i < n; i++)
+        {
+            if (!cursorSeek(&cursors[i], doc))
+                return;
+            if (cursors[i].doc != doc)
+                break;
+        }
 
-    return RQ_OK;
+        // Another list does not have the document, the next one to try is its
+        if (i < n)
+        {
+            more = cursorSeek(&cursors[0], cursors[i].doc);
+            continue;
+        }
+
+        tNodePtr leaf = B->arena.leaves[doc];
+
+        if (leaf != NULL)
+        {
+            int index = 0;
+            while (leaf->docs[index] != doc)
+                index++;
+
+            double norm = BM25_K1 * (1 - BM25_B + BM25_B * B->index.lengths[doc] / (average > 0 ? average : 1));
+            double score = 0;
+
+            for (i = 0; i < n; i++)
+                score += weights[i] * cursors[i].count * (BM25_K1 + 1) / (cursors[i].count + norm);
+
+            hits->matched++;
+            addHit(hits, B, leaf, index, (uint64_t)(score * 1000000));
+        }
+
+        more = cursorNext(&cursors[0]);
+    }
 }
 
-// Change post content
-int changePost(tList *L, char name[], int id, char content[])
+// Keep the post if it is better than the worst kept hit
+void addHit(tHits *hits, tBoardPtr B, tNodePtr leaf, int index, uint64_t key)
 {
-    tBoardPtr tmp = findByName(L, name);
-    if (tmp == NULL)
+    tElemPtr post = leaf->items[index];
+    char number[MAX_NAME + 16];
+    int slot;
+
+    if (hits->count == hits->limit && key < hits->hits[0].key)
+        return;
+
+    strClear(&hits->scratch);
+    strAddData(&hits->scratch, number, sprintf(number, "%s/%d. ", B->name, leafPosition(leaf) + index + 1));
+    strAddData(&hits->scratch, post->data, post->length);
+
+    tHit hit = {key, hits->scratch.str, hits->scratch.length};
+
+    if (hits->count < hits->limit)
     {
-        return RQ_NOT_FOUND;
+        slot = hits->count++;
+        strInit(&hits->lines[slot]);
     }
-
-    tElemPtr post = findById(tmp, id);
-    if (post == NULL)
+    else if (compareHits(&hit, &hits->hits[0]) < 0)
     {
-        return RQ_NOT_FOUND;
+        slot = 0;
+    }
+    else
+    {
+        return;
     }
 
-    sprintf(post->data, content);
+    // Line of the hit takes the buffer of the candidate, the replaced
+    // line becomes the next candidate
+    string line = hits->lines[slot];
+    hits->lines[slot] = hits->scratch;
+    hits->scratch = line;
+    hits->hits[slot] = hit;
 
-    return RQ_OK;
+    if (slot == 0)
+        hitDown(hits, 0);
+    else
+        hitUp(hits, slot);
 }
 
-// Delete post
-int deletePost(tList *L, char name[], int id)
+// Move the hit up while it is worse than its parent
+void hitUp(tHits *hits, int i)
 {
-    tBoardPtr tmp = findByName(L, name);
-    if (tmp == NULL)
+    while (i > 0 && compareHits(&hits->hits[i], &hits->hits[(i - 1) / 2]) > 0)
     {
-        return RQ_NOT_FOUND;
+        swapHits(hits, i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
+}
 
-    tElemPtr post = findById(tmp, id);
-    if (post == NULL)
+// Move the hit down while a child is worse
+void hitDown(tHits *hits, int i)
+{
+    while (2 * i + 1 < hits->count)
     {
-        return RQ_NOT_FOUND;
-    }
+        int child = 2 * i + 1;
 
-    if (post == tmp->First)
-    {
-        tmp->First = post->nPtr;
-    }
+        if (child + 1 < hits->count && compareHits(&hits->hits[child + 1], &hits->hits[child]) > 0)
+            child++;
+        if (compareHits(&hits->hits[child], &hits->hits[i]) <= 0)
+            return;
 
-    if (post == tmp->Last)
-    {
-        tmp->Last = post->pPtr;
+        swapHits(hits, i, child);
+        i = child;
     }
+}
 
-    tElemPtr next = post->nPtr;
-    tElemPtr prev = post->pPtr;
+// Swap two hits of the heap with their lines
+void swapHits(tHits *hits, int i, int j)
+{
+    tHit hit = hits->hits[i];
+    string line = hits->lines[i];
 
-    if (post->pPtr != NULL)
-    {
-        post->pPtr->nPtr = next;
-    }
+    hits->hits[i] = hits->hits[j];
+    hits->lines[i] = hits->lines[j];
+    hits->hits[j] = hit;
+    hits->lines[j] = line;
+}
 
-    if (post->nPtr != NULL)
-    {
-        post->nPtr->pPtr = prev;
-    }
+// Order of the hits, the better first, equal scores by their lines
+int compareHits(const void *a, const void *b)
+{
+    const tHit *x = a;
+    const tHit *y = b;
 
-    free(post);
+    if (x->key != y->key)
+        return x->key > y->key ? -1 : 1;
 
-    return RQ_OK;
+    int n = memcmp(x->line, y->line, x->length < y->length ? x->length : y->length);
+    return n != 0 ? n : x->length - y->length;
 }
 
-// Free the list of boards
-void disposeList(tList *L)
+// Merge the hit records of searchPosts (of all shards), the best
+// ?limit= of them become the body, one line per hit
+// X-Search-Hits tells the number of all posts containing the terms
+int searchResponse(tRqst *rqst, string *hits, string *body)
 {
-    tBoardPtr tmp;
+    tHit *all = NULL;
+    int count = 0;
+    int alloc = 0;
+    int matched = 0;
+    int pos = 0;
 
-    while (L->First != NULL)
+    while (pos < hits->length)
     {
-        tmp = L->First;
+        int value;
 
-        if (tmp->First != NULL)
+        if (hits->str[pos++] == 'N')
         {
-            disposeBoard(tmp);
+            memcpy(&value, hits->str + pos, sizeof(int));
+            matched += value;
+            pos += sizeof(int);
+            continue;
         }
 
-        L->First = L->First->nPtr;
-        free(tmp);
+        if (count == alloc)
+        {
+            alloc = alloc == 0 ? SEARCH_LIMIT : alloc * 2;
+            if ((all = realloc(all, alloc * sizeof(tHit))) == NULL)
+                err(1, "realloc() failed");
+        }
+
+        memcpy(&all[count].key, hits->str + pos, sizeof(uint64_t));
+        memcpy(&all[count].length, hits->str + pos + sizeof(uint64_t), sizeof(int));
+        pos += sizeof(uint64_t) + sizeof(int);
+        all[count].line = hits->str + pos;
+        pos += all[count].length;
+        count++;
     }
-}
 
-// Free the list of posts(board items)
-void disposeBoard(tBoardPtr B)
-{
-    tElemPtr tmp;
+    if (count > 1)
+        qsort(all, count, sizeof(tHit), compareHits);
 
-    while (B->First != NULL)
+    strClear(body);
+    for (int i = 0; i < count && i < rqst->window.limit; i++)
     {
-        tmp = B->First;
-
-        B->First = B->First->nPtr;
-        free(tmp);
+        strAddData(body, all[i].line, all[i].length);
+        strAddChar(body, '\n');
     }
+
+    free(all);
+    sprintf(rqst->extra, "X-Search-Hits: %d\r\n", matched);
+    return RQ_OK;
 }
 
 // Function initializes the string
@@ -890,31 +8291,182 @@ int strInit(string *s)
     s->str[0] = '\0';
     s->length = 0;
     s->allocSize = STR_LEN_INC;
+    s->refs = NULL;
+    s->refCount = 0;
+    s->refAlloc = 0;
+    s->refLength = 0;
     return STR_SUCCESS;
 }
 
 // Function frees all resources used by the string
 void strFree(string *s)
 {
+    strClear(s);
+    free(s->refs);
     free(s->str);
 }
 
 // Function clears string data and returns it to after-init state
+// References are released
 void strClear(string *s)
 {
+    for (int i = 0; i < s->refCount; i++)
+        unpin(s->refs[i].pin);
+
     s->str[0] = '\0';
     s->length = 0;
+    s->refCount = 0;
+    s->refLength = 0;
 }
 
-//  Function appends a character to the string
-int strAddChar(string *s1, char c)
+// Function makes room for length more bytes and the '\0'
+// Size is doubled, so appending n bytes copies O(n) bytes in total
+int strReserve(string *s, int length)
+{
+    int size = s->allocSize;
+
+    if (s->length + length + 1 <= size)
+        return STR_SUCCESS;
+
+    while (size < s->length + length + 1)
+        size *= 2;
+
+    char *str = (char *)realloc(s->str, size);
+    if (str == NULL)
+        return STR_ERROR;
+
+    s->str = str;
+    s->allocSize = size;
+    return STR_SUCCESS;
+}
+
+// Function appends a reference to the data, the string takes the pin
+int strAddRef(string *s, const char *data, int length, tPin *pin)
+{
+    if (s->refCount == s->refAlloc)
+    {
+        int size = s->refAlloc == 0 ? STR_LEN_INC : s->refAlloc * 2;
+        tRef *refs = realloc(s->refs, size * sizeof(tRef));
+        if (refs == NULL)
+            return STR_ERROR;
+        s->refs = refs;
+        s->refAlloc = size;
+    }
+
+    s->refs[s->refCount].at = s->length;
+    s->refs[s->refCount].data = data;
+    s->refs[s->refCount].length = length;
+    s->refs[s->refCount].pin = pin;
+    s->refCount++;
+    s->refLength += length;
+    return STR_SUCCESS;
+}
+
+// Function copies the data of the string with its references to dest
+void strFlatten(string *s, char *dest)
+{
+    int pos = 0;
+
+    for (int i = 0; i < s->refCount; i++)
+    {
+        memcpy(dest, s->str + pos, s->refs[i].at - pos);
+        dest += s->refs[i].at - pos;
+        pos = s->refs[i].at;
+
+        memcpy(dest, s->refs[i].data, s->refs[i].length);
+        dest += s->refs[i].length;
+    }
+
+    memcpy(dest, s->str + pos, s->length - pos);
+}
+
+// Function copies the data of the references into the string itself,
+// so the string can be read through str and length, the pins are released
+int strMerge(string *s)
+{
+    if (s->refCount == 0)
+        return STR_SUCCESS;
+
+    int size = s->allocSize;
+    while (size < s->length + s->refLength + 1)
+        size *= 2;
+
+    char *str = (char *)malloc(size);
+    if (str == NULL)
+        return STR_ERROR;
+
+    strFlatten(s, str);
+    int length = s->length + s->refLength;
+    str[length] = '\0';
+
+    for (int i = 0; i < s->refCount; i++)
+        unpin(s->refs[i].pin);
+
+    free(s->str);
+    s->str = str;
+    s->length = length;
+    s->allocSize = size;
+    s->refCount = 0;
+    s->refLength = 0;
+    return STR_SUCCESS;
+}
+
+// Function appends the second string with its references to the first one
+// References are moved, the second string keeps only its data
+int strAppend(string *s1, string *s2)
 {
-    if (s1->length + 1 >= s1->allocSize)
+    for (int i = 0; i < s2->refCount; i++)
     {
-        if ((s1->str = (char *)realloc(s1->str, s1->length + STR_LEN_INC)) == NULL)
+        if (strAddRef(s1, s2->refs[i].data, s2->refs[i].length, s2->refs[i].pin) != STR_SUCCESS)
             return STR_ERROR;
-        s1->allocSize = s1->length + STR_LEN_INC;
+        s1->refs[s1->refCount - 1].at += s2->refs[i].at;
+    }
+
+    s2->refCount = 0;
+    s2->refLength = 0;
+    return strAddData(s1, s2->str, s2->length);
+}
+
+// Append the text as a JSON string, quotes, backslashes and control
+// characters are escaped, other bytes are copied
+void strAddJson(string *str, const char *data, int length)
+{
+    int start = 0;
+    char escape[8];
+
+    strAddChar(str, '"');
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char c = data[i];
+
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        strAddData(str, data + start, i - start);
+        start = i + 1;
+
+        if (c == '"' || c == '\\')
+            strAddData(str, escape, sprintf(escape, "\\%c", c));
+        else if (c == '\n')
+            strAddData(str, "\\n", 2);
+        else if (c == '\r')
+            strAddData(str, "\\r", 2);
+        else if (c == '\t')
+            strAddData(str, "\\t", 2);
+        else
+            strAddData(str, escape, sprintf(escape, "\\u%04x", c));
     }
+
+    strAddData(str, data + start, length - start);
+    strAddChar(str, '"');
+}
+
+//  Function appends a character to the string
+int strAddChar(string *s1, char c)
+{
+    if (strReserve(s1, 1) != STR_SUCCESS)
+        return STR_ERROR;
     s1->str[s1->length] = c;
     s1->length++;
     s1->str[s1->length] = '\0';
@@ -924,14 +8476,44 @@ int strAddChar(string *s1, char c)
 // Function concatenates string with an array of characters
 int *string_concat(string *s1, const char *s2)
 {
-    int length_const_char = strlen(s2);
-    if ((s1->length + length_const_char + 1) >= s1->allocSize)
+    strAddData(s1, s2, strlen(s2));
+    return STR_SUCCESS;
+}
+
+// Function appends length bytes of data to the string
+int strAddData(string *s1, const char *data, int length)
+{
+    if (strReserve(s1, length) != STR_SUCCESS)
+        return STR_ERROR;
+    memcpy(&s1->str[s1->length], data, length);
+    s1->length += length;
+    s1->str[s1->length] = '\0';
+    return STR_SUCCESS;
+}
+
+// Take an empty buffer from the pool of the loop, new one when it is empty
+void poolGet(tLoop *loop, string *s)
+{
+    if (loop->poolCount > 0)
     {
-        s1->str = (char *)realloc(s1->str, s1->length + length_const_char + 1);
+        *s = loop->pool[--loop->poolCount];
+        strClear(s);
     }
-    strncpy(&s1->str[s1->length], s2, length_const_char);
-    s1->str[s1->length + length_const_char] = '\0';
-    s1->allocSize = s1->length + length_const_char;
-    s1->length += length_const_char;
-    return STR_SUCCESS;
+    else if (strInit(s) != STR_SUCCESS)
+    {
+        err(1, "malloc() failed");
+    }
+}
+
+// Return the buffer to the pool of the loop
+// Buffers grown by large responses are freed, so they do not stay allocated
+void poolPut(tLoop *loop, string *s)
+{
+    if (loop->poolCount < POOL_SIZE && s->allocSize <= POOL_MAX_ALLOC)
+    {
+        strClear(s);
+        loop->pool[loop->poolCount++] = *s;
+    }
+    else
+        strFree(s);
 }